@@ -0,0 +1,333 @@
+//! Benchmarks of the ffmpeg_ram path that run on a machine without a GPU.
+//!
+//! cargo bench --bench ram
+//!
+//! HWCODEC_BENCH_ENCODER       h264 software encoder, default libx264
+//! HWCODEC_BENCH_HEVC_ENCODER  h265 software encoder, default libx265
+//! HWCODEC_BENCH_FRAMES        measured iterations per case, default 300
+//! HWCODEC_BENCH_JSON          also write the results as json to this path
+//! HWCODEC_BENCH_REPLAY        also decode this mp4 / mkv / raw recording
+//!
+//! Allocations are counted by the global allocator, so only the allocations
+//! made on the rust side are reported.
+
+use hwcodec::{
+    common::{DataFormat, Quality::*, RateControl::*},
+    demux::Demuxer,
+    ffmpeg::{AVHWDeviceType::*, AVPixelFormat},
+    ffmpeg_ram::{
+        decode::{DecodeContext, Decoder},
+        encode::{EncodeContext, Encoder},
+        ffmpeg_linesize_offset_length,
+    },
+    mux::{MuxContext, Muxer},
+    nal::Parser,
+};
+use serde_derive::Serialize;
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    env,
+    sync::atomic::{AtomicU64, Ordering},
+    time::{Duration, Instant},
+};
+
+const WIDTH: usize = 1280;
+const HEIGHT: usize = 720;
+const FPS: i32 = 30;
+const GOP: i32 = 60;
+// a multiple of GOP, so replaying the stream always restarts at a keyframe
+const STREAM_FRAMES: usize = 120;
+const WARMUP: usize = 30;
+
+// single IDR frames, used when no software encoder of the format is available
+const SAMPLE_H264: &[u8] = include_bytes!("../src/res/720p.h264");
+const SAMPLE_H265: &[u8] = include_bytes!("../src/res/720p.h265");
+
+struct CountingAlloc;
+
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+#[derive(Debug, Serialize)]
+struct Report {
+    name: String,
+    iterations: usize,
+    mean_us: f64,
+    p50_us: f64,
+    p99_us: f64,
+    p999_us: f64,
+    frames_per_sec: f64,
+    bytes_per_sec: f64,
+    allocs_per_frame: f64,
+}
+
+impl std::fmt::Display for Report {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(
+            f,
+            "{:<36} p50 {:>9.1}us  p99 {:>9.1}us  p999 {:>9.1}us  {:>9.1} fps  {:>8.2} MB/s  {:>6.1} allocs",
+            self.name,
+            self.p50_us,
+            self.p99_us,
+            self.p999_us,
+            self.frames_per_sec,
+            self.bytes_per_sec / 1e6,
+            self.allocs_per_frame
+        )
+    }
+}
+
+// Runs `f` WARMUP times untimed, then `iterations` times timed. `f` gets the
+// iteration index and returns the number of bytes it processed.
+fn run<F: FnMut(usize) -> usize>(name: &str, iterations: usize, mut f: F) -> Report {
+    for i in 0..WARMUP {
+        f(i);
+    }
+    let mut samples = Vec::with_capacity(iterations);
+    let mut bytes = 0;
+    let allocs = ALLOCATIONS.load(Ordering::Relaxed);
+    let total = Instant::now();
+    for i in WARMUP..WARMUP + iterations {
+        let start = Instant::now();
+        bytes += f(i);
+        samples.push(start.elapsed());
+    }
+    let total = total.elapsed().as_secs_f64();
+    let allocs = ALLOCATIONS.load(Ordering::Relaxed) - allocs;
+
+    samples.sort();
+    let percentile = |p: f64| -> f64 {
+        let index = ((samples.len() - 1) as f64 * p).round() as usize;
+        samples[index].as_secs_f64() * 1e6
+    };
+    let report = Report {
+        name: name.to_owned(),
+        iterations,
+        mean_us: samples.iter().sum::<Duration>().as_secs_f64() * 1e6 / iterations as f64,
+        p50_us: percentile(0.5),
+        p99_us: percentile(0.99),
+        p999_us: percentile(0.999),
+        frames_per_sec: iterations as f64 / total,
+        bytes_per_sec: bytes as f64 / total,
+        allocs_per_frame: allocs as f64 / iterations as f64,
+    };
+    println!("{}", report);
+    report
+}
+
+fn main() {
+    let iterations = env::var("HWCODEC_BENCH_FRAMES")
+        .ok()
+        .and_then(|s| s.parse().ok())
+        .unwrap_or(300);
+    let h264_encoder = env::var("HWCODEC_BENCH_ENCODER").unwrap_or("libx264".to_owned());
+    let h265_encoder = env::var("HWCODEC_BENCH_HEVC_ENCODER").unwrap_or("libx265".to_owned());
+    let yuvs = prepare_yuv(STREAM_FRAMES);
+    let mut reports = vec![];
+
+    reports.push(run("linesize_offset_length", iterations, |_| {
+        ffmpeg_linesize_offset_length(AVPixelFormat::AV_PIX_FMT_YUV420P, WIDTH, HEIGHT, 0).unwrap();
+        0
+    }));
+
+    let mut streams = vec![];
+    for (encoder, sample, is265) in [
+        (h264_encoder, SAMPLE_H264, false),
+        (h265_encoder, SAMPLE_H265, true),
+    ] {
+        let stream = match Encoder::new(encode_context(&encoder)) {
+            Ok(mut encoder_) => {
+                reports.push(run(&format!("encode/{}", encoder), iterations, |i| {
+                    let yuv = &yuvs[i % yuvs.len()];
+                    encoder_.encode(yuv, i as _).unwrap();
+                    yuv.len()
+                }));
+                let mut encoder_ = Encoder::new(encode_context(&encoder)).unwrap();
+                reports.push(run(
+                    &format!("encode_packets/{}", encoder),
+                    iterations,
+                    |i| {
+                        let yuv = &yuvs[i % yuvs.len()];
+                        encoder_.encode_packets(yuv, i as _).unwrap();
+                        yuv.len()
+                    },
+                ));
+                encode_stream(&encoder, &yuvs)
+            }
+            Err(_) => {
+                println!("{} unavailable, decoding a single IDR frame", encoder);
+                vec![(sample.to_vec(), true)]
+            }
+        };
+        streams.push((stream, is265));
+    }
+
+    for (stream, is265) in streams.iter() {
+        let name = if *is265 { "hevc" } else { "h264" };
+        let ctx = DecodeContext {
+            name: name.to_owned(),
+            device_type: AV_HWDEVICE_TYPE_NONE,
+            thread_count: 4,
+            output: None,
+        };
+        let mut decoder = Decoder::new(ctx.clone()).unwrap();
+        reports.push(run(&format!("decode/{}", name), iterations, |i| {
+            let (packet, _) = &stream[i % stream.len()];
+            decoder.decode(packet).unwrap();
+            packet.len()
+        }));
+        let mut decoder = Decoder::new(ctx).unwrap();
+        reports.push(run(&format!("decode_frames/{}", name), iterations, |i| {
+            let (packet, _) = &stream[i % stream.len()];
+            decoder.decode_frames(packet).unwrap();
+            packet.len()
+        }));
+        let mut parser = Parser::new(*is265).unwrap();
+        reports.push(run(&format!("nal/{}", name), iterations, |i| {
+            let (packet, _) = &stream[i % stream.len()];
+            parser.parse(packet);
+            packet.len()
+        }));
+
+        let filename = env::temp_dir().join(format!("hwcodec_bench_{}.mp4", name));
+        let mut muxer = Muxer::new(MuxContext {
+            filename: filename.to_string_lossy().to_string(),
+            width: WIDTH,
+            height: HEIGHT,
+            is265: *is265,
+            framerate: FPS as _,
+        })
+        .unwrap();
+        reports.push(run(&format!("mux/{}", name), iterations, |i| {
+            let (packet, key) = &stream[i % stream.len()];
+            muxer.write_video(packet, *key).unwrap();
+            packet.len()
+        }));
+        muxer.write_tail().ok();
+        drop(muxer);
+
+        let mut demuxer = Demuxer::from_memory(std::fs::read(&filename).unwrap()).unwrap();
+        reports.push(run(&format!("demux/{}", name), iterations, |_| {
+            next_packet(&mut demuxer, |packet| packet.len())
+        }));
+        std::fs::remove_file(filename).ok();
+    }
+
+    if let Ok(path) = env::var("HWCODEC_BENCH_REPLAY") {
+        if let Some(report) = replay(&path, iterations) {
+            reports.push(report);
+        }
+    }
+
+    if let Ok(path) = env::var("HWCODEC_BENCH_JSON") {
+        let json = serde_json::to_string_pretty(&reports).unwrap();
+        std::fs::write(&path, json).unwrap();
+        println!("results written to {}", path);
+    }
+}
+
+// Passes the next packet to `f`, starting over at the end of the file.
+fn next_packet<F: FnMut(&[u8]) -> usize>(demuxer: &mut Demuxer, mut f: F) -> usize {
+    if let Some(packet) = demuxer.read().unwrap() {
+        return f(packet.data);
+    }
+    demuxer.rewind().unwrap();
+    f(demuxer.read().unwrap().unwrap().data)
+}
+
+// Decode throughput of a real recording, loaded into memory first so the
+// disk doesn't count.
+fn replay(path: &str, iterations: usize) -> Option<Report> {
+    let mut demuxer = Demuxer::from_memory(std::fs::read(path).ok()?).ok()?;
+    let name = match demuxer.info.format {
+        Some(DataFormat::H264) => "h264",
+        Some(DataFormat::H265) => "hevc",
+        _ => {
+            println!("{}: unsupported codec", path);
+            return None;
+        }
+    };
+    let mut decoder = Decoder::new(DecodeContext {
+        name: name.to_owned(),
+        device_type: AV_HWDEVICE_TYPE_NONE,
+        thread_count: 4,
+        output: None,
+    })
+    .ok()?;
+    Some(run(&format!("replay/{}", name), iterations, |_| {
+        next_packet(&mut demuxer, |packet| {
+            decoder.decode(packet).ok();
+            packet.len()
+        })
+    }))
+}
+
+fn encode_context(name: &str) -> EncodeContext {
+    EncodeContext {
+        name: name.to_owned(),
+        mc_name: None,
+        width: WIDTH as _,
+        height: HEIGHT as _,
+        pixfmt: AVPixelFormat::AV_PIX_FMT_YUV420P,
+        align: 0,
+        kbs: 2000,
+        fps: FPS,
+        gop: GOP,
+        quality: Quality_Default,
+        rc: RC_DEFAULT,
+        thread_count: 4,
+        q: -1,
+        intra_refresh: None,
+    }
+}
+
+fn encode_stream(name: &str, yuvs: &Vec<Vec<u8>>) -> Vec<(Vec<u8>, bool)> {
+    let mut encoder = Encoder::new(encode_context(name)).unwrap();
+    let mut stream = vec![];
+    for (i, yuv) in yuvs.iter().enumerate() {
+        for frame in encoder.encode(yuv, i as _).unwrap() {
+            stream.push((frame.data.to_vec(), frame.key == 1));
+        }
+    }
+    stream
+}
+
+// A moving gradient with some noise, deterministic so runs are comparable.
+fn prepare_yuv(count: usize) -> Vec<Vec<u8>> {
+    let mut seed: u32 = 0x12345678;
+    let mut noise = move || {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        (seed & 0x0f) as u8
+    };
+    (0..count)
+        .map(|i| {
+            let mut yuv = vec![128u8; WIDTH * HEIGHT * 3 / 2];
+            for y in 0..HEIGHT {
+                for x in 0..WIDTH {
+                    yuv[y * WIDTH + x] = ((x + y + i * 4) as u8).wrapping_add(noise());
+                }
+            }
+            yuv
+        })
+        .collect()
+}
@@ -34,6 +34,18 @@ fn build_common(builder: &mut Build) {
         .unwrap()
         .write_to_file(Path::new(&env::var_os("OUT_DIR").unwrap()).join("common_ffi.rs"))
         .unwrap();
+    bindgen::builder()
+        .header(common_dir.join("nal_ffi.h").to_string_lossy().to_string())
+        .generate()
+        .unwrap()
+        .write_to_file(Path::new(&env::var_os("OUT_DIR").unwrap()).join("nal_ffi.rs"))
+        .unwrap();
+    bindgen::builder()
+        .header(common_dir.join("color_ffi.h").to_string_lossy().to_string())
+        .generate()
+        .unwrap()
+        .write_to_file(Path::new(&env::var_os("OUT_DIR").unwrap()).join("color_ffi.rs"))
+        .unwrap();
 
     // system
     #[cfg(windows)]
@@ -73,7 +85,19 @@ fn build_common(builder: &mut Build) {
     }
 
     // tool
-    builder.files(["log.cpp", "util.cpp"].map(|f| common_dir.join(f)));
+    builder.files(
+        [
+            "log.cpp",
+            "util.cpp",
+            "cpu.cpp",
+            "color_convert.cpp",
+            "frame_compare.cpp",
+            "nal.cpp",
+        ]
+        .map(|f| common_dir.join(f)),
+    );
+    #[cfg(feature = "profile")]
+    builder.define("CFG_PROFILE", None);
 }
 
 #[derive(Debug)]
@@ -154,7 +178,7 @@ mod ffmpeg {
             )
         );
         {
-            let mut static_libs = vec!["avcodec", "avutil", "avformat"];
+            let mut static_libs = vec!["avcodec", "swscale", "avutil", "avformat"];
             if target_os == "windows" {
                 static_libs.push("libmfx");
             }
@@ -271,7 +295,16 @@ mod ffmpeg {
             .write_to_file(Path::new(&env::var_os("OUT_DIR").unwrap()).join("mux_ffi.rs"))
             .unwrap();
 
-        builder.files(["mux.cpp"].map(|f| mux_dir.join(f)));
+        let demux_header = mux_dir.join("demux_ffi.h").to_string_lossy().to_string();
+        bindgen::builder()
+            .header(demux_header)
+            .rustified_enum("*")
+            .generate()
+            .unwrap()
+            .write_to_file(Path::new(&env::var_os("OUT_DIR").unwrap()).join("demux_ffi.rs"))
+            .unwrap();
+
+        builder.files(["mux.cpp", "demux.cpp"].map(|f| mux_dir.join(f)));
     }
 }
 
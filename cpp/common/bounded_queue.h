@@ -0,0 +1,103 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// Fixed capacity FIFO shared between pipeline stages. Slots are allocated once
+// in the constructor, so pushing and popping never allocate.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : items_(capacity > 0 ? capacity : 1) {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // Returns false if the queue is full or closed.
+  bool try_push(T item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || count_ == items_.size())
+      return false;
+    put(std::move(item));
+    return true;
+  }
+
+  // Blocks while the queue is full. Returns false once closed.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock,
+                   [this] { return closed_ || count_ < items_.size(); });
+    if (closed_)
+      return false;
+    put(std::move(item));
+    return true;
+  }
+
+  bool try_pop(T &item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_ == 0)
+      return false;
+    take(item);
+    return true;
+  }
+
+  // Blocks while the queue is empty. Returns false once closed and drained.
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || count_ > 0; });
+    if (count_ == 0)
+      return false;
+    take(item);
+    return true;
+  }
+
+  // Blocks until every slot is occupied, or the queue is closed.
+  void wait_full() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock,
+                    [this] { return closed_ || count_ == items_.size(); });
+  }
+
+  // Wakes up all waiters, pending items can still be popped.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+  }
+
+  size_t capacity() const { return items_.size(); }
+
+private:
+  void put(T item) {
+    items_[(head_ + count_) % items_.size()] = std::move(item);
+    count_++;
+    not_empty_.notify_all();
+  }
+
+  void take(T &item) {
+    item = std::move(items_[head_]);
+    head_ = (head_ + 1) % items_.size();
+    count_--;
+    not_full_.notify_all();
+  }
+
+  std::vector<T> items_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+  bool closed_ = false;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+#endif // BOUNDED_QUEUE_H
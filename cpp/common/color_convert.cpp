@@ -0,0 +1,481 @@
+#include "color_convert.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "cpu.h"
+#include "thread_pool.h"
+
+#ifdef CPU_X86
+#define COLOR_X86
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define COLOR_NEON
+#include <arm_neon.h>
+#endif
+
+namespace color {
+
+namespace {
+
+// 8 bit fixed point, scaled by 256. Every kernel computes
+//   Y = ((y0 * c0 + y1 * c1 + y2 * c2 + 128) >> 8) + offset
+//   U = ((u0 * s0 + u1 * s1 + u2 * s2 + 256) >> 9) + 128
+// where c are the pixel channels and s the channel sums of the two horizontal
+// neighbours after averaging the two rows with rounding, so all of them
+// produce exactly the output of the scalar version.
+struct Coeffs {
+  int16_t y[3];
+  int16_t u[3];
+  int16_t v[3];
+  int16_t y_offset;
+};
+
+// [colorspace][range], Y U V rows in R G B order
+static const int16_t kMatrix[2][2][9] = {
+    {
+        {66, 129, 25, -38, -74, 112, 112, -94, -18},  // BT.601 limited
+        {77, 150, 29, -43, -85, 128, 128, -107, -21}, // BT.601 full
+    },
+    {
+        {47, 157, 16, -25, -87, 112, 112, -102, -10}, // BT.709 limited
+        {54, 183, 19, -29, -99, 128, 128, -116, -12}, // BT.709 full
+    },
+};
+
+typedef void (*YRowFn)(const uint8_t *src, uint8_t *dst, int width,
+                       const Coeffs &c);
+// v is NULL for NV12, u then receives the interleaved UV row
+typedef void (*UVRowFn)(const uint8_t *src0, const uint8_t *src1, uint8_t *u,
+                        uint8_t *v, int width, const Coeffs &c);
+
+struct Kernels {
+  YRowFn y_row;
+  UVRowFn uv_row;
+  const char *name;
+  bool (*supported)();
+};
+
+bool always() { return true; }
+
+inline uint8_t clamp_u8(int v) {
+  return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+void y_row_c(const uint8_t *src, uint8_t *dst, int width, const Coeffs &c) {
+  for (int x = 0; x < width; x++, src += 4) {
+    int y = (src[0] * c.y[0] + src[1] * c.y[1] + src[2] * c.y[2] + 128) >> 8;
+    dst[x] = clamp_u8(y + c.y_offset);
+  }
+}
+
+void uv_row_c(const uint8_t *src0, const uint8_t *src1, uint8_t *u, uint8_t *v,
+              int width, const Coeffs &c) {
+  for (int x = 0; x + 1 < width; x += 2, src0 += 8, src1 += 8) {
+    int s[3];
+    for (int i = 0; i < 3; i++)
+      s[i] = ((src0[i] + src1[i] + 1) >> 1) +
+             ((src0[4 + i] + src1[4 + i] + 1) >> 1);
+    int cu = ((s[0] * c.u[0] + s[1] * c.u[1] + s[2] * c.u[2] + 256) >> 9) + 128;
+    int cv = ((s[0] * c.v[0] + s[1] * c.v[1] + s[2] * c.v[2] + 256) >> 9) + 128;
+    if (v) {
+      u[x / 2] = clamp_u8(cu);
+      v[x / 2] = clamp_u8(cv);
+    } else {
+      u[x] = clamp_u8(cu);
+      u[x + 1] = clamp_u8(cv);
+    }
+  }
+}
+
+#ifdef COLOR_X86
+
+TARGET_SSE41 void y_row_sse41(const uint8_t *src, uint8_t *dst, int width,
+                              const Coeffs &c) {
+  const __m128i coef = _mm_setr_epi16(c.y[0], c.y[1], c.y[2], 0, c.y[0],
+                                      c.y[1], c.y[2], 0);
+  const __m128i round = _mm_set1_epi32(128);
+  const __m128i offset = _mm_set1_epi16(c.y_offset);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i y[4];
+    for (int i = 0; i < 4; i++) {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + (x + i * 4) * 4));
+      __m128i lo = _mm_madd_epi16(_mm_cvtepu8_epi16(px), coef);
+      __m128i hi =
+          _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(px, 8)), coef);
+      y[i] = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(lo, hi), round), 8);
+    }
+    __m128i a = _mm_add_epi16(_mm_packs_epi32(y[0], y[1]), offset);
+    __m128i b = _mm_add_epi16(_mm_packs_epi32(y[2], y[3]), offset);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+  }
+  y_row_c(src + x * 4, dst + x, width - x, c);
+}
+
+// 4 pixels of both rows to the channel sums of 2 horizontal pairs, as
+// [s0 s1 s2 s3 of pair 0, s0 s1 s2 s3 of pair 1] in 16 bit
+TARGET_SSE41 inline __m128i pair_sums_sse41(const uint8_t *src0,
+                                            const uint8_t *src1) {
+  __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)src0),
+                           _mm_loadu_si128((const __m128i *)src1));
+  __m128i lo = _mm_cvtepu8_epi16(a);
+  __m128i hi = _mm_cvtepu8_epi16(_mm_srli_si128(a, 8));
+  return _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)),
+                            _mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+}
+
+TARGET_SSE41 void uv_row_sse41(const uint8_t *src0, const uint8_t *src1,
+                               uint8_t *u, uint8_t *v, int width,
+                               const Coeffs &c) {
+  const __m128i ucoef = _mm_setr_epi16(c.u[0], c.u[1], c.u[2], 0, c.u[0],
+                                       c.u[1], c.u[2], 0);
+  const __m128i vcoef = _mm_setr_epi16(c.v[0], c.v[1], c.v[2], 0, c.v[0],
+                                       c.v[1], c.v[2], 0);
+  const __m128i round = _mm_set1_epi32(256);
+  const __m128i offset = _mm_set1_epi16(128);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i cu[2], cv[2];
+    for (int i = 0; i < 2; i++) {
+      int off = (x + i * 8) * 4;
+      __m128i s0 = pair_sums_sse41(src0 + off, src1 + off);
+      __m128i s1 = pair_sums_sse41(src0 + off + 16, src1 + off + 16);
+      cu[i] = _mm_hadd_epi32(_mm_madd_epi16(s0, ucoef),
+                             _mm_madd_epi16(s1, ucoef));
+      cv[i] = _mm_hadd_epi32(_mm_madd_epi16(s0, vcoef),
+                             _mm_madd_epi16(s1, vcoef));
+      cu[i] = _mm_srai_epi32(_mm_add_epi32(cu[i], round), 9);
+      cv[i] = _mm_srai_epi32(_mm_add_epi32(cv[i], round), 9);
+    }
+    __m128i u16 = _mm_add_epi16(_mm_packs_epi32(cu[0], cu[1]), offset);
+    __m128i v16 = _mm_add_epi16(_mm_packs_epi32(cv[0], cv[1]), offset);
+    __m128i u8 = _mm_packus_epi16(u16, u16);
+    __m128i v8 = _mm_packus_epi16(v16, v16);
+    if (v) {
+      _mm_storel_epi64((__m128i *)(u + x / 2), u8);
+      _mm_storel_epi64((__m128i *)(v + x / 2), v8);
+    } else {
+      _mm_storeu_si128((__m128i *)(u + x), _mm_unpacklo_epi8(u8, v8));
+    }
+  }
+  if (v)
+    uv_row_c(src0 + x * 4, src1 + x * 4, u + x / 2, v + x / 2, width - x, c);
+  else
+    uv_row_c(src0 + x * 4, src1 + x * 4, u + x, NULL, width - x, c);
+}
+
+TARGET_AVX2 void y_row_avx2(const uint8_t *src, uint8_t *dst, int width,
+                            const Coeffs &c) {
+  const __m256i coef = _mm256_setr_epi16(
+      c.y[0], c.y[1], c.y[2], 0, c.y[0], c.y[1], c.y[2], 0, c.y[0], c.y[1],
+      c.y[2], 0, c.y[0], c.y[1], c.y[2], 0);
+  const __m256i round = _mm256_set1_epi32(128);
+  const __m256i offset = _mm256_set1_epi16(c.y_offset);
+  // hadd works per 128 bit lane, these restore the pixel order
+  const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+  const __m256i interleave = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m256i y[4];
+    for (int i = 0; i < 4; i++) {
+      __m256i px = _mm256_loadu_si256((const __m256i *)(src + (x + i * 8) * 4));
+      __m256i lo = _mm256_madd_epi16(
+          _mm256_cvtepu8_epi16(_mm256_castsi256_si128(px)), coef);
+      __m256i hi = _mm256_madd_epi16(
+          _mm256_cvtepu8_epi16(_mm256_extracti128_si256(px, 1)), coef);
+      __m256i sum = _mm256_add_epi32(_mm256_hadd_epi32(lo, hi), round);
+      y[i] = _mm256_permutevar8x32_epi32(_mm256_srai_epi32(sum, 8), order);
+    }
+    __m256i a = _mm256_add_epi16(_mm256_packs_epi32(y[0], y[1]), offset);
+    __m256i b = _mm256_add_epi16(_mm256_packs_epi32(y[2], y[3]), offset);
+    __m256i out =
+        _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), interleave);
+    _mm256_storeu_si256((__m256i *)(dst + x), out);
+  }
+  y_row_sse41(src + x * 4, dst + x, width - x, c);
+}
+
+// 8 pixels of both rows to the channel sums of 4 horizontal pairs, lane 0
+// holds pairs 0 and 2, lane 1 pairs 1 and 3
+TARGET_AVX2 inline __m256i pair_sums_avx2(const uint8_t *src0,
+                                          const uint8_t *src1) {
+  __m256i a = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)src0),
+                              _mm256_loadu_si256((const __m256i *)src1));
+  __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a));
+  __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1));
+  return _mm256_unpacklo_epi64(_mm256_add_epi16(lo, _mm256_srli_si256(lo, 8)),
+                               _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8)));
+}
+
+TARGET_AVX2 void uv_row_avx2(const uint8_t *src0, const uint8_t *src1,
+                             uint8_t *u, uint8_t *v, int width,
+                             const Coeffs &c) {
+  const __m256i ucoef = _mm256_setr_epi16(
+      c.u[0], c.u[1], c.u[2], 0, c.u[0], c.u[1], c.u[2], 0, c.u[0], c.u[1],
+      c.u[2], 0, c.u[0], c.u[1], c.u[2], 0);
+  const __m256i vcoef = _mm256_setr_epi16(
+      c.v[0], c.v[1], c.v[2], 0, c.v[0], c.v[1], c.v[2], 0, c.v[0], c.v[1],
+      c.v[2], 0, c.v[0], c.v[1], c.v[2], 0);
+  const __m256i round = _mm256_set1_epi32(256);
+  const __m256i offset = _mm256_set1_epi16(128);
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m256i cu[2], cv[2];
+    for (int i = 0; i < 2; i++) {
+      int off = (x + i * 16) * 4;
+      __m256i s0 = pair_sums_avx2(src0 + off, src1 + off);
+      __m256i s1 = pair_sums_avx2(src0 + off + 32, src1 + off + 32);
+      __m256i su = _mm256_hadd_epi32(_mm256_madd_epi16(s0, ucoef),
+                                     _mm256_madd_epi16(s1, ucoef));
+      __m256i sv = _mm256_hadd_epi32(_mm256_madd_epi16(s0, vcoef),
+                                     _mm256_madd_epi16(s1, vcoef));
+      su = _mm256_srai_epi32(_mm256_add_epi32(su, round), 9);
+      sv = _mm256_srai_epi32(_mm256_add_epi32(sv, round), 9);
+      cu[i] = _mm256_permutevar8x32_epi32(su, order);
+      cv[i] = _mm256_permutevar8x32_epi32(sv, order);
+    }
+    __m256i u16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(cu[0], cu[1]),
+                                           _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i v16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(cv[0], cv[1]),
+                                           _MM_SHUFFLE(3, 1, 2, 0));
+    u16 = _mm256_add_epi16(u16, offset);
+    v16 = _mm256_add_epi16(v16, offset);
+    __m128i u8 = _mm_packus_epi16(_mm256_castsi256_si128(u16),
+                                  _mm256_extracti128_si256(u16, 1));
+    __m128i v8 = _mm_packus_epi16(_mm256_castsi256_si128(v16),
+                                  _mm256_extracti128_si256(v16, 1));
+    if (v) {
+      _mm_storeu_si128((__m128i *)(u + x / 2), u8);
+      _mm_storeu_si128((__m128i *)(v + x / 2), v8);
+    } else {
+      _mm_storeu_si128((__m128i *)(u + x), _mm_unpacklo_epi8(u8, v8));
+      _mm_storeu_si128((__m128i *)(u + x + 16), _mm_unpackhi_epi8(u8, v8));
+    }
+  }
+  if (v)
+    uv_row_sse41(src0 + x * 4, src1 + x * 4, u + x / 2, v + x / 2, width - x,
+                 c);
+  else
+    uv_row_sse41(src0 + x * 4, src1 + x * 4, u + x, NULL, width - x, c);
+}
+
+#endif // COLOR_X86
+
+#ifdef COLOR_NEON
+
+inline uint8x8_t y_half_neon(int16x8_t c0, int16x8_t c1, int16x8_t c2,
+                             const Coeffs &c) {
+  int32x4_t lo = vmull_n_s16(vget_low_s16(c0), c.y[0]);
+  lo = vmlal_n_s16(lo, vget_low_s16(c1), c.y[1]);
+  lo = vmlal_n_s16(lo, vget_low_s16(c2), c.y[2]);
+  int32x4_t hi = vmull_n_s16(vget_high_s16(c0), c.y[0]);
+  hi = vmlal_n_s16(hi, vget_high_s16(c1), c.y[1]);
+  hi = vmlal_n_s16(hi, vget_high_s16(c2), c.y[2]);
+  int16x8_t y = vcombine_s16(vrshrn_n_s32(lo, 8), vrshrn_n_s32(hi, 8));
+  return vqmovun_s16(vaddq_s16(y, vdupq_n_s16(c.y_offset)));
+}
+
+void y_row_neon(const uint8_t *src, uint8_t *dst, int width, const Coeffs &c) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x4_t px = vld4q_u8(src + x * 4);
+    int16x8_t c0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(px.val[0])));
+    int16x8_t c1 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(px.val[1])));
+    int16x8_t c2 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(px.val[2])));
+    uint8x8_t lo = y_half_neon(c0, c1, c2, c);
+    c0 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(px.val[0])));
+    c1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(px.val[1])));
+    c2 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(px.val[2])));
+    uint8x8_t hi = y_half_neon(c0, c1, c2, c);
+    vst1q_u8(dst + x, vcombine_u8(lo, hi));
+  }
+  y_row_c(src + x * 4, dst + x, width - x, c);
+}
+
+inline uint8x8_t chroma_neon(int16x8_t s0, int16x8_t s1, int16x8_t s2,
+                             const int16_t *k) {
+  int32x4_t lo = vmull_n_s16(vget_low_s16(s0), k[0]);
+  lo = vmlal_n_s16(lo, vget_low_s16(s1), k[1]);
+  lo = vmlal_n_s16(lo, vget_low_s16(s2), k[2]);
+  int32x4_t hi = vmull_n_s16(vget_high_s16(s0), k[0]);
+  hi = vmlal_n_s16(hi, vget_high_s16(s1), k[1]);
+  hi = vmlal_n_s16(hi, vget_high_s16(s2), k[2]);
+  int16x8_t r = vcombine_s16(vrshrn_n_s32(lo, 9), vrshrn_n_s32(hi, 9));
+  return vqmovun_s16(vaddq_s16(r, vdupq_n_s16(128)));
+}
+
+void uv_row_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *u,
+                 uint8_t *v, int width, const Coeffs &c) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x4_t a = vld4q_u8(src0 + x * 4);
+    uint8x16x4_t b = vld4q_u8(src1 + x * 4);
+    int16x8_t s[3];
+    for (int i = 0; i < 3; i++)
+      s[i] = vreinterpretq_s16_u16(vpaddlq_u8(vrhaddq_u8(a.val[i], b.val[i])));
+    uint8x8_t cu = chroma_neon(s[0], s[1], s[2], c.u);
+    uint8x8_t cv = chroma_neon(s[0], s[1], s[2], c.v);
+    if (v) {
+      vst1_u8(u + x / 2, cu);
+      vst1_u8(v + x / 2, cv);
+    } else {
+      uint8x8x2_t uv = {{cu, cv}};
+      vst2_u8(u + x, uv);
+    }
+  }
+  if (v)
+    uv_row_c(src0 + x * 4, src1 + x * 4, u + x / 2, v + x / 2, width - x, c);
+  else
+    uv_row_c(src0 + x * 4, src1 + x * 4, u + x, NULL, width - x, c);
+}
+
+#endif // COLOR_NEON
+
+// widest first, the scalar set runs everywhere
+const Kernels kKernels[] = {
+#ifdef COLOR_X86
+    {y_row_avx2, uv_row_avx2, "avx2", cpu::has_avx2},
+    {y_row_sse41, uv_row_sse41, "sse4.1", cpu::has_sse41},
+#endif
+#ifdef COLOR_NEON
+    {y_row_neon, uv_row_neon, "neon", always},
+#endif
+    {y_row_c, uv_row_c, "c", always},
+};
+
+const Kernels *select_kernels() {
+  for (const Kernels &k : kKernels) {
+    if (k.supported())
+      return &k;
+  }
+  return NULL;
+}
+
+const Kernels &kernels() {
+  static const Kernels *k = select_kernels();
+  return *k;
+}
+
+// The set called name if this cpu runs it, NULL otherwise
+const Kernels *find_kernels(const char *name) {
+  for (const Kernels &k : kKernels) {
+    if (strcmp(k.name, name) == 0)
+      return k.supported() ? &k : NULL;
+  }
+  return NULL;
+}
+
+struct Job {
+  const Kernels *k;
+  Coeffs coeffs;
+  const uint8_t *src;
+  int src_stride;
+  int width;
+  int height;
+  uint8_t *const *dst;
+  const int *dst_linesize;
+  bool nv12;
+  int band_rows;
+};
+
+void convert_band(void *ctx, int index) {
+  const Job &job = *(const Job *)ctx;
+  int begin = index * job.band_rows;
+  int end = std::min(begin + job.band_rows, job.height);
+  for (int row = begin; row < end; row += 2) {
+    const uint8_t *src0 = job.src + (int64_t)row * job.src_stride;
+    const uint8_t *src1 = src0 + job.src_stride;
+    uint8_t *y0 = job.dst[0] + (int64_t)row * job.dst_linesize[0];
+    job.k->y_row(src0, y0, job.width, job.coeffs);
+    job.k->y_row(src1, y0 + job.dst_linesize[0], job.width, job.coeffs);
+    uint8_t *u = job.dst[1] + (int64_t)(row / 2) * job.dst_linesize[1];
+    uint8_t *v = job.nv12
+                     ? NULL
+                     : job.dst[2] + (int64_t)(row / 2) * job.dst_linesize[2];
+    job.k->uv_row(src0, src1, u, v, job.width, job.coeffs);
+  }
+}
+
+int convert(const Kernels *k, const uint8_t *src, int src_stride, int format,
+            int width, int height, uint8_t *const dst[],
+            const int dst_linesize[], bool nv12, ColorSpace colorspace,
+            ColorRange range, ThreadPool *pool) {
+  if (!src || width <= 0 || height <= 0 || width % 2 || height % 2 ||
+      src_stride < width * 4)
+    return -1;
+  if (format != SURFACE_FORMAT_BGRA && format != SURFACE_FORMAT_RGBA)
+    return -1;
+  if (colorspace != COLOR_SPACE_BT601 && colorspace != COLOR_SPACE_BT709)
+    return -1;
+  if (range != COLOR_RANGE_LIMITED && range != COLOR_RANGE_FULL)
+    return -1;
+
+  Job job;
+  job.k = k;
+  const int16_t *m = kMatrix[colorspace][range];
+  // kernels take the channels in memory order
+  int r = format == SURFACE_FORMAT_BGRA ? 2 : 0;
+  int b = 2 - r;
+  for (int i = 0; i < 3; i++) {
+    int16_t *row =
+        i == 0 ? job.coeffs.y : (i == 1 ? job.coeffs.u : job.coeffs.v);
+    row[r] = m[i * 3];
+    row[1] = m[i * 3 + 1];
+    row[b] = m[i * 3 + 2];
+  }
+  job.coeffs.y_offset = range == COLOR_RANGE_LIMITED ? 16 : 0;
+  job.src = src;
+  job.src_stride = src_stride;
+  job.width = width;
+  job.height = height;
+  job.dst = dst;
+  job.dst_linesize = dst_linesize;
+  job.nv12 = nv12;
+
+  // bands of at least 32 rows, a smaller share costs more in wakeups than it
+  // saves
+  int bands = pool ? std::max(1, std::min(pool->size(), height / 32)) : 1;
+  job.band_rows = (height / 2 + bands - 1) / bands * 2;
+  bands = (height + job.band_rows - 1) / job.band_rows;
+  if (pool)
+    pool->run(bands, convert_band, &job);
+  else
+    convert_band(&job, 0);
+  return 0;
+}
+
+} // namespace
+
+int rgb_to_yuv420(const uint8_t *src, int src_stride, int format, int width,
+                  int height, uint8_t *const dst[], const int dst_linesize[],
+                  bool nv12, ColorSpace colorspace, ColorRange range,
+                  ThreadPool *pool) {
+  return convert(&kernels(), src, src_stride, format, width, height, dst,
+                 dst_linesize, nv12, colorspace, range, pool);
+}
+
+const char *simd_name() { return kernels().name; }
+
+} // namespace color
+
+extern "C" int hwcodec_rgb_to_yuv420(const uint8_t *src, int src_stride,
+                                     int format, int width, int height,
+                                     uint8_t *const dst[],
+                                     const int dst_linesize[], int nv12,
+                                     int colorspace, int range,
+                                     const char *kernels) {
+  if (!dst || !dst_linesize || !dst[0] || !dst[1] || (!nv12 && !dst[2]))
+    return -1;
+  const color::Kernels *k =
+      kernels ? color::find_kernels(kernels) : &color::kernels();
+  if (!k)
+    return -1;
+  return color::convert(k, src, src_stride, format, width, height, dst,
+                        dst_linesize, nv12 != 0, (ColorSpace)colorspace,
+                        (ColorRange)range, NULL);
+}
+
+extern "C" const char *hwcodec_color_simd_name(void) {
+  return color::simd_name();
+}
@@ -0,0 +1,27 @@
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+class ThreadPool;
+
+namespace color {
+
+// Convert packed BGRA / RGBA (format is a SurfaceFormat) to NV12 when nv12,
+// otherwise to YUV420P. dst / dst_linesize follow the AVFrame plane layout,
+// width and height must be even. Chroma is the rounded average of each 2x2
+// block. Row bands are spread over pool when it is not NULL.
+// Returns 0 on success, -1 for unsupported parameters.
+int rgb_to_yuv420(const uint8_t *src, int src_stride, int format, int width,
+                  int height, uint8_t *const dst[], const int dst_linesize[],
+                  bool nv12, ColorSpace colorspace, ColorRange range,
+                  ThreadPool *pool);
+
+// Name of the kernel set picked for this cpu, e.g. "avx2"
+const char *simd_name();
+
+} // namespace color
+
+#endif // COLOR_CONVERT_H
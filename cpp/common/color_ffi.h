@@ -0,0 +1,18 @@
+#ifndef COLOR_FFI_H
+#define COLOR_FFI_H
+
+#include <stdint.h>
+
+// BGRA / RGBA to NV12 or YUV420P as the encoders convert it, format,
+// colorspace and range take the SurfaceFormat, ColorSpace and ColorRange
+// values. kernels names the set to use, e.g. "c" or "sse4.1", so each can be
+// checked against the scalar one, NULL picks the widest this cpu runs.
+// Returns 0 on success, -1 for unsupported parameters or kernels.
+int hwcodec_rgb_to_yuv420(const uint8_t *src, int src_stride, int format,
+                          int width, int height, uint8_t *const dst[],
+                          const int dst_linesize[], int nv12, int colorspace,
+                          int range, const char *kernels);
+// Name of the kernels picked for this cpu, e.g. "avx2"
+const char *hwcodec_color_simd_name(void);
+
+#endif // COLOR_FFI_H
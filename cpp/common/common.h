@@ -18,6 +18,27 @@ enum SurfaceFormat {
   SURFACE_FORMAT_NV12,
 };
 
+// Matrix and range of a RGB to YUV conversion
+enum ColorSpace {
+  COLOR_SPACE_BT601,
+  COLOR_SPACE_BT709,
+};
+
+enum ColorRange {
+  COLOR_RANGE_LIMITED,
+  COLOR_RANGE_FULL,
+};
+
+// Filter of a resize, maps to the SWS_* flag of the same name
+enum ScaleAlgorithm {
+  SCALE_FAST_BILINEAR,
+  SCALE_BILINEAR,
+  SCALE_BICUBIC,
+  SCALE_POINT,
+  SCALE_AREA,
+  SCALE_LANCZOS,
+};
+
 enum DataFormat {
   H264,
   H265,
@@ -43,4 +64,50 @@ enum RateControl {
   RC_CQ,
 };
 
+// Order in which intra refresh renews the picture, by columns sweeping left to
+// right or by rows sweeping top to bottom
+enum RefreshDirection {
+  REFRESH_COLUMNS,
+  REFRESH_ROWS,
+};
+
+#define PROFILE_BUCKETS 20
+
+// Latency histogram of one stage, buckets[i] counts the durations below 2^i us
+// and the last bucket everything longer.
+struct ProfileStats {
+  int64_t count;
+  int64_t total_ns;
+  int64_t min_ns;
+  int64_t max_ns;
+  int64_t buckets[PROFILE_BUCKETS];
+};
+
+enum EncodeStage {
+  ENCODE_STAGE_TOTAL,
+  ENCODE_STAGE_MAKE_WRITABLE,
+  ENCODE_STAGE_FILL_FRAME,
+  ENCODE_STAGE_UPLOAD,
+  ENCODE_STAGE_SEND_FRAME,
+  ENCODE_STAGE_RECEIVE_PACKET,
+  ENCODE_STAGE_COUNT,
+};
+
+enum DecodeStage {
+  DECODE_STAGE_TOTAL,
+  DECODE_STAGE_SEND_PACKET,
+  DECODE_STAGE_RECEIVE_FRAME,
+  DECODE_STAGE_DOWNLOAD,
+  DECODE_STAGE_CONVERT,
+  DECODE_STAGE_CALLBACK,
+  DECODE_STAGE_COUNT,
+};
+
+enum MuxStage {
+  MUX_STAGE_TOTAL,
+  MUX_STAGE_WRITE_HEADER,
+  MUX_STAGE_WRITE_FRAME,
+  MUX_STAGE_COUNT,
+};
+
 #endif // COMMON_H
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "cpu.h"
+
+#if defined(CPU_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace cpu {
+
+namespace {
+
+struct Features {
+  bool sse41;
+  bool avx2;
+};
+
+Features detect() {
+  Features f = {false, false};
+#ifdef CPU_X86
+#ifdef _MSC_VER
+  int regs[4];
+  __cpuid(regs, 0);
+  int max_leaf = regs[0];
+  __cpuid(regs, 1);
+  f.sse41 = (regs[2] & (1 << 19)) != 0;
+  bool osxsave = (regs[2] & (1 << 27)) != 0;
+  bool avx = (regs[2] & (1 << 28)) != 0;
+  // the os must save the ymm registers too
+  if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+    __cpuidex(regs, 7, 0);
+    f.avx2 = (regs[1] & (1 << 5)) != 0;
+  }
+#else
+  f.sse41 = __builtin_cpu_supports("sse4.1");
+  f.avx2 = __builtin_cpu_supports("avx2");
+#endif
+#endif // CPU_X86
+  return f;
+}
+
+const Features &features() {
+  static const Features f = detect();
+  return f;
+}
+
+} // namespace
+
+bool has_sse41() { return features().sse41; }
+
+bool has_avx2() { return features().avx2; }
+
+} // namespace cpu
@@ -0,0 +1,28 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Instruction set attributes for kernels compiled next to the baseline code.
+// MSVC emits any intrinsic without them.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(_M_IX86)
+#define CPU_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace cpu {
+
+// Whether the cpu and the os support the instruction set. cpuid runs once,
+// later calls return the cached result. Always false off x86.
+bool has_sse41();
+bool has_avx2();
+
+} // namespace cpu
+
+#endif // CPU_H
@@ -14,9 +14,13 @@
 enum AVPixelFormat {
   AV_PIX_FMT_YUV420P = 0,
   AV_PIX_FMT_NV12 = 23,
+  AV_PIX_FMT_RGBA = 26,
+  AV_PIX_FMT_BGRA = 28,
 };
 
 int av_log_get_level(void);
 void av_log_set_level(int level);
+unsigned avcodec_version(void);
+unsigned avutil_version(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include "frame_compare.h"
+
+#include <string.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define COMPARE_X86
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define COMPARE_NEON
+#include <arm_neon.h>
+#endif
+
+namespace compare {
+
+namespace {
+
+#define BLOCK_SIZE 64
+
+typedef bool (*EqualFn)(const uint8_t *a, const uint8_t *b, size_t size);
+
+// the tail below a block
+bool equal_tail(const uint8_t *a, const uint8_t *b, size_t size) {
+  return memcmp(a, b, size) == 0;
+}
+
+#ifdef COMPARE_X86
+
+// SSE2 is part of x86-64
+bool equal_sse2(const uint8_t *a, const uint8_t *b, size_t size) {
+  size_t i = 0;
+  for (; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+    __m128i d = _mm_setzero_si128();
+    for (int j = 0; j < BLOCK_SIZE; j += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i + j));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i + j));
+      d = _mm_or_si128(d, _mm_xor_si128(va, vb));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) != 0xFFFF)
+      return false;
+  }
+  return equal_tail(a + i, b + i, size - i);
+}
+
+TARGET_AVX2 bool equal_avx2(const uint8_t *a, const uint8_t *b, size_t size) {
+  size_t i = 0;
+  for (; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+    __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                  _mm256_loadu_si256((const __m256i *)(b + i)));
+    __m256i d1 =
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+                         _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+    __m256i d = _mm256_or_si256(d0, d1);
+    if (!_mm256_testz_si256(d, d))
+      return false;
+  }
+  return equal_tail(a + i, b + i, size - i);
+}
+
+#endif // COMPARE_X86
+
+#ifdef COMPARE_NEON
+
+bool equal_neon(const uint8_t *a, const uint8_t *b, size_t size) {
+  size_t i = 0;
+  for (; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+    uint8x16_t d = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    for (int j = 16; j < BLOCK_SIZE; j += 16)
+      d = vorrq_u8(d, veorq_u8(vld1q_u8(a + i + j), vld1q_u8(b + i + j)));
+    if (vmaxvq_u8(d) != 0)
+      return false;
+  }
+  return equal_tail(a + i, b + i, size - i);
+}
+
+#endif // COMPARE_NEON
+
+EqualFn select_equal() {
+#ifdef COMPARE_X86
+  if (cpu::has_avx2())
+    return equal_avx2;
+  return equal_sse2;
+#elif defined(COMPARE_NEON)
+  return equal_neon;
+#else
+  return equal_tail;
+#endif
+}
+
+} // namespace
+
+bool equal(const uint8_t *a, const uint8_t *b, size_t size) {
+  static const EqualFn fn = select_equal();
+  return fn(a, b, size);
+}
+
+} // namespace compare
@@ -0,0 +1,16 @@
+#ifndef FRAME_COMPARE_H
+#define FRAME_COMPARE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace compare {
+
+// Whether the size bytes at a and b are identical. Compares 64 byte blocks
+// with the widest vector unit of the cpu and returns at the first block that
+// differs, so a changed frame usually costs a fraction of a full pass.
+bool equal(const uint8_t *a, const uint8_t *b, size_t size);
+
+} // namespace compare
+
+#endif // FRAME_COMPARE_H
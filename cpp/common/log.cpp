@@ -1,36 +1,82 @@
-
 #include "log.h"
 
+#include <chrono>
+#include <stdarg.h>
+#include <stdio.h>
+
 namespace gol {
-enum {
-  LOG_LEVEL_ERROR = 0,
-  LOG_LEVEL_WARN = 1,
-  LOG_LEVEL_INFO = 2,
-  LOG_LEVEL_DEBUG = 3,
-  LOG_LEVEL_TRACE = 4,
-};
 
 extern "C" void hwcodec_log(int level, const char *message);
+extern "C" int hwcodec_log_enabled(int level);
+
+bool enabled(int level) { return hwcodec_log_enabled(level) != 0; }
+
+static void append_suppressed(char *buf, size_t size, size_t len,
+                              int suppressed) {
+  if (suppressed > 0 && len < size)
+    snprintf(buf + len, size - len, " (%d similar messages suppressed)",
+             suppressed);
+}
 
-void log_to_rust(int level, const std::string &message) {
-  const char *cstr = message.c_str();
-  hwcodec_log(level, cstr);
+void log(int level, const std::string &message, int suppressed) {
+  if (suppressed > 0) {
+    char buf[LOG_BUFFER_SIZE];
+    int len = snprintf(buf, sizeof(buf), "%s", message.c_str());
+    if (len < 0)
+      return;
+    append_suppressed(buf, sizeof(buf), (size_t)len, suppressed);
+    hwcodec_log(level, buf);
+    return;
+  }
+  hwcodec_log(level, message.c_str());
+}
+
+void logf(int level, const char *module, int suppressed, const char *format,
+          ...) {
+  char buf[LOG_BUFFER_SIZE];
+  int len = snprintf(buf, sizeof(buf), "[%s] ", module);
+  if (len < 0)
+    return;
+  if ((size_t)len < sizeof(buf)) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + len, sizeof(buf) - len, format, args);
+    va_end(args);
+    if (n > 0)
+      len += n;
+  }
+  append_suppressed(buf, sizeof(buf), (size_t)len, suppressed);
+  hwcodec_log(level, buf);
 }
 
 void error(const std::string &message) {
-  log_to_rust(LOG_LEVEL_ERROR, message);
+  log(LOG_LEVEL_ERROR, message, 0);
 }
 
-void warn(const std::string &message) { log_to_rust(LOG_LEVEL_WARN, message); }
+void warn(const std::string &message) { log(LOG_LEVEL_WARN, message, 0); }
 
-void info(const std::string &message) { log_to_rust(LOG_LEVEL_INFO, message); }
+void info(const std::string &message) { log(LOG_LEVEL_INFO, message, 0); }
 
-void debug(const std::string &message) {
-  log_to_rust(LOG_LEVEL_DEBUG, message);
-}
+void debug(const std::string &message) { log(LOG_LEVEL_DEBUG, message, 0); }
+
+void trace(const std::string &message) { log(LOG_LEVEL_TRACE, message, 0); }
 
-void trace(const std::string &message) {
-  log_to_rust(LOG_LEVEL_TRACE, message);
+bool RateLimit::allow(int *suppressed) {
+  int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t start = window_start_.load(std::memory_order_relaxed);
+  if (now - start >= LOG_RATE_WINDOW_MS &&
+      window_start_.compare_exchange_strong(start, now,
+                                            std::memory_order_relaxed)) {
+    count_.store(0, std::memory_order_relaxed);
+  }
+  if (count_.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_BURST) {
+    *suppressed = dropped_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+  dropped_.fetch_add(1, std::memory_order_relaxed);
+  return false;
 }
 
 } // namespace gol
@@ -6,31 +6,92 @@ extern "C" {
 #include <libavutil/error.h>
 }
 
+#include <atomic>
 #include <sstream>
+#include <stdint.h>
 #include <string>
 
 #ifndef LOG_MODULE
 #define LOG_MODULE "*"
 #endif
 
+// Messages longer than this are truncated by the LOG_*F macros
+#define LOG_BUFFER_SIZE 512
+// Each call site logs at most LOG_RATE_BURST messages per LOG_RATE_WINDOW_MS,
+// the rest are counted and reported with the next message that gets through.
+#define LOG_RATE_BURST 5
+#define LOG_RATE_WINDOW_MS 1000
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LOG_PRINTF_FORMAT(fmt, args)
+#endif
+
 namespace gol {
+enum {
+  LOG_LEVEL_ERROR = 0,
+  LOG_LEVEL_WARN = 1,
+  LOG_LEVEL_INFO = 2,
+  LOG_LEVEL_DEBUG = 3,
+  LOG_LEVEL_TRACE = 4,
+};
+
+bool enabled(int level);
+void log(int level, const std::string &message, int suppressed);
+// Formats into a stack buffer, never allocates.
+void logf(int level, const char *module, int suppressed, const char *format,
+          ...) LOG_PRINTF_FORMAT(4, 5);
+
 void error(const std::string &message);
 void warn(const std::string &message);
 void info(const std::string &message);
 void debug(const std::string &message);
 void trace(const std::string &message);
+
+class RateLimit {
+public:
+  // Whether the call site may log now. suppressed receives the number of
+  // messages dropped since the last one that was allowed.
+  bool allow(int *suppressed);
+
+private:
+  std::atomic<int64_t> window_start_{0};
+  std::atomic<int> count_{0};
+  std::atomic<int> dropped_{0};
+};
 } // namespace gol
 
-#define LOG_ERROR(message)                                                     \
-  gol::error(std::string("[") + LOG_MODULE + "] " + message)
-#define LOG_WARN(message)                                                      \
-  gol::warn(std::string("[") + LOG_MODULE + "] " + message)
-#define LOG_INFO(message)                                                      \
-  gol::info(std::string("[") + LOG_MODULE + "] " + message)
-#define LOG_DEBUG(message)                                                     \
-  gol::debug(std::string("[") + LOG_MODULE + "] " + message)
-#define LOG_TRACE(message)                                                     \
-  gol::trace(std::string("[") + LOG_MODULE + "] " + message)
+// The message expression is only evaluated if the level is enabled.
+#define LOG_AT(level, message)                                                 \
+  do {                                                                         \
+    static gol::RateLimit __log_limit__;                                       \
+    int __log_suppressed__ = 0;                                                \
+    if (gol::enabled(level) && __log_limit__.allow(&__log_suppressed__))       \
+      gol::log(level, std::string("[") + LOG_MODULE + "] " + message,          \
+               __log_suppressed__);                                            \
+  } while (false)
+
+// printf style variant for hot paths
+#define LOGF_AT(level, ...)                                                    \
+  do {                                                                         \
+    static gol::RateLimit __log_limit__;                                       \
+    int __log_suppressed__ = 0;                                                \
+    if (gol::enabled(level) && __log_limit__.allow(&__log_suppressed__))       \
+      gol::logf(level, LOG_MODULE, __log_suppressed__, __VA_ARGS__);           \
+  } while (false)
+
+#define LOG_ERROR(message) LOG_AT(gol::LOG_LEVEL_ERROR, message)
+#define LOG_WARN(message) LOG_AT(gol::LOG_LEVEL_WARN, message)
+#define LOG_INFO(message) LOG_AT(gol::LOG_LEVEL_INFO, message)
+#define LOG_DEBUG(message) LOG_AT(gol::LOG_LEVEL_DEBUG, message)
+#define LOG_TRACE(message) LOG_AT(gol::LOG_LEVEL_TRACE, message)
+
+#define LOG_ERRORF(...) LOGF_AT(gol::LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNF(...) LOGF_AT(gol::LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFOF(...) LOGF_AT(gol::LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUGF(...) LOGF_AT(gol::LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACEF(...) LOGF_AT(gol::LOG_LEVEL_TRACE, __VA_ARGS__)
 
 // https://github.com/joncampbell123/composite-video-simulator/issues/5#issuecomment-611885908
 #ifdef av_err2str
@@ -42,6 +103,13 @@ av_always_inline std::string av_err2string(int errnum) {
 #define av_err2str(err) av_err2string(err).c_str()
 #endif // av_err2str
 
+// av_err2str without the temporary std::string, for the LOG_*F macros. The
+// buffer is per thread, so use it once per statement.
+av_always_inline const char *av_err2cstr(int errnum) {
+  static thread_local char str[AV_ERROR_MAX_STRING_SIZE];
+  return av_make_error_string(str, AV_ERROR_MAX_STRING_SIZE, errnum);
+}
+
 #ifdef _WIN32
 
 #define HRB(f) MS_CHECK(f, return false;)
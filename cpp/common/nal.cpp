@@ -0,0 +1,485 @@
+#include "nal.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NAL_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define NAL_NEON
+#include <arm_neon.h>
+#endif
+
+#define LOG_MODULE "NAL"
+#include "log.h"
+
+namespace nal {
+
+namespace {
+
+#define BLOCK_SIZE 16
+// refuse SPS sizes beyond any level, they come from a corrupt unit
+#define MAX_DIMENSION 16384
+
+#ifdef NAL_SSE2
+int lowest_bit(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+bool start_code_at(const uint8_t *p) {
+  return p[0] == 0 && p[1] == 0 && p[2] == 1;
+}
+
+// Reads the RBSP of a unit, dropping the emulation prevention bytes on the
+// way. Reading past the end yields zeros and sets error.
+class BitReader {
+public:
+  BitReader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  int bit() {
+    if (left_ == 0 && !load()) {
+      error_ = true;
+      return 0;
+    }
+    left_--;
+    return (byte_ >> left_) & 1;
+  }
+
+  uint32_t bits(int n) {
+    uint32_t v = 0;
+    while (n-- > 0)
+      v = (v << 1) | bit();
+    return v;
+  }
+
+  void skip(int n) {
+    while (n-- > 0)
+      bit();
+  }
+
+  // ue(v), exp-Golomb
+  uint32_t ue() {
+    int zeros = 0;
+    while (!bit()) {
+      if (error_ || ++zeros > 31) {
+        error_ = true;
+        return 0;
+      }
+    }
+    return ((1u << zeros) - 1) + bits(zeros);
+  }
+
+  // se(v)
+  int32_t se() {
+    uint32_t v = ue();
+    return (v & 1) ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+  }
+
+  bool error() const { return error_; }
+
+private:
+  bool load() {
+    if (pos_ >= size_)
+      return false;
+    if (zeros_ >= 2 && data_[pos_] == 3) {
+      zeros_ = 0;
+      if (++pos_ >= size_)
+        return false;
+    }
+    byte_ = data_[pos_++];
+    zeros_ = byte_ == 0 ? zeros_ + 1 : 0;
+    left_ = 8;
+    return true;
+  }
+
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_ = 0;
+  int zeros_ = 0;
+  uint8_t byte_ = 0;
+  int left_ = 0;
+  bool error_ = false;
+};
+
+void skip_scaling_list(BitReader &r, int size) {
+  int last = 8;
+  int next = 8;
+  for (int j = 0; j < size; j++) {
+    if (next != 0) {
+      int delta = r.se();
+      next = ((last + delta) % 256 + 256) % 256;
+    }
+    last = next == 0 ? last : next;
+  }
+}
+
+// Picture size of a cropped frame, sub_width / sub_height are the chroma
+// subsampling factors the crop offsets count in.
+bool crop(int64_t width, int64_t height, int64_t sub_width, int64_t sub_height,
+          const uint32_t offsets[4], int *out_width, int *out_height) {
+  width -= sub_width * ((int64_t)offsets[0] + offsets[1]);
+  height -= sub_height * ((int64_t)offsets[2] + offsets[3]);
+  if (width <= 0 || height <= 0 || width > MAX_DIMENSION ||
+      height > MAX_DIMENSION)
+    return false;
+  *out_width = (int)width;
+  *out_height = (int)height;
+  return true;
+}
+
+// 7.3.2.1.1 of H.264, up to frame_cropping
+bool h264_sps(BitReader &r, int *width, int *height) {
+  uint32_t profile = r.bits(8);
+  r.skip(16); // constraint flags, level_idc
+  r.ue();     // seq_parameter_set_id
+  uint32_t chroma_format = 1;
+  int separate_planes = 0;
+  switch (profile) {
+  case 100:
+  case 110:
+  case 122:
+  case 244:
+  case 44:
+  case 83:
+  case 86:
+  case 118:
+  case 128:
+  case 138:
+  case 139:
+  case 134:
+  case 135:
+    chroma_format = r.ue();
+    if (chroma_format > 3)
+      return false;
+    if (chroma_format == 3)
+      separate_planes = r.bit();
+    r.ue();    // bit_depth_luma_minus8
+    r.ue();    // bit_depth_chroma_minus8
+    r.skip(1); // qpprime_y_zero_transform_bypass_flag
+    // seq_scaling_matrix_present_flag
+    if (r.bit()) {
+      int lists = chroma_format != 3 ? 8 : 12;
+      for (int i = 0; i < lists && !r.error(); i++) {
+        if (r.bit())
+          skip_scaling_list(r, i < 6 ? 16 : 64);
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  r.ue(); // log2_max_frame_num_minus4
+  uint32_t poc_type = r.ue();
+  if (poc_type == 0) {
+    r.ue(); // log2_max_pic_order_cnt_lsb_minus4
+  } else if (poc_type == 1) {
+    r.skip(1); // delta_pic_order_always_zero_flag
+    r.se();    // offset_for_non_ref_pic
+    r.se();    // offset_for_top_to_bottom_field
+    uint32_t cycle = r.ue();
+    if (cycle > 255)
+      return false;
+    for (uint32_t i = 0; i < cycle && !r.error(); i++)
+      r.se();
+  }
+  r.ue();    // max_num_ref_frames
+  r.skip(1); // gaps_in_frame_num_value_allowed_flag
+  int64_t mbs_width = (int64_t)r.ue() + 1;
+  int64_t map_units_height = (int64_t)r.ue() + 1;
+  int frame_mbs_only = r.bit();
+  if (!frame_mbs_only)
+    r.skip(1); // mb_adaptive_frame_field_flag
+  r.skip(1);   // direct_8x8_inference_flag
+  uint32_t offsets[4] = {0, 0, 0, 0};
+  // frame_cropping_flag
+  if (r.bit()) {
+    for (int i = 0; i < 4; i++)
+      offsets[i] = r.ue();
+  }
+  if (r.error())
+    return false;
+  int64_t sub_width = 1;
+  int64_t sub_height = 2 - frame_mbs_only;
+  if (chroma_format != 0 && !separate_planes) {
+    sub_width = chroma_format == 3 ? 1 : 2;
+    sub_height *= chroma_format == 1 ? 2 : 1;
+  }
+  return crop(mbs_width * 16, (2 - frame_mbs_only) * map_units_height * 16,
+              sub_width, sub_height, offsets, width, height);
+}
+
+// 7.3.2.2.1 of H.265, up to conformance_window
+bool hevc_sps(BitReader &r, int *width, int *height) {
+  r.skip(4); // sps_video_parameter_set_id
+  int sub_layers = (int)r.bits(3); // sps_max_sub_layers_minus1
+  r.skip(1);                       // sps_temporal_id_nesting_flag
+  // general profile_tier_level, then general_level_idc
+  r.skip(88 + 8);
+  int profile_present[8] = {0};
+  int level_present[8] = {0};
+  for (int i = 0; i < sub_layers; i++) {
+    profile_present[i] = r.bit();
+    level_present[i] = r.bit();
+  }
+  if (sub_layers > 0) {
+    for (int i = sub_layers; i < 8; i++)
+      r.skip(2); // reserved_zero_2bits
+  }
+  for (int i = 0; i < sub_layers; i++) {
+    if (profile_present[i])
+      r.skip(88);
+    if (level_present[i])
+      r.skip(8);
+  }
+  r.ue(); // sps_seq_parameter_set_id
+  uint32_t chroma_format = r.ue();
+  if (chroma_format > 3)
+    return false;
+  int separate_planes = 0;
+  if (chroma_format == 3)
+    separate_planes = r.bit();
+  int64_t luma_width = r.ue();
+  int64_t luma_height = r.ue();
+  uint32_t offsets[4] = {0, 0, 0, 0};
+  // conformance_window_flag
+  if (r.bit()) {
+    for (int i = 0; i < 4; i++)
+      offsets[i] = r.ue();
+  }
+  if (r.error())
+    return false;
+  int64_t sub_width = 1;
+  int64_t sub_height = 1;
+  if (!separate_planes) {
+    sub_width = chroma_format == 1 || chroma_format == 2 ? 2 : 1;
+    sub_height = chroma_format == 1 ? 2 : 1;
+  }
+  return crop(luma_width, luma_height, sub_width, sub_height, offsets, width,
+              height);
+}
+
+} // namespace
+
+size_t find_start_code(const uint8_t *data, size_t size, size_t from) {
+  size_t i = from;
+  if (size < 3 || i > size - 3)
+    return size;
+#ifdef NAL_SSE2
+  // a block checks the start codes beginning at i .. i + 15
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  for (; i + BLOCK_SIZE + 2 <= size; i += BLOCK_SIZE) {
+    __m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+    __m128i b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+    __m128i hit = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+        _mm_cmpeq_epi8(b2, one));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return i + lowest_bit(mask);
+  }
+#elif defined(NAL_NEON)
+  const uint8x16_t one = vdupq_n_u8(1);
+  for (; i + BLOCK_SIZE + 2 <= size; i += BLOCK_SIZE) {
+    uint8x16_t zeros = vandq_u8(vceqzq_u8(vld1q_u8(data + i)),
+                                vceqzq_u8(vld1q_u8(data + i + 1)));
+    uint8x16_t hit = vandq_u8(zeros, vceqq_u8(vld1q_u8(data + i + 2), one));
+    if (vmaxvq_u8(hit) == 0)
+      continue;
+    for (size_t j = i;; j++) {
+      if (start_code_at(data + j))
+        return j;
+    }
+  }
+#endif
+  for (; i + 3 <= size; i++) {
+    if (start_code_at(data + i))
+      return i;
+  }
+  return size;
+}
+
+bool next(const uint8_t *data, size_t size, size_t *pos, bool is265,
+          Unit *unit) {
+  size_t start = find_start_code(data, size, *pos);
+  while (start < size) {
+    size_t begin = start + 3;
+    size_t end = find_start_code(data, size, begin);
+    // the zero of a 4 byte start code trails the unit before
+    size_t last = end;
+    while (last > begin && data[last - 1] == 0)
+      last--;
+    if (last > begin) {
+      *pos = end;
+      unit->data = data + begin;
+      unit->size = last - begin;
+      unit->type = is265 ? (data[begin] >> 1) & 0x3f : data[begin] & 0x1f;
+      return true;
+    }
+    start = end;
+  }
+  *pos = size;
+  return false;
+}
+
+bool is_key(int type, bool is265) {
+  return is265 ? type >= 16 && type <= 23 : type == 5;
+}
+
+bool is_parameter_set(int type, bool is265) {
+  return is265 ? type >= 32 && type <= 34 : type == 7 || type == 8;
+}
+
+bool is_sps(int type, bool is265) { return is265 ? type == 33 : type == 7; }
+
+bool sps_resolution(const uint8_t *data, size_t size, bool is265, int *width,
+                    int *height) {
+  // nal unit header
+  size_t header = is265 ? 2 : 1;
+  if (size <= header)
+    return false;
+  BitReader r(data + header, size - header);
+  return is265 ? hevc_sps(r, width, height) : h264_sps(r, width, height);
+}
+
+void Parser::parse(const uint8_t *data, size_t size, Summary *summary) {
+  *summary = {};
+  size_t pos = 0;
+  Unit unit;
+  while (next(data, size, &pos, is265_, &unit)) {
+    summary->units++;
+    if (is_key(unit.type, is265_))
+      summary->key = true;
+    if (!is_parameter_set(unit.type, is265_))
+      continue;
+    summary->parameter_sets = true;
+    if (!store(unit))
+      continue;
+    summary->changed = true;
+    if (is_sps(unit.type, is265_)) {
+      int width, height;
+      if (sps_resolution(unit.data, unit.size, is265_, &width, &height)) {
+        width_ = width;
+        height_ = height;
+      } else {
+        LOG_WARNF("unreadable SPS, %zu bytes", unit.size);
+      }
+    }
+  }
+  summary->width = width_;
+  summary->height = height_;
+}
+
+void Parser::reset() {
+  for (auto &set : sets_)
+    set.clear();
+  width_ = 0;
+  height_ = 0;
+}
+
+// Whether unit differs from the stored set of its type, which it replaces.
+bool Parser::store(const Unit &unit) {
+  std::vector<uint8_t> &set = sets_[is265_ ? unit.type - 32 : unit.type - 7];
+  if (set.size() == unit.size && memcmp(set.data(), unit.data, unit.size) == 0)
+    return false;
+  set.assign(unit.data, unit.data + unit.size);
+  return true;
+}
+
+} // namespace nal
+
+namespace {
+typedef struct NalUnit {
+  int offset;
+  int length;
+  int type;
+  int key;
+  int parameter_set;
+} NalUnit;
+
+typedef struct NalSummary {
+  int units;
+  int key;
+  int parameter_sets;
+  int changed;
+  int width;
+  int height;
+} NalSummary;
+} // namespace
+
+extern "C" int hwcodec_nal_next(const uint8_t *data, int length, int *pos,
+                                int is265, NalUnit *unit) {
+  if (!data || length <= 0 || !pos || *pos < 0 || !unit)
+    return 0;
+  size_t next_pos = (size_t)*pos;
+  nal::Unit u;
+  if (!nal::next(data, (size_t)length, &next_pos, is265 != 0, &u)) {
+    *pos = length;
+    return 0;
+  }
+  *pos = (int)next_pos;
+  unit->offset = (int)(u.data - data);
+  unit->length = (int)u.size;
+  unit->type = u.type;
+  unit->key = nal::is_key(u.type, is265 != 0) ? 1 : 0;
+  unit->parameter_set = nal::is_parameter_set(u.type, is265 != 0) ? 1 : 0;
+  return 1;
+}
+
+extern "C" int hwcodec_nal_sps_resolution(const uint8_t *data, int length,
+                                          int is265, int *width, int *height) {
+  if (!data || length <= 0 || !width || !height)
+    return -1;
+  return nal::sps_resolution(data, (size_t)length, is265 != 0, width, height)
+             ? 0
+             : -1;
+}
+
+extern "C" void *hwcodec_new_nal_parser(int is265) {
+  try {
+    return new nal::Parser(is265 != 0);
+  } catch (const std::exception &e) {
+    LOG_ERROR("new nal parser exception: " + std::string(e.what()));
+  }
+  return NULL;
+}
+
+extern "C" int hwcodec_nal_parse(void *parser, const uint8_t *data,
+                                 int length, NalSummary *summary) {
+  try {
+    if (!parser || !summary || (!data && length > 0) || length < 0)
+      return -1;
+    nal::Parser::Summary s;
+    ((nal::Parser *)parser)->parse(data, (size_t)length, &s);
+    summary->units = s.units;
+    summary->key = s.key ? 1 : 0;
+    summary->parameter_sets = s.parameter_sets ? 1 : 0;
+    summary->changed = s.changed ? 1 : 0;
+    summary->width = s.width;
+    summary->height = s.height;
+    return 0;
+  } catch (const std::exception &e) {
+    LOG_ERROR("nal_parse exception: " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" void hwcodec_nal_reset(void *parser) {
+  if (parser)
+    ((nal::Parser *)parser)->reset();
+}
+
+extern "C" void hwcodec_free_nal_parser(void *parser) {
+  delete (nal::Parser *)parser;
+}
@@ -0,0 +1,72 @@
+#ifndef NAL_H
+#define NAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace nal {
+
+// Offset of the first 00 00 01 start code at or after from, size if there is
+// none. Scans 16 bytes at a time with the vector unit of the cpu, so a packet
+// costs about one pass over memory and nothing is allocated.
+size_t find_start_code(const uint8_t *data, size_t size, size_t from);
+
+// A NAL unit of an Annex-B buffer, from its header byte up to the next start
+// code with trailing zeros removed.
+struct Unit {
+  const uint8_t *data;
+  size_t size;
+  int type; // nal_unit_type
+};
+
+// The unit after *pos, which it advances. Start with *pos = 0, returns false
+// after the last unit.
+bool next(const uint8_t *data, size_t size, size_t *pos, bool is265,
+          Unit *unit);
+
+// h264 IDR, hevc IRAP (IDR, CRA and BLA): decoding can start here
+bool is_key(int type, bool is265);
+// h264 SPS / PPS, hevc VPS / SPS / PPS
+bool is_parameter_set(int type, bool is265);
+bool is_sps(int type, bool is265);
+
+// The cropped picture size an SPS unit, header included, declares. Returns
+// false if the unit is truncated or uses syntax it doesn't read.
+bool sps_resolution(const uint8_t *data, size_t size, bool is265, int *width,
+                    int *height);
+
+// Remembers the parameter sets of a stream to tell when they change. The
+// sets are kept in buffers that only grow, so parse allocates nothing once
+// the first sets are stored.
+class Parser {
+public:
+  struct Summary {
+    int units;
+    bool key;
+    bool parameter_sets;
+    // a VPS / SPS / PPS differs from the one stored with the same type
+    bool changed;
+    // from the last SPS seen, 0 before the first one
+    int width;
+    int height;
+  };
+
+  explicit Parser(bool is265) : is265_(is265) {}
+
+  void parse(const uint8_t *data, size_t size, Summary *summary);
+  void reset();
+
+private:
+  bool store(const Unit &unit);
+
+  bool is265_;
+  // indexed by type - first parameter set type
+  std::vector<uint8_t> sets_[3];
+  int width_ = 0;
+  int height_ = 0;
+};
+
+} // namespace nal
+
+#endif // NAL_H
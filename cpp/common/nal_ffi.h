@@ -0,0 +1,40 @@
+#ifndef NAL_FFI_H
+#define NAL_FFI_H
+
+#include <stdint.h>
+
+typedef struct NalUnit {
+  int offset; // of the header byte in the buffer
+  int length; // start code and trailing zeros excluded
+  int type;   // nal_unit_type
+  int key;    // h264 IDR, hevc IDR / CRA / BLA
+  int parameter_set;
+} NalUnit;
+
+typedef struct NalSummary {
+  int units;
+  int key;
+  int parameter_sets;
+  // a VPS / SPS / PPS is new or differs from the last one of its type
+  int changed;
+  // of the last SPS the parser read, 0 before the first one
+  int width;
+  int height;
+} NalSummary;
+
+// 1 with the unit after *pos in an Annex-B buffer, 0 after the last one.
+// Start with *pos = 0.
+int hwcodec_nal_next(const uint8_t *data, int length, int *pos, int is265,
+                     NalUnit *unit);
+// 0 with the cropped size an SPS unit declares, -1 if it can't be read
+int hwcodec_nal_sps_resolution(const uint8_t *data, int length, int is265,
+                               int *width, int *height);
+
+void *hwcodec_new_nal_parser(int is265);
+int hwcodec_nal_parse(void *parser, const uint8_t *data, int length,
+                      NalSummary *summary);
+// Forget the stored parameter sets, e.g. after a seek.
+void hwcodec_nal_reset(void *parser);
+void hwcodec_free_nal_parser(void *parser);
+
+#endif // NAL_FFI_H
@@ -0,0 +1,99 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+
+// Per stage timing probes. They compile to nothing unless CFG_PROFILE is
+// defined, which build.rs does for the `profile` cargo feature.
+// #define CFG_PROFILE
+
+#define PROFILE_RING_SIZE 4096 // must be a power of two
+
+#ifdef CFG_PROFILE
+#define PROFILE_START(name) int64_t name = profile_now()
+#define PROFILE_STOP(profiler, stage, name) (profiler).record(stage, name)
+#else
+#define PROFILE_START(name)
+#define PROFILE_STOP(profiler, stage, name)
+#endif
+
+inline int64_t profile_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Keeps the last PROFILE_RING_SIZE stage durations. record() never blocks and
+// may be called from several threads, snapshot() skips the slots that are
+// being overwritten while it reads them.
+class Profiler {
+public:
+  void record(int stage, int64_t start_ns) {
+    int64_t duration = profile_now() - start_ns;
+    uint64_t index = head_.fetch_add(1, std::memory_order_relaxed);
+    Record &r = ring_[index & (PROFILE_RING_SIZE - 1)];
+    // odd while writing, so readers can tell a torn record
+    r.seq.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    r.stage.store(stage, std::memory_order_relaxed);
+    r.duration_ns.store(duration, std::memory_order_relaxed);
+    r.seq.store(index * 2 + 2, std::memory_order_release);
+  }
+
+  // Fold the retained records into stats[stage], count is the number of
+  // stages. With reset, the folded records are not reported again.
+  void snapshot(ProfileStats *stats, int count, bool reset) {
+    memset(stats, 0, sizeof(ProfileStats) * count);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (head - tail > PROFILE_RING_SIZE)
+      tail = head - PROFILE_RING_SIZE;
+    for (uint64_t i = tail; i < head; i++) {
+      Record &r = ring_[i & (PROFILE_RING_SIZE - 1)];
+      uint64_t seq = r.seq.load(std::memory_order_acquire);
+      if (seq != i * 2 + 2)
+        continue;
+      int stage = r.stage.load(std::memory_order_relaxed);
+      int64_t duration = r.duration_ns.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (r.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+      if (stage >= 0 && stage < count)
+        add(stats[stage], duration);
+    }
+    if (reset)
+      tail_.store(head, std::memory_order_relaxed);
+  }
+
+private:
+  struct Record {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<int> stage{0};
+    std::atomic<int64_t> duration_ns{0};
+  };
+
+  static void add(ProfileStats &s, int64_t duration) {
+    if (s.count == 0 || duration < s.min_ns)
+      s.min_ns = duration;
+    if (duration > s.max_ns)
+      s.max_ns = duration;
+    s.count++;
+    s.total_ns += duration;
+    int64_t us = duration / 1000;
+    int bucket = 0;
+    while (bucket < PROFILE_BUCKETS - 1 && ((int64_t)1 << bucket) <= us)
+      bucket++;
+    s.buckets[bucket]++;
+  }
+
+  Record ring_[PROFILE_RING_SIZE];
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+};
+
+#endif // PROFILE_H
@@ -0,0 +1,118 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers for splitting one job into independent tasks, e.g. row
+// bands of a frame. run() takes a plain function and context so dispatching
+// never allocates.
+class ThreadPool {
+public:
+  typedef void (*Task)(void *ctx, int index);
+
+  // threads workers are spawned, run() also uses the calling thread.
+  explicit ThreadPool(int threads) {
+    for (int i = 0; i < threads; i++)
+      threads_.emplace_back(&ThreadPool::worker, this);
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &t : threads_)
+      t.join();
+  }
+
+  // Number of threads a job is spread over, including the caller.
+  int size() const { return (int)threads_.size() + 1; }
+
+  // Calls task(ctx, i) for every i in [0, count) and returns once all are done.
+  void run(int count, Task task, void *ctx) {
+    if (count <= 0)
+      return;
+    if (threads_.empty() || count == 1) {
+      for (int i = 0; i < count; i++)
+        task(ctx, i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = task;
+      ctx_ = ctx;
+      count_ = count;
+      done_ = 0;
+      next_.store(0, std::memory_order_relaxed);
+      generation_++;
+    }
+    work_cv_.notify_all();
+    int done = drain(task, ctx, count);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_ += done;
+    // workers still inside drain() would take indices of the next job, late
+    // ones skip the job once it is done
+    done_cv_.wait(lock, [this] { return done_ == count_ && active_ == 0; });
+  }
+
+private:
+  int drain(Task task, void *ctx, int count) {
+    int done = 0;
+    int i;
+    while ((i = next_.fetch_add(1, std::memory_order_relaxed)) < count) {
+      task(ctx, i);
+      done++;
+    }
+    return done;
+  }
+
+  void worker() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_)
+        return;
+      seen = generation_;
+      // woke after the job finished, run() may already have returned and ctx_
+      // point into a stack frame that is gone
+      if (done_ == count_)
+        continue;
+      Task task = task_;
+      void *ctx = ctx_;
+      int count = count_;
+      active_++;
+      lock.unlock();
+      int done = drain(task, ctx, count);
+      lock.lock();
+      active_--;
+      done_ += done;
+      if (done_ == count_ && active_ == 0)
+        done_cv_.notify_all();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  Task task_ = nullptr;
+  void *ctx_ = nullptr;
+  int count_ = 0;
+  int done_ = 0;
+  int active_ = 0;
+  uint64_t generation_ = 0;
+  bool stop_ = false;
+  std::atomic<int> next_{0};
+};
+
+#endif // THREAD_POOL_H
@@ -17,9 +17,25 @@ bool set_rate_control(AVCodecContext *c, const std::string &name, int rc,
                       int q);
 bool set_gpu(void *priv_data, const std::string &name, int gpu);
 bool force_hw(void *priv_data, const std::string &name);
-bool set_others(void *priv_data, const std::string &name);
+// refresh_period > 0 turns on intra refresh over that many frames in
+// refresh_direction, a RefreshDirection
+bool set_others(AVCodecContext *c, const std::string &name, int refresh_period,
+                int refresh_direction);
+// whether intra refresh of name takes its period from gop_size, which then
+// can't be changed on its own
+bool refresh_uses_gop(const std::string &name);
 
 bool change_bit_rate(AVCodecContext *c, const std::string &name, int kbs);
+bool change_framerate(AVCodecContext *c, int fps);
+bool change_gop(AVCodecContext *c, const std::string &name, int gop);
+// RATE_* settings the FFmpeg wrapper of name passes on to a running encoder
+// when the context changes, the others need a reopen
+#define RATE_BITRATE 1
+#define RATE_FRAMERATE 2
+#define RATE_GOP 4
+int dynamic_rate(const std::string &name);
+// whether the encoder reads AV_FRAME_DATA_REGIONS_OF_INTEREST
+bool support_roi(const std::string &name);
 
 } // namespace util
 
@@ -17,19 +17,23 @@ extern "C" {
 
 namespace util {
 
-void set_av_codec_ctx(AVCodecContext *c, const std::string &name, int kbs,
-                      int gop, int fps) {
-  c->has_b_frames = 0;
-  c->max_b_frames = 0;
+static int gop_size(const std::string &name, int gop) {
   if (gop > 0 && gop < std::numeric_limits<int16_t>::max()) {
-    c->gop_size = gop;
+    return gop;
   } else if (name.find("vaapi") != std::string::npos) {
-    c->gop_size = std::numeric_limits<int16_t>::max();
+    return std::numeric_limits<int16_t>::max();
   } else if (name.find("qsv") != std::string::npos) {
-    c->gop_size = std::numeric_limits<uint16_t>::max();
+    return std::numeric_limits<uint16_t>::max();
   } else {
-    c->gop_size = std::numeric_limits<int>::max();
+    return std::numeric_limits<int>::max();
   }
+}
+
+void set_av_codec_ctx(AVCodecContext *c, const std::string &name, int kbs,
+                      int gop, int fps) {
+  c->has_b_frames = 0;
+  c->max_b_frames = 0;
+  c->gop_size = gop_size(name, gop);
   c->keyint_min = std::numeric_limits<int>::max();
   /* put sample parameters */
   // https://github.com/FFmpeg/FFmpeg/blob/415f012359364a77e8394436f222b74a8641a3ee/libavcodec/encode.c#L581
@@ -89,6 +93,14 @@ bool set_lantency_free(void *priv_data, const std::string &name) {
       return false;
     }
   }
+  // no lookahead or frame threads, a packet comes back for every frame
+  if (name.find("libx264") != std::string::npos ||
+      name.find("libx265") != std::string::npos) {
+    if ((ret = av_opt_set(priv_data, "tune", "zerolatency", 0)) < 0) {
+      LOG_ERROR(name + " set_lantency_free failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  }
   if (name.find("videotoolbox") != std::string::npos) {
     if ((ret = av_opt_set_int(priv_data, "realtime", 1, 0)) < 0) {
       LOG_ERROR("videotoolbox set realtime failed, ret = " + av_err2str(ret));
@@ -270,8 +282,57 @@ bool force_hw(void *priv_data, const std::string &name) {
   return true;
 }
 
-bool set_others(void *priv_data, const std::string &name) {
+bool refresh_uses_gop(const std::string &name) {
+  return name.find("nvenc") != std::string::npos ||
+         name.find("libx264") != std::string::npos;
+}
+
+static bool set_intra_refresh(AVCodecContext *c, const std::string &name,
+                              int period, int direction) {
+  int ret;
+  void *priv_data = c->priv_data;
+
+  if (refresh_uses_gop(name)) {
+    // keyframes are then only sent on request
+    c->gop_size = period;
+    if ((ret = av_opt_set_int(priv_data, "intra-refresh", 1, 0)) < 0) {
+      LOG_ERROR(name + " set intra-refresh failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    return true;
+  }
+  if (name.find("qsv") != std::string::npos) {
+    // vertical refresh regions are columns
+    const char *type = direction == REFRESH_ROWS ? "horizontal" : "vertical";
+    if ((ret = av_opt_set(priv_data, "int_ref_type", type, 0)) < 0) {
+      LOG_ERROR("qsv set int_ref_type failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    ret = av_opt_set_int(priv_data, "int_ref_cycle_size", period, 0);
+    if (ret < 0) {
+      LOG_ERROR("qsv set int_ref_cycle_size failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    return true;
+  }
+  if (name.find("h264_amf") != std::string::npos) {
+    // amf refreshes macroblocks in raster order, so always by rows
+    int mbs = ((c->width + 15) / 16) * ((c->height + 15) / 16);
+    if ((ret = av_opt_set_int(priv_data, "intra_refresh_mb",
+                              (mbs + period - 1) / period, 0)) < 0) {
+      LOG_ERROR("amf set intra_refresh_mb failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    return true;
+  }
+  LOG_WARN("intra refresh is not supported by " + name);
+  return true;
+}
+
+bool set_others(AVCodecContext *c, const std::string &name, int refresh_period,
+                int refresh_direction) {
   int ret;
+  void *priv_data = c->priv_data;
   if (name.find("_mf") != std::string::npos) {
     // ff_eAVScenarioInfo_DisplayRemoting = 1
     if ((ret = av_opt_set_int(priv_data, "scenario", 1, 0)) < 0) {
@@ -287,6 +348,27 @@ bool set_others(void *priv_data, const std::string &name) {
       return false;
     }
   }
+  // Make a frame with pict_type AV_PICTURE_TYPE_I an IDR frame instead of an
+  // intra frame that still follows the open GOP. vaapi, mediafoundation and
+  // libvpx do that without an option.
+  if (name.find("nvenc") != std::string::npos ||
+      name.find("libx264") != std::string::npos ||
+      name.find("libx265") != std::string::npos) {
+    if ((ret = av_opt_set_int(priv_data, "forced-idr", 1, 0)) < 0) {
+      LOG_ERROR(name + " set forced-idr failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  }
+  if (name.find("amf") != std::string::npos ||
+      name.find("qsv") != std::string::npos) {
+    // not in older FFmpeg amf, which then encodes an intra frame
+    if ((ret = av_opt_set_int(priv_data, "forced_idr", 1, 0)) < 0) {
+      LOG_WARN(name + " set forced_idr failed, ret = " + av_err2str(ret));
+    }
+  }
+  if (refresh_period > 0 &&
+      !set_intra_refresh(c, name, refresh_period, refresh_direction))
+    return false;
   return true;
 }
 
@@ -299,4 +381,42 @@ bool change_bit_rate(AVCodecContext *c, const std::string &name, int kbs) {
   }
   return true;
 }
+
+bool change_framerate(AVCodecContext *c, int fps) {
+  if (fps > 0)
+    c->framerate = av_make_q(fps, 1);
+  return true;
+}
+
+bool change_gop(AVCodecContext *c, const std::string &name, int gop) {
+  c->gop_size = gop_size(name, gop);
+  return true;
+}
+
+int dynamic_rate(const std::string &name) {
+  // nvenc and libx264 compare bit_rate with their config before every frame,
+  // qsv also gop_size and framerate since FFmpeg 6 (libavcodec 60), before
+  // that it reads them only when opening
+  if (name.find("qsv") != std::string::npos) {
+#if LIBAVCODEC_VERSION_MAJOR >= 60
+    return RATE_BITRATE | RATE_FRAMERATE | RATE_GOP;
+#else
+    return 0;
+#endif
+  }
+  if (name.find("nvenc") != std::string::npos ||
+      name.find("libx264") != std::string::npos)
+    return RATE_BITRATE;
+  return 0;
+}
+
+bool support_roi(const std::string &name) {
+  std::vector<std::string> names = {"libx264", "libx265", "libvpx", "qsv",
+                                    "vaapi"};
+  for (auto &n : names) {
+    if (name.find(n) != std::string::npos)
+      return true;
+  }
+  return false;
+}
 } // namespace util
\ No newline at end of file
@@ -3,16 +3,24 @@
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/log.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
 }
 
+#include <atomic>
 #include <memory>
 #include <stdbool.h>
+#include <string.h>
+#include <thread>
+#include <vector>
 
 #define LOG_MODULE "FFMPEG_RAM_DEC"
+#include <bounded_queue.h>
 #include <log.h>
+#include <profile.h>
 
 #ifdef _WIN32
 #include <libavutil/hwcontext_d3d11va.h>
@@ -28,6 +36,28 @@ typedef void (*RamDecodeCallback)(const void *obj, int width, int height,
                                   enum AVPixelFormat pixfmt,
                                   int linesize[AV_NUM_DATA_POINTERS],
                                   uint8_t *data[AV_NUM_DATA_POINTERS], int key);
+// The callee takes ownership of frame and must release it with
+// ffmpeg_ram_free_frame.
+typedef void (*RamDecodeFrameCallback)(void *frame, const void *obj, int width,
+                                       int height, enum AVPixelFormat pixfmt,
+                                       int linesize[AV_NUM_DATA_POINTERS],
+                                       uint8_t *data[AV_NUM_DATA_POINTERS],
+                                       int key);
+
+// Alignment of the planes downloaded into pooled buffers
+#define POOL_FRAME_ALIGN 32
+
+// Image written by decode_into, length is the size of the caller's buffer on
+// input and the size of the image on output.
+typedef struct RamDecodeTarget {
+  uint8_t *data;
+  int length;
+  int width;
+  int height;
+  int pixfmt;
+  int linesize[AV_NUM_DATA_POINTERS];
+  int key;
+} RamDecodeTarget;
 
 class FFmpegRamDecoder {
 public:
@@ -44,6 +74,48 @@ public:
   RamDecodeCallback callback_ = NULL;
   DataFormat data_format_;
 
+  // recycled system memory for hw downloads of lent frames
+  AVBufferPool *pool_ = NULL;
+  int pool_buffer_size_ = 0;
+  int pool_count_ = 0;
+
+  // output stage, off while out_format_ is AV_PIX_FMT_NONE. A zero size
+  // keeps the decoded one.
+  AVPixelFormat out_format_ = AV_PIX_FMT_NONE;
+  int out_width_ = 0;
+  int out_height_ = 0;
+  int out_flags_ = SWS_BILINEAR;
+  int out_threads_ = 1;
+  // rebuilt whenever the decoded frames stop matching what it was made for
+  SwsContext *sws_ = NULL;
+  int sws_width_ = 0;
+  int sws_height_ = 0;
+  int sws_format_ = AV_PIX_FMT_NONE;
+  int sws_colorspace_ = AVCOL_SPC_UNSPECIFIED;
+  int sws_range_ = AVCOL_RANGE_UNSPECIFIED;
+  AVFrame *out_frame_ = NULL;
+  AVBufferPool *out_pool_ = NULL;
+  int out_pool_size_ = 0;
+  // set for the duration of decode_into
+  RamDecodeTarget *into_ = NULL;
+
+  // pipeline mode: intake -> decode_thread_ -> download_thread_
+  std::atomic<bool> pipeline_ = {false};
+  std::thread decode_thread_;
+  std::thread download_thread_;
+  std::vector<std::vector<uint8_t> *> packet_slots_;
+  std::vector<AVFrame *> frame_slots_;
+  BoundedQueue<std::vector<uint8_t> *> *free_packets_ = NULL;
+  BoundedQueue<std::vector<uint8_t> *> *pending_packets_ = NULL;
+  BoundedQueue<AVFrame *> *free_frames_ = NULL;
+  BoundedQueue<AVFrame *> *decoded_frames_ = NULL;
+  RamDecodeFrameCallback pipeline_callback_ = NULL;
+  const void *pipeline_obj_ = NULL;
+
+#ifdef CFG_PROFILE
+  Profiler profiler_;
+#endif
+
 #ifdef CFG_PKG_TRACE
   int in_ = 0;
   int out_ = 0;
@@ -60,6 +132,7 @@ public:
   ~FFmpegRamDecoder() {}
 
   void free_decoder() {
+    stop_pipeline();
     if (frame_)
       av_frame_free(&frame_);
     if (pkt_)
@@ -70,12 +143,25 @@ public:
       avcodec_free_context(&c_);
     if (hw_device_ctx_)
       av_buffer_unref(&hw_device_ctx_);
+    // buffers still lent out keep the pool alive until they are returned
+    if (pool_)
+      av_buffer_pool_uninit(&pool_);
+    if (out_frame_)
+      av_frame_free(&out_frame_);
+    if (out_pool_)
+      av_buffer_pool_uninit(&out_pool_);
+    free_sws();
 
     frame_ = NULL;
     pkt_ = NULL;
     sw_frame_ = NULL;
     c_ = NULL;
     hw_device_ctx_ = NULL;
+    pool_ = NULL;
+    pool_buffer_size_ = 0;
+    out_frame_ = NULL;
+    out_pool_ = NULL;
+    out_pool_size_ = 0;
   }
   int reset() {
     if (name_.find("h264") != std::string::npos) {
@@ -142,6 +228,11 @@ public:
       return -1;
     }
 
+    if (!(out_frame_ = av_frame_alloc())) {
+      LOG_ERROR("av_frame_alloc failed");
+      return -1;
+    }
+
     if ((ret = avcodec_open2(c_, codec, NULL)) != 0) {
       LOG_ERROR("avcodec_open2 failed, ret = " + av_err2str(ret));
       return -1;
@@ -154,78 +245,651 @@ public:
     return 0;
   }
 
-  int decode(const uint8_t *data, int length, const void *obj) {
+  int decode(const uint8_t *data, int length, const void *obj,
+             RamDecodeFrameCallback frame_callback = NULL) {
     int ret = -1;
 #ifdef CFG_PKG_TRACE
     in_++;
-    LOG_DEBUG("delay DI: in:" + in_ + " out:" + out_);
+    LOG_DEBUGF("delay DI: in:%d out:%d", in_, out_);
 #endif
 
     if (!data || !length) {
-      LOG_ERROR("illegal decode parameter");
+      LOG_ERRORF("illegal decode parameter");
+      return -1;
+    }
+    if (pipeline_) {
+      LOG_ERRORF("decode called while pipeline mode is running");
       return -1;
     }
     pkt_->data = (uint8_t *)data;
     pkt_->size = length;
-    ret = do_decode(obj);
+    PROFILE_START(total);
+    ret = do_decode(obj, frame_callback);
+    PROFILE_STOP(profiler_, DECODE_STAGE_TOTAL, total);
     return ret;
   }
 
+  // Decode into the caller's buffer instead of calling back, packed with no
+  // padding between rows. If the packet holds several frames, the last wins.
+  int decode_into(const uint8_t *data, int length, RamDecodeTarget *target) {
+    int ret;
+
+    if (!target || !target->data) {
+      LOG_ERRORF("illegal decode_into parameter");
+      return -1;
+    }
+    into_ = target;
+    ret = decode(data, length, NULL);
+    into_ = NULL;
+    return ret;
+  }
+
+  // Convert every decoded frame to format at width x height with the given
+  // ScaleAlgorithm on threads slice threads, 0 for one per core. Format
+  // AV_PIX_FMT_NONE turns it off.
+  int set_output(int format, int width, int height, int algorithm,
+                 int threads) {
+    int flags;
+
+    if (pipeline_) {
+      LOG_ERROR("set_output called while pipeline mode is running");
+      return -1;
+    }
+    if (width < 0 || height < 0 || threads < 0) {
+      LOG_ERROR("invalid output size " + std::to_string(width) + "x" +
+                std::to_string(height) + ", threads " +
+                std::to_string(threads));
+      return -1;
+    }
+    if (format != AV_PIX_FMT_NONE &&
+        !sws_isSupportedOutput((AVPixelFormat)format)) {
+      LOG_ERROR("unsupported output pixfmt " + std::to_string(format));
+      return -1;
+    }
+    switch (algorithm) {
+    case SCALE_FAST_BILINEAR:
+      flags = SWS_FAST_BILINEAR;
+      break;
+    case SCALE_BILINEAR:
+      flags = SWS_BILINEAR;
+      break;
+    case SCALE_BICUBIC:
+      flags = SWS_BICUBIC;
+      break;
+    case SCALE_POINT:
+      flags = SWS_POINT;
+      break;
+    case SCALE_AREA:
+      flags = SWS_AREA;
+      break;
+    case SCALE_LANCZOS:
+      flags = SWS_LANCZOS;
+      break;
+    default:
+      LOG_ERROR("unknown scale algorithm " + std::to_string(algorithm));
+      return -1;
+    }
+    out_format_ = (AVPixelFormat)format;
+    out_width_ = width;
+    out_height_ = height;
+    out_flags_ = flags;
+    out_threads_ = threads;
+    free_sws();
+    return 0;
+  }
+
+  // Split decoding into three stages connected by rings of depth slots:
+  // packets are copied in on the submitting thread, decoded on one worker and
+  // downloaded and handed to callback on another.
+  int start_pipeline(int depth, RamDecodeFrameCallback callback,
+                     const void *obj) {
+    if (pipeline_) {
+      LOG_ERROR("pipeline already started");
+      return -1;
+    }
+    if (depth <= 0 || !callback) {
+      LOG_ERROR("invalid pipeline parameter, depth: " + std::to_string(depth));
+      return -1;
+    }
+    free_packets_ = new BoundedQueue<std::vector<uint8_t> *>(depth);
+    pending_packets_ = new BoundedQueue<std::vector<uint8_t> *>(depth);
+    free_frames_ = new BoundedQueue<AVFrame *>(depth);
+    decoded_frames_ = new BoundedQueue<AVFrame *>(depth);
+    for (int i = 0; i < depth; i++) {
+      packet_slots_.push_back(new std::vector<uint8_t>());
+      free_packets_->try_push(packet_slots_.back());
+      AVFrame *frame = av_frame_alloc();
+      if (!frame) {
+        LOG_ERROR("av_frame_alloc failed");
+        stop_pipeline();
+        return -1;
+      }
+      frame_slots_.push_back(frame);
+      free_frames_->try_push(frame);
+    }
+    pipeline_callback_ = callback;
+    pipeline_obj_ = obj;
+    pipeline_ = true;
+    decode_thread_ = std::thread(&FFmpegRamDecoder::decode_loop, this);
+    download_thread_ = std::thread(&FFmpegRamDecoder::download_loop, this);
+    return 0;
+  }
+
+  // AVERROR(EAGAIN) if every packet slot is still waiting to be decoded
+  int submit(const uint8_t *data, int length) {
+    std::vector<uint8_t> *slot = NULL;
+
+    if (!pipeline_) {
+      LOG_ERRORF("submit called before start_pipeline");
+      return -1;
+    }
+    if (!data || length <= 0) {
+      LOG_ERRORF("illegal submit parameter");
+      return -1;
+    }
+    if (!free_packets_->try_pop(slot))
+      return AVERROR(EAGAIN);
+    // slots keep their capacity, so this only allocates while warming up
+    slot->resize(length + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(slot->data(), data, length);
+    memset(slot->data() + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    slot->resize(length);
+    pending_packets_->try_push(slot);
+    return 0;
+  }
+
+  // Block until every submitted packet has been through all stages.
+  void flush_pipeline() {
+    if (!pipeline_)
+      return;
+    free_packets_->wait_full();
+    free_frames_->wait_full();
+  }
+
+  void stop_pipeline() {
+    // the decode stage closes decoded_frames_ once it has drained its input
+    if (pending_packets_)
+      pending_packets_->close();
+    if (decode_thread_.joinable())
+      decode_thread_.join();
+    if (decoded_frames_)
+      decoded_frames_->close();
+    if (download_thread_.joinable())
+      download_thread_.join();
+    pipeline_ = false;
+    for (auto &slot : packet_slots_)
+      delete slot;
+    packet_slots_.clear();
+    for (auto &frame : frame_slots_)
+      av_frame_free(&frame);
+    frame_slots_.clear();
+    BoundedQueue<std::vector<uint8_t> *> **packet_queues[] = {
+        &free_packets_, &pending_packets_};
+    for (auto queue : packet_queues) {
+      delete *queue;
+      *queue = NULL;
+    }
+    BoundedQueue<AVFrame *> **frame_queues[] = {&free_frames_,
+                                                &decoded_frames_};
+    for (auto queue : frame_queues) {
+      delete *queue;
+      *queue = NULL;
+    }
+    pipeline_callback_ = NULL;
+    pipeline_obj_ = NULL;
+  }
+
+  int set_frame_pool(int count) {
+    if (count < 0) {
+      LOG_ERROR("invalid frame pool count: " + std::to_string(count));
+      return -1;
+    }
+    pool_count_ = count;
+    return 0;
+  }
+
+  int profile(ProfileStats *stats, int count, bool reset) {
+#ifdef CFG_PROFILE
+    profiler_.snapshot(stats, count, reset);
+    return 0;
+#else
+    (void)stats;
+    (void)count;
+    (void)reset;
+    return -1;
+#endif
+  }
+
 private:
-  int do_decode(const void *obj) {
+  int do_decode(const void *obj, RamDecodeFrameCallback frame_callback) {
     int ret;
     AVFrame *tmp_frame = NULL;
+    AVFrame *lent_frame = NULL;
     bool decoded = false;
 
+    PROFILE_START(send);
     ret = avcodec_send_packet(c_, pkt_);
+    PROFILE_STOP(profiler_, DECODE_STAGE_SEND_PACKET, send);
     if (ret < 0) {
-      LOG_ERROR("avcodec_send_packet failed, ret = " + av_err2str(ret));
+      LOG_ERRORF("avcodec_send_packet failed, ret = %s", av_err2cstr(ret));
       return ret;
     }
 
     while (ret >= 0) {
-      if ((ret = avcodec_receive_frame(c_, frame_)) != 0) {
+      PROFILE_START(receive);
+      ret = avcodec_receive_frame(c_, frame_);
+      PROFILE_STOP(profiler_, DECODE_STAGE_RECEIVE_FRAME, receive);
+      if (ret != 0) {
         if (ret != AVERROR(EAGAIN)) {
-          LOG_ERROR("avcodec_receive_frame failed, ret = " + av_err2str(ret));
+          LOG_ERRORF("avcodec_receive_frame failed, ret = %s",
+                     av_err2cstr(ret));
         }
         goto _exit;
       }
 
+#if FF_API_FRAME_KEY
+      int key_frame = frame_->flags & AV_FRAME_FLAG_KEY;
+#else
+      int key_frame = frame_->key_frame;
+#endif
+      if (frame_callback) {
+        if (!(lent_frame = av_frame_alloc())) {
+          LOG_ERRORF("av_frame_alloc failed");
+          goto _exit;
+        }
+      }
+
       if (hwaccel_) {
         if (!frame_->hw_frames_ctx) {
-          LOG_ERROR("hw_frames_ctx is NULL");
+          LOG_ERRORF("hw_frames_ctx is NULL");
           goto _exit;
         }
-        if ((ret = av_hwframe_transfer_data(sw_frame_, frame_, 0)) < 0) {
-          LOG_ERROR("av_hwframe_transfer_data failed, ret = " +
-                    av_err2str(ret));
+        AVFrame *dst = sw_frame_;
+        PROFILE_START(download);
+        // a converted frame is lent from out_pool_ instead
+        if (lent_frame && !converts(frame_)) {
+          if ((ret = get_pool_frame(lent_frame, frame_)) < 0)
+            goto _exit;
+          dst = lent_frame;
+        }
+        if ((ret = av_hwframe_transfer_data(dst, frame_, 0)) < 0) {
+          LOG_ERRORF("av_hwframe_transfer_data failed, ret = %s",
+                     av_err2cstr(ret));
           goto _exit;
         }
+        PROFILE_STOP(profiler_, DECODE_STAGE_DOWNLOAD, download);
 
-        tmp_frame = sw_frame_;
+        tmp_frame = dst;
+      } else if (lent_frame && !converts(frame_)) {
+        // decoder output is already refcounted, lend it as is
+        av_frame_move_ref(lent_frame, frame_);
+        tmp_frame = lent_frame;
       } else {
         tmp_frame = frame_;
       }
+
+      if (into_) {
+        if ((ret = write_into(tmp_frame, key_frame)) < 0)
+          goto _exit;
+        decoded = true;
+        continue;
+      }
+      if (tmp_frame != lent_frame && converts(tmp_frame)) {
+        AVFrame *dst = lent_frame ? lent_frame : out_frame_;
+        av_frame_unref(out_frame_);
+        PROFILE_START(scale);
+        if ((ret = convert(dst, tmp_frame)) < 0)
+          goto _exit;
+        PROFILE_STOP(profiler_, DECODE_STAGE_CONVERT, scale);
+        tmp_frame = dst;
+      }
       decoded = true;
 #ifdef CFG_PKG_TRACE
       out_++;
-      LOG_DEBUG("delay DO: in:" + in_ + " out:" + out_);
-#endif
-#if FF_API_FRAME_KEY
-      int key_frame = frame_->flags & AV_FRAME_FLAG_KEY;
-#else
-      int key_frame = frame_->key_frame;
+      LOG_DEBUGF("delay DO: in:%d out:%d", in_, out_);
 #endif
 
-      callback_(obj, tmp_frame->width, tmp_frame->height,
-                (AVPixelFormat)tmp_frame->format, tmp_frame->linesize,
-                tmp_frame->data, key_frame);
+      PROFILE_START(callback);
+      if (lent_frame) {
+        AVFrame *f = lent_frame;
+        lent_frame = NULL;
+        frame_callback(f, obj, f->width, f->height, (AVPixelFormat)f->format,
+                       f->linesize, f->data, key_frame);
+      } else {
+        callback_(obj, tmp_frame->width, tmp_frame->height,
+                  (AVPixelFormat)tmp_frame->format, tmp_frame->linesize,
+                  tmp_frame->data, key_frame);
+      }
+      PROFILE_STOP(profiler_, DECODE_STAGE_CALLBACK, callback);
     }
   _exit:
+    if (lent_frame)
+      av_frame_free(&lent_frame);
     av_packet_unref(pkt_);
     return decoded ? 0 : -1;
   }
 
+  void decode_loop() {
+    std::vector<uint8_t> *slot = NULL;
+    AVFrame *frame = NULL;
+    int ret;
+
+    while (pending_packets_->pop(slot)) {
+      pkt_->data = slot->data();
+      pkt_->size = (int)slot->size();
+      PROFILE_START(send);
+      ret = avcodec_send_packet(c_, pkt_);
+      PROFILE_STOP(profiler_, DECODE_STAGE_SEND_PACKET, send);
+      av_packet_unref(pkt_);
+      if (ret < 0)
+        LOG_ERRORF("avcodec_send_packet failed, ret = %s", av_err2cstr(ret));
+      while (ret >= 0) {
+        PROFILE_START(receive);
+        ret = avcodec_receive_frame(c_, frame_);
+        PROFILE_STOP(profiler_, DECODE_STAGE_RECEIVE_FRAME, receive);
+        if (ret != 0) {
+          if (ret != AVERROR(EAGAIN)) {
+            LOG_ERRORF("avcodec_receive_frame failed, ret = %s",
+                       av_err2cstr(ret));
+          }
+          break;
+        }
+        // waits for the download stage to hand a slot back. With hw decoders
+        // every slot pins a surface, keep depth within the decoder's pool.
+        if (!free_frames_->pop(frame))
+          break;
+        av_frame_move_ref(frame, frame_);
+        decoded_frames_->push(frame);
+      }
+      // returned last so flush_pipeline sees its frames already queued
+      free_packets_->try_push(slot);
+    }
+    decoded_frames_->close();
+  }
+
+  void download_loop() {
+    AVFrame *frame = NULL;
+    AVFrame *lent_frame = NULL;
+    int ret;
+
+    while (decoded_frames_->pop(frame)) {
+#if FF_API_FRAME_KEY
+      int key_frame = frame->flags & AV_FRAME_FLAG_KEY;
+#else
+      int key_frame = frame->key_frame;
+#endif
+      PROFILE_START(total);
+      PROFILE_START(download);
+      AVFrame *src = frame;
+      bool convert_frame = false;
+      if (!(lent_frame = av_frame_alloc())) {
+        LOG_ERRORF("av_frame_alloc failed");
+      } else if (hwaccel_) {
+        if (!frame->hw_frames_ctx) {
+          LOG_ERRORF("hw_frames_ctx is NULL");
+          av_frame_free(&lent_frame);
+        } else if ((convert_frame = converts(frame))) {
+          // sw_frame_ is free here, decode() is refused while pipelining
+          if ((ret = av_hwframe_transfer_data(sw_frame_, frame, 0)) < 0) {
+            LOG_ERRORF("download failed, ret = %s", av_err2cstr(ret));
+            av_frame_free(&lent_frame);
+          }
+          src = sw_frame_;
+        } else if ((ret = get_pool_frame(lent_frame, frame)) < 0 ||
+                   (ret = av_hwframe_transfer_data(lent_frame, frame, 0)) <
+                       0) {
+          LOG_ERRORF("download failed, ret = %s", av_err2cstr(ret));
+          av_frame_free(&lent_frame);
+        }
+      } else if (!(convert_frame = converts(frame))) {
+        av_frame_move_ref(lent_frame, frame);
+      }
+      PROFILE_STOP(profiler_, DECODE_STAGE_DOWNLOAD, download);
+      if (lent_frame && convert_frame) {
+        PROFILE_START(scale);
+        if (convert(lent_frame, src) < 0)
+          av_frame_free(&lent_frame);
+        PROFILE_STOP(profiler_, DECODE_STAGE_CONVERT, scale);
+      }
+      if (lent_frame) {
+        AVFrame *f = lent_frame;
+        lent_frame = NULL;
+        PROFILE_START(callback);
+        pipeline_callback_(f, pipeline_obj_, f->width, f->height,
+                           (AVPixelFormat)f->format, f->linesize, f->data,
+                           key_frame);
+        PROFILE_STOP(profiler_, DECODE_STAGE_CALLBACK, callback);
+      }
+      PROFILE_STOP(profiler_, DECODE_STAGE_TOTAL, total);
+      av_frame_unref(frame);
+      free_frames_->try_push(frame);
+    }
+  }
+
+  // Back dst with a recycled buffer big enough for the download of src.
+  int get_pool_frame(AVFrame *dst, const AVFrame *src) {
+    return pool_frame(&pool_, &pool_buffer_size_, dst, sw_format(src),
+                      src->width, src->height);
+  }
+
+  // Back dst with a buffer of *pool for a format image of width x height,
+  // *pool is replaced when the size changes.
+  int pool_frame(AVBufferPool **pool, int *pool_size, AVFrame *dst,
+                 AVPixelFormat format, int width, int height) {
+    int ret;
+    int size =
+        av_image_get_buffer_size(format, width, height, POOL_FRAME_ALIGN);
+    if (size < 0) {
+      LOG_ERRORF("av_image_get_buffer_size failed, ret = %s",
+                 av_err2cstr(size));
+      return size;
+    }
+    if (!*pool || size != *pool_size) {
+      if (*pool)
+        av_buffer_pool_uninit(pool);
+      if (!(*pool = av_buffer_pool_init(size, av_buffer_alloc))) {
+        LOG_ERRORF("av_buffer_pool_init failed");
+        return -1;
+      }
+      *pool_size = size;
+      warm_pool(*pool);
+    }
+    if (!(dst->buf[0] = av_buffer_pool_get(*pool))) {
+      LOG_ERRORF("av_buffer_pool_get failed");
+      return -1;
+    }
+    if ((ret = av_image_fill_arrays(dst->data, dst->linesize, dst->buf[0]->data,
+                                    format, width, height, POOL_FRAME_ALIGN)) <
+        0) {
+      LOG_ERRORF("av_image_fill_arrays failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+    dst->format = format;
+    dst->width = width;
+    dst->height = height;
+    return 0;
+  }
+
+  // Allocate pool_count_ buffers up front so the first frames don't pay for it
+  void warm_pool(AVBufferPool *pool) {
+    std::vector<AVBufferRef *> refs;
+    for (int i = 0; i < pool_count_; i++) {
+      AVBufferRef *ref = av_buffer_pool_get(pool);
+      if (!ref)
+        break;
+      refs.push_back(ref);
+    }
+    for (auto &ref : refs)
+      av_buffer_unref(&ref);
+  }
+
+  // Format of the system memory image of f, for hw frames the one a download
+  // produces.
+  static AVPixelFormat sw_format(const AVFrame *f) {
+    if (f->hw_frames_ctx)
+      return ((AVHWFramesContext *)f->hw_frames_ctx->data)->sw_format;
+    return (AVPixelFormat)f->format;
+  }
+
+  int output_width(const AVFrame *f) {
+    return out_width_ > 0 ? out_width_ : f->width;
+  }
+
+  int output_height(const AVFrame *f) {
+    return out_height_ > 0 ? out_height_ : f->height;
+  }
+
+  // Whether the output stage changes f
+  bool converts(const AVFrame *f) {
+    return out_format_ != AV_PIX_FMT_NONE &&
+           (out_format_ != sw_format(f) || output_width(f) != f->width ||
+            output_height(f) != f->height);
+  }
+
+  void free_sws() {
+    if (sws_)
+      sws_freeContext(sws_);
+    sws_ = NULL;
+  }
+
+  // The cached context for src, made again only when the size, format or
+  // colorimetry of the decoded frames changes.
+  SwsContext *get_sws(const AVFrame *src) {
+    int range = src->color_range == AVCOL_RANGE_JPEG ? 1 : 0;
+    const int *coefficients;
+
+    if (sws_ && sws_width_ == src->width && sws_height_ == src->height &&
+        sws_format_ == src->format && sws_colorspace_ == src->colorspace &&
+        sws_range_ == src->color_range)
+      return sws_;
+    free_sws();
+    if (!(sws_ = sws_alloc_context())) {
+      LOG_ERRORF("sws_alloc_context failed");
+      return NULL;
+    }
+    av_opt_set_int(sws_, "srcw", src->width, 0);
+    av_opt_set_int(sws_, "srch", src->height, 0);
+    av_opt_set_int(sws_, "src_format", src->format, 0);
+    av_opt_set_int(sws_, "dstw", output_width(src), 0);
+    av_opt_set_int(sws_, "dsth", output_height(src), 0);
+    av_opt_set_int(sws_, "dst_format", out_format_, 0);
+    av_opt_set_int(sws_, "sws_flags", out_flags_, 0);
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    // slice threads of sws_scale_frame, which FFmpeg 5 added
+    av_opt_set_int(sws_, "threads", out_threads_, 0);
+#endif
+    int ret = sws_init_context(sws_, NULL, NULL);
+    if (ret < 0) {
+      LOG_ERRORF("sws_init_context failed, ret = %s", av_err2cstr(ret));
+      free_sws();
+      return NULL;
+    }
+    coefficients = sws_getCoefficients(src->colorspace);
+    sws_setColorspaceDetails(sws_, coefficients, range, coefficients, range, 0,
+                             1 << 16, 1 << 16);
+    sws_width_ = src->width;
+    sws_height_ = src->height;
+    sws_format_ = src->format;
+    sws_colorspace_ = src->colorspace;
+    sws_range_ = src->color_range;
+    return sws_;
+  }
+
+  // Run src through the output stage into dst, backed by out_pool_ unless
+  // dst already has a buffer.
+  int convert(AVFrame *dst, const AVFrame *src) {
+    SwsContext *sws = get_sws(src);
+    int ret;
+
+    if (!sws)
+      return -1;
+    if (!dst->buf[0]) {
+      if ((ret = pool_frame(&out_pool_, &out_pool_size_, dst, out_format_,
+                            output_width(src), output_height(src))) < 0)
+        return ret;
+    }
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    if ((ret = sws_scale_frame(sws, dst, src)) < 0) {
+      LOG_ERRORF("sws_scale_frame failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+#else
+    // single threaded before FFmpeg 5
+    if ((ret = sws_scale(sws, src->data, src->linesize, 0, src->height,
+                         dst->data, dst->linesize)) < 0) {
+      LOG_ERRORF("sws_scale failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+#endif
+    dst->colorspace = src->colorspace;
+    dst->color_range = src->color_range;
+    return 0;
+  }
+
+  static void free_nothing(void *opaque, uint8_t *data) {
+    (void)opaque;
+    (void)data;
+  }
+
+  // Write src, converted if the output stage is on, to into_
+  int write_into(const AVFrame *src, int key_frame) {
+    AVPixelFormat format =
+        out_format_ != AV_PIX_FMT_NONE ? out_format_ : sw_format(src);
+    int width = output_width(src);
+    int height = output_height(src);
+    int capacity = into_->length;
+    int ret;
+
+    into_->length = av_image_get_buffer_size(format, width, height, 1);
+    if (into_->length < 0) {
+      LOG_ERRORF("av_image_get_buffer_size failed, ret = %s",
+                 av_err2cstr(into_->length));
+      return into_->length;
+    }
+    if (into_->length > capacity) {
+      LOG_ERRORF("decode_into buffer too small, %d < %d", capacity,
+                 into_->length);
+      return -1;
+    }
+    av_frame_unref(out_frame_);
+    if ((ret = av_image_fill_arrays(out_frame_->data, out_frame_->linesize,
+                                    into_->data, format, width, height, 1)) <
+        0) {
+      LOG_ERRORF("av_image_fill_arrays failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+      into_->linesize[i] = out_frame_->linesize[i];
+    PROFILE_START(scale);
+    if (converts(src)) {
+      // sws_scale_frame only writes into refcounted frames
+      out_frame_->buf[0] = av_buffer_create(into_->data, into_->length,
+                                            free_nothing, NULL, 0);
+      if (!out_frame_->buf[0]) {
+        LOG_ERRORF("av_buffer_create failed");
+        return -1;
+      }
+      out_frame_->format = format;
+      out_frame_->width = width;
+      out_frame_->height = height;
+      ret = convert(out_frame_, src);
+    } else {
+      av_image_copy(out_frame_->data, out_frame_->linesize,
+                    (const uint8_t **)src->data, src->linesize, format, width,
+                    height);
+      ret = 0;
+    }
+    PROFILE_STOP(profiler_, DECODE_STAGE_CONVERT, scale);
+    av_frame_unref(out_frame_);
+    if (ret < 0)
+      return ret;
+    into_->width = width;
+    into_->height = height;
+    into_->pixfmt = format;
+    into_->key = key_frame;
+    return 0;
+  }
+
   bool check_support() {
 #ifdef _WIN32
     if (device_type_ == AV_HWDEVICE_TYPE_D3D11VA) {
@@ -318,3 +982,100 @@ extern "C" int ffmpeg_ram_decode(FFmpegRamDecoder *decoder, const uint8_t *data,
   }
   return -1;
 }
+
+extern "C" int ffmpeg_ram_decode_frame(FFmpegRamDecoder *decoder,
+                                       const uint8_t *data, int length,
+                                       const void *obj,
+                                       RamDecodeFrameCallback callback) {
+  try {
+    return decoder->decode(data, length, obj, callback);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_frame exception:" + e.what());
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_decode_start_pipeline(FFmpegRamDecoder *decoder,
+                                                int depth,
+                                                RamDecodeFrameCallback callback,
+                                                const void *obj) {
+  try {
+    return decoder->start_pipeline(depth, callback, obj);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_start_pipeline exception:" + e.what());
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_decode_submit(FFmpegRamDecoder *decoder,
+                                        const uint8_t *data, int length) {
+  try {
+    return decoder->submit(data, length);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_submit exception:" + e.what());
+  }
+  return -1;
+}
+
+extern "C" void ffmpeg_ram_decode_flush_pipeline(FFmpegRamDecoder *decoder) {
+  try {
+    decoder->flush_pipeline();
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_flush_pipeline exception:" + e.what());
+  }
+}
+
+extern "C" void ffmpeg_ram_decode_stop_pipeline(FFmpegRamDecoder *decoder) {
+  try {
+    decoder->stop_pipeline();
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_stop_pipeline exception:" + e.what());
+  }
+}
+
+extern "C" int ffmpeg_ram_decode_into(FFmpegRamDecoder *decoder,
+                                      const uint8_t *data, int length,
+                                      RamDecodeTarget *target) {
+  try {
+    return decoder->decode_into(data, length, target);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_into exception:" + e.what());
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_decode_set_output(FFmpegRamDecoder *decoder,
+                                            int pixfmt, int width, int height,
+                                            int algorithm, int threads) {
+  try {
+    return decoder->set_output(pixfmt, width, height, algorithm, threads);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_set_output exception:" + e.what());
+  }
+  return -1;
+}
+
+extern "C" void ffmpeg_ram_free_frame(AVFrame *frame) {
+  if (frame)
+    av_frame_free(&frame);
+}
+
+extern "C" int ffmpeg_ram_set_frame_pool(FFmpegRamDecoder *decoder,
+                                         int count) {
+  try {
+    return decoder->set_frame_pool(count);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_frame_pool exception:" + e.what());
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_decode_profile(FFmpegRamDecoder *decoder,
+                                         void *stats, int count, int reset) {
+  try {
+    return decoder->profile((ProfileStats *)stats, count, reset != 0);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_profile exception:" + e.what());
+  }
+  return -1;
+}
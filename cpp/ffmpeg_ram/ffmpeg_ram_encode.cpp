@@ -5,15 +5,25 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/log.h>
 #include <libavutil/opt.h>
+#include <libswscale/swscale.h>
 }
 
+#include <algorithm>
+#include <atomic>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <vector>
 
 #define LOG_MODULE "FFMPEG_RAM_ENC"
+#include <bounded_queue.h>
+#include <color_convert.h>
+#include <frame_compare.h>
 #include <log.h>
+#include <profile.h>
+#include <thread_pool.h>
 #include <uitl.h>
 #ifdef _WIN32
 #include "win.h"
@@ -91,6 +101,77 @@ _exit:
 namespace {
 typedef void (*RamEncodeCallback)(const uint8_t *data, int len, int64_t pts,
                                   int key, const void *obj);
+// The callee takes ownership of packet and must release it with
+// ffmpeg_ram_free_packet.
+typedef void (*RamEncodePacketCallback)(void *packet, const uint8_t *data,
+                                        int len, int64_t pts, int key,
+                                        const void *obj);
+typedef struct RamEncodeEntry {
+  const uint8_t *data;
+  int length;
+  int64_t pts;
+} RamEncodeEntry;
+
+typedef struct RamRect {
+  int x;
+  int y;
+  int width;
+  int height;
+} RamRect;
+
+typedef struct RamEncodeLayer {
+  int width;
+  int height;
+  int kbs;
+} RamEncodeLayer;
+// Like RamEncodePacketCallback, layer is the index of the producing layer
+typedef void (*RamGroupPacketCallback)(void *packet, int layer,
+                                       const uint8_t *data, int len,
+                                       int64_t pts, int key, const void *obj);
+
+#define FFMPEG_RAM_ENCODE_SKIPPED 1
+// how set_rate applied a change
+#define FFMPEG_RAM_RATE_DYNAMIC 0
+#define FFMPEG_RAM_RATE_REOPENED 1
+#define MAX_ENCODE_LAYERS 8
+// more dirty rects are not passed as regions of interest
+#define MAX_ROI_RECTS 32
+// quality offset of the dirty rects, negative is better
+#define ROI_QOFFSET_NUM -1
+#define ROI_QOFFSET_DEN 5
+// last_layout_ of encode / encode_planes, encode_bgra uses its SurfaceFormat
+#define INPUT_LAYOUT_NONE -2
+#define INPUT_LAYOUT_YUV -1
+#define INPUT_LAYOUT_PLANES -3
+// rows per task of a multithreaded repack
+#define REPACK_BAND_ROWS 64
+// codec contexts of other resolutions kept open by reconfigure
+#define MAX_CACHED_SESSIONS 2
+
+// encode_planes input, repacked one band of rows of one plane per task
+struct RepackJob {
+  const uint8_t *const *src;
+  const int *src_linesize;
+  uint8_t *const *dst;
+  const int *dst_linesize;
+  int bytes[3];
+  int rows[3];
+  int bands[3];
+};
+
+void repack_band(void *ctx, int index) {
+  RepackJob *job = (RepackJob *)ctx;
+  int p = 0;
+  while (index >= job->bands[p]) {
+    index -= job->bands[p];
+    p++;
+  }
+  int top = index * REPACK_BAND_ROWS;
+  int bottom = std::min(top + REPACK_BAND_ROWS, job->rows[p]);
+  for (int row = top; row < bottom; row++)
+    memcpy(job->dst[p] + (int64_t)row * job->dst_linesize[p],
+           job->src[p] + (int64_t)row * job->src_linesize[p], job->bytes[p]);
+}
 
 class FFmpegRamEncoder {
 public:
@@ -112,17 +193,79 @@ public:
   int gop_ = 0xFFFF;
   int thread_count_ = 1;
   int gpu_ = 0;
+  // intra refresh over refresh_period_ frames instead of keyframes, 0 for off
+  int refresh_period_ = 0;
+  int refresh_direction_ = REFRESH_COLUMNS;
   RamEncodeCallback callback_ = NULL;
   int offset_[AV_NUM_DATA_POINTERS] = {0};
+  int length_ = 0;
 
   AVHWDeviceType hw_device_type_ = AV_HWDEVICE_TYPE_NONE;
   AVPixelFormat hw_pixfmt_ = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx_ = NULL;
   AVFrame *hw_frame_ = NULL;
 
+  // async mode, frames cycle between free_frames_ and pending_frames_
+  std::thread worker_;
+  std::atomic<bool> async_ = {false};
+  std::vector<AVFrame *> async_frames_;
+  BoundedQueue<AVFrame *> *free_frames_ = NULL;
+  BoundedQueue<AVFrame *> *pending_frames_ = NULL;
+  RamEncodePacketCallback async_callback_ = NULL;
+  const void *async_obj_ = NULL;
+
+  // encode_bgra converts into its own frame, split over convert_pool_
+  AVFrame *convert_frame_ = NULL;
+  ThreadPool *convert_pool_ = NULL;
+
+  // skip_unchanged_ mode, a copy of the last input that reached the encoder
+  bool skip_unchanged_ = false;
+  std::vector<uint8_t> last_input_;
+  int last_layout_ = INPUT_LAYOUT_NONE;
+
+  // encode_dirty updates its own frame in place, dirty_valid_ once it holds a
+  // complete picture
+  AVFrame *dirty_frame_ = NULL;
+  bool dirty_valid_ = false;
+  bool roi_ = false;
+
+  // encode_planes points planes_frame_ at the caller's planes, or repacks
+  // them into repack_frame_ when the encoder can't take their layout
+  AVFrame *planes_frame_ = NULL;
+  AVFrame *repack_frame_ = NULL;
+
+  // What reconfigure swaps out: an opened codec context and the frames of
+  // its size. The device in hw_device_ctx_ is shared by all of them.
+  struct Session {
+    AVCodecContext *c;
+    AVFrame *frame;
+    AVFrame *hw_frame;
+    int width;
+    int height;
+    AVPixelFormat pixfmt;
+    int kbs;
+    int fps;
+    int gop;
+    int offset[AV_NUM_DATA_POINTERS];
+    int length;
+  };
+  // most recently used last
+  std::vector<Session> sessions_;
+  // a cached context was switched back to, frames it held from before the
+  // switch come out with a pts older than drop_before_ and are dropped
+  bool restored_ = false;
+  int64_t drop_before_ = AV_NOPTS_VALUE;
+  // the next frame is sent as a keyframe, set from any thread
+  std::atomic<bool> key_pending_ = {false};
+
+#ifdef CFG_PROFILE
+  Profiler profiler_;
+#endif
+
   FFmpegRamEncoder(const char *name, const char *mc_name, int width, int height,
                    int pixfmt, int align, int fps, int gop, int rc, int quality,
                    int kbs, int q, int thread_count, int gpu,
+                   int refresh_period, int refresh_direction,
                    RamEncodeCallback callback) {
     name_ = name;
     mc_name_ = mc_name ? mc_name : "";
@@ -138,6 +281,8 @@ public:
     q_ = q;
     thread_count_ = thread_count;
     gpu_ = gpu;
+    refresh_period_ = refresh_period;
+    refresh_direction_ = refresh_direction;
     callback_ = callback;
     if (name_.find("vaapi") != std::string::npos) {
       hw_device_type_ = AV_HWDEVICE_TYPE_VAAPI;
@@ -153,6 +298,92 @@ public:
   ~FFmpegRamEncoder() {}
 
   bool init(int *linesize, int *offset, int *length) {
+    if (!open())
+      return false;
+    output_layout(linesize, offset, length);
+    return true;
+  }
+
+  // Switch to width x height and pixfmt without recreating the device. The
+  // context of the previous size is kept in a small cache, switching back to
+  // it costs no avcodec_open2. The first frame after a switch is a keyframe.
+  int reconfigure(int width, int height, int pixfmt, int *linesize,
+                  int *offset, int *length) {
+    if (async_) {
+      LOG_ERROR("reconfigure called while async mode is running");
+      return -1;
+    }
+    if (width <= 0 || height <= 0 || width % 2 || height % 2) {
+      LOG_ERROR("invalid size " + std::to_string(width) + "x" +
+                std::to_string(height));
+      return -1;
+    }
+    if (width != width_ || height != height_ || pixfmt != pixfmt_) {
+      // frames of the old size, allocated again on first use
+      AVFrame **scratch[] = {&convert_frame_, &dirty_frame_, &planes_frame_,
+                             &repack_frame_};
+      for (auto frame : scratch) {
+        if (*frame)
+          av_frame_free(frame);
+      }
+      dirty_valid_ = false;
+      last_layout_ = INPUT_LAYOUT_NONE;
+
+      // discard what the encoder still holds, or it would come out after
+      // switching back to this context
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+      if (c_->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+        avcodec_flush_buffers(c_);
+#endif
+      sessions_.push_back(save_session());
+      auto it = std::find_if(sessions_.begin(), sessions_.end(),
+                             [&](const Session &s) {
+                               return s.width == width && s.height == height &&
+                                      s.pixfmt == pixfmt;
+                             });
+      // opened with a rate set_rate has changed since
+      if (it != sessions_.end() && !reusable(*it)) {
+        free_session(*it);
+        sessions_.erase(it);
+        it = sessions_.end();
+      }
+      if (it != sessions_.end()) {
+        Session session = *it;
+        sessions_.erase(it);
+        restore_session(session);
+        restored_ = true;
+        if (session.kbs != kbs_)
+          util::change_bit_rate(c_, name_, kbs_);
+      } else {
+        width_ = width;
+        height_ = height;
+        pixfmt_ = (AVPixelFormat)pixfmt;
+        c_ = NULL;
+        frame_ = NULL;
+        hw_frame_ = NULL;
+        if (!open()) {
+          LOG_ERROR("reconfigure to " + std::to_string(width) + "x" +
+                    std::to_string(height) + " failed");
+          Session failed = save_session();
+          free_session(failed);
+          restore_session(sessions_.back());
+          sessions_.pop_back();
+          return -1;
+        }
+      }
+      while (sessions_.size() > MAX_CACHED_SESSIONS) {
+        free_session(sessions_.front());
+        sessions_.erase(sessions_.begin());
+      }
+      key_pending_ = true;
+    }
+    output_layout(linesize, offset, length);
+    return 0;
+  }
+
+  // Open c_ with frame_ and hw_frame_ for the current size, the device is
+  // created by the first call only.
+  bool open() {
     const AVCodec *codec = NULL;
 
     int ret;
@@ -167,7 +398,7 @@ public:
       return false;
     }
 
-    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
+    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE && !hw_device_ctx_) {
       std::string device = "";
 #ifdef _WIN32
       if (name_.find("nvenc") != std::string::npos) {
@@ -185,6 +416,8 @@ public:
         LOG_ERROR("av_hwdevice_ctx_create failed");
         return false;
       }
+    }
+    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
       if (set_hwframe_ctx() != 0) {
         LOG_ERROR("set_hwframe_ctx failed");
         return false;
@@ -217,7 +450,7 @@ public:
       return false;
     }
 
-    if (!(pkt_ = av_packet_alloc())) {
+    if (!pkt_ && !(pkt_ = av_packet_alloc())) {
       LOG_ERROR("Could not allocate video packet");
       return false;
     }
@@ -237,7 +470,7 @@ public:
     util::set_rate_control(c_, name_, rc_, q_);
     util::set_gpu(c_->priv_data, name_, gpu_);
     util::force_hw(c_->priv_data, name_);
-    util::set_others(c_->priv_data, name_);
+    util::set_others(c_, name_, refresh_period_, refresh_direction_);
     if (name_.find("mediacodec") != std::string::npos) {
       if (mc_name_.length() > 0) {
         LOG_INFO("mediacodec codec_name: " + mc_name_);
@@ -255,57 +488,867 @@ public:
     }
 
     if (ffmpeg_ram_get_linesize_offset_length(pixfmt_, width_, height_, align_,
-                                              NULL, offset_, length) != 0)
+                                              NULL, offset_, &length_) != 0)
       return false;
-
-    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
-      linesize[i] = frame_->linesize[i];
-      offset[i] = offset_[i];
-    }
+    roi_ = util::support_roi(name_);
     return true;
   }
 
-  int encode(const uint8_t *data, int length, const void *obj, uint64_t ms) {
+  int encode(const uint8_t *data, int length, const void *obj, uint64_t ms,
+             RamEncodePacketCallback packet_callback = NULL) {
     int ret;
 
+    if (async_) {
+      LOG_ERRORF("encode called while async mode is running");
+      return -1;
+    }
+    dirty_valid_ = false;
+    if (unchanged(data, length, INPUT_LAYOUT_YUV))
+      return FFMPEG_RAM_ENCODE_SKIPPED;
+    PROFILE_START(total);
+    PROFILE_START(make_writable);
     if ((ret = av_frame_make_writable(frame_)) != 0) {
-      LOG_ERROR("av_frame_make_writable failed, ret = " + av_err2str(ret));
+      LOG_ERRORF("av_frame_make_writable failed, ret = %s", av_err2cstr(ret));
       return ret;
     }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_MAKE_WRITABLE, make_writable);
+    PROFILE_START(fill);
     if ((ret = fill_frame(frame_, (uint8_t *)data, length, offset_)) != 0)
       return ret;
-    AVFrame *tmp_frame;
-    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
-      if ((ret = av_hwframe_transfer_data(hw_frame_, frame_, 0)) < 0) {
-        LOG_ERROR("av_hwframe_transfer_data failed, ret = " + av_err2str(ret));
+    PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+    ret = encode_frame(frame_, obj, ms, packet_callback);
+    PROFILE_STOP(profiler_, ENCODE_STAGE_TOTAL, total);
+    // -1 is a frame the encoder kept without returning a packet yet
+    if (ret == 0 || ret == -1)
+      remember(data, length, INPUT_LAYOUT_YUV);
+    return ret;
+  }
+
+  // Encode the entries in order. Buffering encoders may not return a packet
+  // for every frame, so only a frame that fails before reaching the encoder
+  // stops the batch. Entries are checked up front, the -1 of encode then
+  // only means the encoder kept the frame.
+  int encode_batch(const RamEncodeEntry *entries, int count, const void *obj) {
+    bool encoded = false;
+    bool skipped = false;
+    int ret;
+
+    if (async_) {
+      LOG_ERRORF("encode_batch called while async mode is running");
+      return -1;
+    }
+    if (!entries || count <= 0) {
+      LOG_ERRORF("illegal encode_batch parameter, count: %d", count);
+      return -1;
+    }
+    for (int i = 0; i < count; i++) {
+      if (!entries[i].data || entries[i].length < length_) {
+        LOG_ERRORF("encode_batch: illegal entry %d, length: %d < %d", i,
+                   entries[i].length, length_);
+        return -1;
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      if ((ret = encode(entries[i].data, entries[i].length, obj,
+                        entries[i].pts)) == 0) {
+        encoded = true;
+      } else if (ret == FFMPEG_RAM_ENCODE_SKIPPED) {
+        skipped = true;
+      } else if (ret != -1) {
         return ret;
       }
-      tmp_frame = hw_frame_;
+    }
+    if (encoded)
+      return 0;
+    return skipped ? FFMPEG_RAM_ENCODE_SKIPPED : -1;
+  }
+
+  // Encode a packed BGRA / RGBA image, converted to pixfmt_ on the way.
+  // format is a SurfaceFormat, colorspace / range a ColorSpace / ColorRange.
+  int encode_bgra(const uint8_t *data, int length, int stride, int format,
+                  int colorspace, int range, const void *obj, int64_t ms) {
+    int ret;
+
+    if (async_) {
+      LOG_ERRORF("encode_bgra called while async mode is running");
+      return -1;
+    }
+    dirty_valid_ = false;
+    if (pixfmt_ != AV_PIX_FMT_NV12 && pixfmt_ != AV_PIX_FMT_YUV420P) {
+      LOG_ERRORF("encode_bgra: unsupported pixfmt, %d", pixfmt_);
+      return -1;
+    }
+    if (!data || stride < width_ * 4 || length < stride * height_) {
+      LOG_ERRORF("encode_bgra: illegal parameter, length: %d, stride: %d",
+                 length, stride);
+      return -1;
+    }
+    if (!convert_frame_) {
+      if (!(convert_frame_ = av_frame_alloc())) {
+        LOG_ERRORF("av_frame_alloc failed");
+        return -1;
+      }
+      convert_frame_->format = pixfmt_;
+      convert_frame_->width = width_;
+      convert_frame_->height = height_;
+      if ((ret = av_frame_get_buffer(convert_frame_, align_)) < 0) {
+        LOG_ERRORF("av_frame_get_buffer failed, ret = %s", av_err2cstr(ret));
+        av_frame_free(&convert_frame_);
+        return ret;
+      }
+      if (thread_count_ > 1 && !convert_pool_)
+        convert_pool_ = new ThreadPool(thread_count_ - 1);
+    }
+
+    if (unchanged(data, stride * height_, format))
+      return FFMPEG_RAM_ENCODE_SKIPPED;
+
+    PROFILE_START(total);
+    PROFILE_START(make_writable);
+    if ((ret = av_frame_make_writable(convert_frame_)) != 0) {
+      LOG_ERRORF("av_frame_make_writable failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_MAKE_WRITABLE, make_writable);
+    PROFILE_START(fill);
+    if (color::rgb_to_yuv420(data, stride, format, width_, height_,
+                             convert_frame_->data, convert_frame_->linesize,
+                             pixfmt_ == AV_PIX_FMT_NV12,
+                             (ColorSpace)colorspace, (ColorRange)range,
+                             convert_pool_) != 0) {
+      LOG_ERRORF("encode_bgra: unsupported conversion, format: %d, "
+                 "colorspace: %d, range: %d",
+                 format, colorspace, range);
+      return -1;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+    convert_frame_->colorspace = colorspace == COLOR_SPACE_BT709
+                                     ? AVCOL_SPC_BT709
+                                     : AVCOL_SPC_SMPTE170M;
+    convert_frame_->color_range =
+        range == COLOR_RANGE_FULL ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    ret = encode_frame(convert_frame_, obj, ms, NULL);
+    PROFILE_STOP(profiler_, ENCODE_STAGE_TOTAL, total);
+    if (ret == 0 || ret == -1)
+      remember(data, stride * height_, format);
+    return ret;
+  }
+
+  // Encode a buffer laid out like the one of encode, of which only rects
+  // changed since the last encode_dirty call. Just those are copied into a
+  // frame kept between calls, the first call, or the first one after another
+  // encode function, copies the whole buffer. With roi, encoders that support
+  // it get the rects as regions of interest.
+  int encode_dirty(const uint8_t *data, int length, const RamRect *rects,
+                   int count, bool roi, const void *obj, int64_t ms) {
+    int ret;
+
+    if (async_) {
+      LOG_ERRORF("encode_dirty called while async mode is running");
+      return -1;
+    }
+    // the encoder's last picture is no longer the one encode compares with
+    last_layout_ = INPUT_LAYOUT_NONE;
+    if (pixfmt_ != AV_PIX_FMT_NV12 && pixfmt_ != AV_PIX_FMT_YUV420P) {
+      LOG_ERRORF("encode_dirty: unsupported pixfmt, %d", pixfmt_);
+      return -1;
+    }
+    if (!data || length < length_ || count < 0 || (count > 0 && !rects)) {
+      LOG_ERRORF("encode_dirty: illegal parameter, length: %d, count: %d",
+                 length, count);
+      return -1;
+    }
+    if (count == 0 && dirty_valid_ && skip_unchanged_ && !key_pending_)
+      return FFMPEG_RAM_ENCODE_SKIPPED;
+    if (!dirty_frame_) {
+      if (!(dirty_frame_ = av_frame_alloc())) {
+        LOG_ERRORF("av_frame_alloc failed");
+        return -1;
+      }
+      dirty_frame_->format = pixfmt_;
+      dirty_frame_->width = width_;
+      dirty_frame_->height = height_;
+      // same align_ as frame_, so the linesizes match the input layout
+      if ((ret = av_frame_get_buffer(dirty_frame_, align_)) < 0) {
+        LOG_ERRORF("av_frame_get_buffer failed, ret = %s", av_err2cstr(ret));
+        av_frame_free(&dirty_frame_);
+        return ret;
+      }
+    }
+
+    PROFILE_START(total);
+    PROFILE_START(make_writable);
+    // copies the picture if the encoder still holds a reference to it
+    if ((ret = av_frame_make_writable(dirty_frame_)) != 0) {
+      LOG_ERRORF("av_frame_make_writable failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_MAKE_WRITABLE, make_writable);
+    PROFILE_START(fill);
+    if (!dirty_valid_) {
+      copy_rect(data, 0, 0, width_, height_);
+      dirty_valid_ = true;
     } else {
-      tmp_frame = frame_;
+      for (int i = 0; i < count; i++)
+        copy_rect(data, rects[i].x, rects[i].y, rects[i].width,
+                  rects[i].height);
     }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+    if ((ret = set_roi(dirty_frame_, roi && roi_ ? rects : NULL, count)) != 0)
+      return ret;
+    ret = encode_frame(dirty_frame_, obj, ms, NULL);
+    PROFILE_STOP(profiler_, ENCODE_STAGE_TOTAL, total);
+    return ret;
+  }
 
-    return do_encode(tmp_frame, obj, ms);
+  // Encode a picture given as one pointer and linesize per plane, e.g. a
+  // capture buffer with its own pitch. The planes are passed on as they are
+  // when every linesize is positive and they are aligned to align_, like the
+  // layout of encode. Otherwise they are repacked into a frame of that layout
+  // first.
+  int encode_planes(const uint8_t *const data[], const int linesize[],
+                    const void *obj, int64_t ms) {
+    int ret;
+    AVFrame *frame;
+
+    if (async_) {
+      LOG_ERRORF("encode_planes called while async mode is running");
+      return -1;
+    }
+    dirty_valid_ = false;
+    if (pixfmt_ != AV_PIX_FMT_NV12 && pixfmt_ != AV_PIX_FMT_YUV420P) {
+      LOG_ERRORF("encode_planes: unsupported pixfmt, %d", pixfmt_);
+      return -1;
+    }
+    if (!data || !linesize) {
+      LOG_ERRORF("illegal encode_planes parameter");
+      return -1;
+    }
+    int planes = pixfmt_ == AV_PIX_FMT_NV12 ? 2 : 3;
+    for (int p = 0; p < planes; p++) {
+      if (!data[p] || std::abs(linesize[p]) < plane_bytes(p)) {
+        LOG_ERRORF("encode_planes: illegal plane %d, linesize: %d", p,
+                   data[p] ? linesize[p] : 0);
+        return -1;
+      }
+    }
+    if (unchanged_planes(data, linesize, planes))
+      return FFMPEG_RAM_ENCODE_SKIPPED;
+
+    PROFILE_START(total);
+    if (direct_planes(data, linesize, planes)) {
+      PROFILE_START(fill);
+      if (!planes_frame_ && !(planes_frame_ = av_frame_alloc())) {
+        LOG_ERRORF("av_frame_alloc failed");
+        return -1;
+      }
+      // the buffer of frame_ is borrowed only so the encoder can reference
+      // the frame without copying it
+      if ((ret = av_frame_ref(planes_frame_, frame_)) < 0) {
+        LOG_ERRORF("av_frame_ref failed, ret = %s", av_err2cstr(ret));
+        return ret;
+      }
+      for (int p = 0; p < planes; p++) {
+        planes_frame_->data[p] = (uint8_t *)data[p];
+        planes_frame_->linesize[p] = linesize[p];
+      }
+      PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+      frame = planes_frame_;
+    } else {
+      if (!repack_frame_) {
+        if (!(repack_frame_ = av_frame_alloc())) {
+          LOG_ERRORF("av_frame_alloc failed");
+          return -1;
+        }
+        repack_frame_->format = pixfmt_;
+        repack_frame_->width = width_;
+        repack_frame_->height = height_;
+        if ((ret = av_frame_get_buffer(repack_frame_, align_)) < 0) {
+          LOG_ERRORF("av_frame_get_buffer failed, ret = %s", av_err2cstr(ret));
+          av_frame_free(&repack_frame_);
+          return ret;
+        }
+        if (thread_count_ > 1 && !convert_pool_)
+          convert_pool_ = new ThreadPool(thread_count_ - 1);
+      }
+      PROFILE_START(make_writable);
+      if ((ret = av_frame_make_writable(repack_frame_)) != 0) {
+        LOG_ERRORF("av_frame_make_writable failed, ret = %s",
+                   av_err2cstr(ret));
+        return ret;
+      }
+      PROFILE_STOP(profiler_, ENCODE_STAGE_MAKE_WRITABLE, make_writable);
+      PROFILE_START(fill);
+      repack(data, linesize, planes);
+      PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+      frame = repack_frame_;
+    }
+    ret = encode_frame(frame, obj, ms, NULL);
+    // drop the borrowed buffer, or encode would find frame_ not writable
+    if (planes_frame_)
+      av_frame_unref(planes_frame_);
+    PROFILE_STOP(profiler_, ENCODE_STAGE_TOTAL, total);
+    if (ret == 0 || ret == -1)
+      remember_planes(data, linesize, planes);
+    return ret;
+  }
+
+  // Spawn a worker that encodes submitted frames, at most depth in flight.
+  // Packets are handed to callback on the worker thread.
+  int start_async(int depth, RamEncodePacketCallback callback,
+                  const void *obj) {
+    int ret;
+
+    if (async_) {
+      LOG_ERROR("async mode already started");
+      return -1;
+    }
+    if (depth <= 0 || !callback) {
+      LOG_ERROR("invalid async parameter, depth: " + std::to_string(depth));
+      return -1;
+    }
+    free_frames_ = new BoundedQueue<AVFrame *>(depth);
+    pending_frames_ = new BoundedQueue<AVFrame *>(depth);
+    for (int i = 0; i < depth; i++) {
+      AVFrame *frame = av_frame_alloc();
+      if (!frame) {
+        LOG_ERROR("av_frame_alloc failed");
+        stop_async();
+        return -1;
+      }
+      async_frames_.push_back(frame);
+      frame->format = pixfmt_;
+      frame->width = width_;
+      frame->height = height_;
+      if ((ret = av_frame_get_buffer(frame, align_)) < 0) {
+        LOG_ERROR("av_frame_get_buffer failed, ret = " + av_err2str(ret));
+        stop_async();
+        return ret;
+      }
+      free_frames_->try_push(frame);
+    }
+    async_callback_ = callback;
+    async_obj_ = obj;
+    async_ = true;
+    worker_ = std::thread(&FFmpegRamEncoder::async_loop, this);
+    return 0;
+  }
+
+  // Copy data into a free slot and queue it, AVERROR(EAGAIN) if all slots are
+  // in flight.
+  int submit(const uint8_t *data, int length, int64_t ms) {
+    AVFrame *frame = NULL;
+    int ret;
+
+    if (!async_) {
+      LOG_ERRORF("submit called before start_async");
+      return -1;
+    }
+    if (!free_frames_->try_pop(frame))
+      return AVERROR(EAGAIN);
+    PROFILE_START(make_writable);
+    if ((ret = av_frame_make_writable(frame)) != 0) {
+      LOG_ERRORF("av_frame_make_writable failed, ret = %s", av_err2cstr(ret));
+      free_frames_->try_push(frame);
+      return ret;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_MAKE_WRITABLE, make_writable);
+    PROFILE_START(fill);
+    if ((ret = copy_frame(frame, data, length)) != 0) {
+      free_frames_->try_push(frame);
+      return ret;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+    frame->pts = ms;
+    pending_frames_->try_push(frame);
+    return 0;
+  }
+
+  // Block until every submitted frame has been handed to the encoder and the
+  // packets it returned so far were delivered. Frames the encoder still
+  // buffers come out with later ones, draining would end the stream.
+  void flush_async() {
+    if (!async_)
+      return;
+    // every slot is back once the worker has finished the last frame
+    free_frames_->wait_full();
+  }
+
+  void stop_async() {
+    if (pending_frames_)
+      pending_frames_->close();
+    if (worker_.joinable())
+      worker_.join();
+    async_ = false;
+    for (auto &frame : async_frames_)
+      av_frame_free(&frame);
+    async_frames_.clear();
+    if (free_frames_) {
+      delete free_frames_;
+      free_frames_ = NULL;
+    }
+    if (pending_frames_) {
+      delete pending_frames_;
+      pending_frames_ = NULL;
+    }
+    async_callback_ = NULL;
+    async_obj_ = NULL;
   }
 
   void free_encoder() {
+    stop_async();
+    for (auto &session : sessions_)
+      free_session(session);
+    sessions_.clear();
     if (pkt_)
       av_packet_free(&pkt_);
     if (frame_)
       av_frame_free(&frame_);
     if (hw_frame_)
       av_frame_free(&hw_frame_);
+    if (convert_frame_)
+      av_frame_free(&convert_frame_);
+    if (dirty_frame_)
+      av_frame_free(&dirty_frame_);
+    if (planes_frame_)
+      av_frame_free(&planes_frame_);
+    if (repack_frame_)
+      av_frame_free(&repack_frame_);
+    if (convert_pool_) {
+      delete convert_pool_;
+      convert_pool_ = NULL;
+    }
     if (hw_device_ctx_)
       av_buffer_unref(&hw_device_ctx_);
     if (c_)
       avcodec_free_context(&c_);
   }
 
+  // Scale a picture of another size into frame_ with sws and encode it. Only
+  // for encoders that are not fed by encode(), which re-points frame_.
+  int encode_scaled(SwsContext *sws, const uint8_t *const src[],
+                    const int src_linesize[], int src_height, const void *obj,
+                    int64_t ms, RamEncodePacketCallback packet_callback) {
+    int ret;
+
+    PROFILE_START(total);
+    PROFILE_START(make_writable);
+    if ((ret = av_frame_make_writable(frame_)) != 0) {
+      LOG_ERRORF("av_frame_make_writable failed, ret = %s", av_err2cstr(ret));
+      return ret;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_MAKE_WRITABLE, make_writable);
+    PROFILE_START(fill);
+    if ((ret = sws_scale(sws, src, src_linesize, 0, src_height, frame_->data,
+                         frame_->linesize)) <= 0) {
+      LOG_ERRORF("sws_scale failed, ret = %d", ret);
+      return -1;
+    }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_FILL_FRAME, fill);
+    ret = encode_frame(frame_, obj, ms, packet_callback);
+    PROFILE_STOP(profiler_, ENCODE_STAGE_TOTAL, total);
+    return ret;
+  }
+
+  // With enable, encode / encode_bgra return FFMPEG_RAM_ENCODE_SKIPPED instead
+  // of encoding an input identical to the previous one, and so does
+  // encode_dirty without dirty rects.
+  void set_skip_unchanged(bool enable) {
+    skip_unchanged_ = enable;
+    if (!enable) {
+      last_layout_ = INPUT_LAYOUT_NONE;
+      std::vector<uint8_t>().swap(last_input_);
+    }
+  }
+
+  // Never reopens, backends that only read the bitrate when opening keep the
+  // old one. set_rate reopens those.
   int set_bitrate(int kbs) {
-    return util::change_bit_rate(c_, name_, kbs) ? 0 : -1;
+    if (!util::change_bit_rate(c_, name_, kbs))
+      return -1;
+    // applied to cached contexts when reconfigure switches back to them
+    if (kbs > 0)
+      kbs_ = kbs;
+    return 0;
+  }
+
+  // Encode the next frame as an IDR frame, also in async mode, where it is
+  // the next one the worker takes. An input skipped as unchanged is encoded.
+  void request_keyframe() { key_pending_ = true; }
+
+  // Change the bitrate, framerate and gop, a value <= 0 keeps the current
+  // one. If the backend takes all changed settings at runtime they are
+  // applied to the running encoder, otherwise the context is reopened on the
+  // same device, which starts with a keyframe. Returns
+  // FFMPEG_RAM_RATE_DYNAMIC or FFMPEG_RAM_RATE_REOPENED. A gop change fails
+  // while intra refresh uses the gop as its period.
+  int set_rate(int kbs, int fps, int gop) {
+    int changes = 0;
+
+    if (async_) {
+      LOG_ERROR("set_rate called while async mode is running");
+      return -1;
+    }
+    if (gop > 0 && gop != gop_ && refresh_period_ > 0 &&
+        util::refresh_uses_gop(name_)) {
+      LOG_ERROR("the gop of " + name_ + " is the intra refresh period");
+      return -1;
+    }
+    if (kbs > 0 && kbs != kbs_)
+      changes |= RATE_BITRATE;
+    if (fps > 0 && fps != fps_)
+      changes |= RATE_FRAMERATE;
+    if (gop > 0 && gop != gop_)
+      changes |= RATE_GOP;
+    if (!changes)
+      return FFMPEG_RAM_RATE_DYNAMIC;
+
+    int old_kbs = kbs_;
+    int old_fps = fps_;
+    int old_gop = gop_;
+    if (changes & RATE_BITRATE)
+      kbs_ = kbs;
+    if (changes & RATE_FRAMERATE)
+      fps_ = fps;
+    if (changes & RATE_GOP)
+      gop_ = gop;
+    if ((changes & ~util::dynamic_rate(name_)) == 0) {
+      if (changes & RATE_BITRATE)
+        util::change_bit_rate(c_, name_, kbs_);
+      if (changes & RATE_FRAMERATE)
+        util::change_framerate(c_, fps_);
+      if (changes & RATE_GOP)
+        util::change_gop(c_, name_, gop_);
+      return FFMPEG_RAM_RATE_DYNAMIC;
+    }
+    if (!reopen()) {
+      kbs_ = old_kbs;
+      fps_ = old_fps;
+      gop_ = old_gop;
+      return -1;
+    }
+    return FFMPEG_RAM_RATE_REOPENED;
+  }
+
+  int profile(ProfileStats *stats, int count, bool reset) {
+#ifdef CFG_PROFILE
+    profiler_.snapshot(stats, count, reset);
+    return 0;
+#else
+    (void)stats;
+    (void)count;
+    (void)reset;
+    return -1;
+#endif
   }
 
 private:
+  void output_layout(int *linesize, int *offset, int *length) {
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
+      linesize[i] = frame_->linesize[i];
+      offset[i] = offset_[i];
+    }
+    *length = length_;
+  }
+
+  // Open a context of the current size and settings in place of c_, the old
+  // one stays if that fails.
+  bool reopen() {
+    Session old = save_session();
+    c_ = NULL;
+    frame_ = NULL;
+    hw_frame_ = NULL;
+    if (!open()) {
+      LOG_ERROR("reopen " + name_ + " failed");
+      Session failed = save_session();
+      free_session(failed);
+      restore_session(old);
+      return false;
+    }
+    free_session(old);
+    return true;
+  }
+
+  // Whether a cached session can be used with the current settings, a
+  // bitrate change is the only one it can still take
+  bool reusable(const Session &session) {
+    if (session.fps != fps_ || session.gop != gop_)
+      return false;
+    return session.kbs == kbs_ ||
+           (util::dynamic_rate(name_) & RATE_BITRATE) != 0;
+  }
+
+  Session save_session() {
+    Session session;
+    session.c = c_;
+    session.frame = frame_;
+    session.hw_frame = hw_frame_;
+    session.width = width_;
+    session.height = height_;
+    session.pixfmt = pixfmt_;
+    session.kbs = kbs_;
+    session.fps = fps_;
+    session.gop = gop_;
+    memcpy(session.offset, offset_, sizeof(offset_));
+    session.length = length_;
+    return session;
+  }
+
+  void restore_session(const Session &session) {
+    c_ = session.c;
+    frame_ = session.frame;
+    hw_frame_ = session.hw_frame;
+    width_ = session.width;
+    height_ = session.height;
+    pixfmt_ = session.pixfmt;
+    memcpy(offset_, session.offset, sizeof(offset_));
+    length_ = session.length;
+  }
+
+  static void free_session(Session &session) {
+    if (session.frame)
+      av_frame_free(&session.frame);
+    if (session.hw_frame)
+      av_frame_free(&session.hw_frame);
+    if (session.c)
+      avcodec_free_context(&session.c);
+  }
+
+  // Whether data is the same input as the last one given to the encoder. The
+  // whole buffer is compared, so changed padding only costs a skip.
+  bool unchanged(const uint8_t *data, int length, int layout) {
+    return skip_unchanged_ && !key_pending_ && layout == last_layout_ &&
+           (size_t)length == last_input_.size() &&
+           compare::equal(data, last_input_.data(), length);
+  }
+
+  // Copy one rect of the encode input layout into dirty_frame_. It is clipped
+  // and grown to even coordinates, chroma is subsampled by two.
+  void copy_rect(const uint8_t *data, int x, int y, int width, int height) {
+    if (width <= 0 || height <= 0)
+      return;
+    int x0 = std::max(x, 0) & ~1;
+    int y0 = std::max(y, 0) & ~1;
+    int x1 = (int)std::min<int64_t>((int64_t)x + width, width_);
+    int y1 = (int)std::min<int64_t>((int64_t)y + height, height_);
+    x1 = (x1 + 1) & ~1;
+    y1 = (y1 + 1) & ~1;
+    if (x1 <= x0 || y1 <= y0)
+      return;
+
+    bool nv12 = pixfmt_ == AV_PIX_FMT_NV12;
+    const uint8_t *src[3] = {data, data + offset_[0], data + offset_[1]};
+    for (int p = 0; p < (nv12 ? 2 : 3); p++) {
+      // NV12 interleaves U and V, so its chroma row has the luma byte width
+      int shift = p == 0 || nv12 ? 0 : 1;
+      int left = x0 >> shift;
+      int bytes = (x1 - x0) >> shift;
+      int top = p == 0 ? y0 : y0 / 2;
+      int bottom = p == 0 ? y1 : y1 / 2;
+      // frame_ was allocated with the same align_, its linesizes are the ones
+      // the caller was given
+      int src_linesize = frame_->linesize[p];
+      int dst_linesize = dirty_frame_->linesize[p];
+      for (int row = top; row < bottom; row++)
+        memcpy(dirty_frame_->data[p] + (int64_t)row * dst_linesize + left,
+               src[p] + (int64_t)row * src_linesize + left, bytes);
+    }
+  }
+
+  // Bytes of a row of plane p, NV12 interleaves U and V into one plane
+  int plane_bytes(int p) {
+    if (p == 0)
+      return width_;
+    // interleaved U and V of an odd width still come in pairs
+    if (pixfmt_ == AV_PIX_FMT_NV12)
+      return 2 * ((width_ + 1) / 2);
+    return (width_ + 1) / 2;
+  }
+
+  int plane_rows(int p) { return p == 0 ? height_ : (height_ + 1) / 2; }
+
+  // Whether the encoder can take the planes without a repack. Hardware
+  // uploads and the software encoders copy them row by row anyway, align_ is
+  // what the backend asked of the linesizes and plane addresses.
+  bool direct_planes(const uint8_t *const data[], const int linesize[],
+                     int planes) {
+    for (int p = 0; p < planes; p++) {
+      if (linesize[p] <= 0)
+        return false;
+      if (align_ > 1 &&
+          (linesize[p] % align_ != 0 || (uintptr_t)data[p] % align_ != 0))
+        return false;
+    }
+    return true;
+  }
+
+  // Copy the planes into repack_frame_, in bands over convert_pool_ if there
+  // is one. memcpy is vectorized by the C library, so a band is as fast as a
+  // hand written kernel.
+  void repack(const uint8_t *const data[], const int linesize[], int planes) {
+    RepackJob job;
+    int count = 0;
+
+    job.src = data;
+    job.src_linesize = linesize;
+    job.dst = repack_frame_->data;
+    job.dst_linesize = repack_frame_->linesize;
+    for (int p = 0; p < 3; p++) {
+      job.bytes[p] = p < planes ? plane_bytes(p) : 0;
+      job.rows[p] = p < planes ? plane_rows(p) : 0;
+      job.bands[p] = (job.rows[p] + REPACK_BAND_ROWS - 1) / REPACK_BAND_ROWS;
+      count += job.bands[p];
+    }
+    if (convert_pool_) {
+      convert_pool_->run(count, repack_band, &job);
+    } else {
+      for (int i = 0; i < count; i++)
+        repack_band(&job, i);
+    }
+  }
+
+  // unchanged for plane input, the rows are compared with the packed copy
+  // remember_planes keeps
+  bool unchanged_planes(const uint8_t *const data[], const int linesize[],
+                        int planes) {
+    if (!skip_unchanged_ || key_pending_ || last_layout_ != INPUT_LAYOUT_PLANES)
+      return false;
+    const uint8_t *last = last_input_.data();
+    for (int p = 0; p < planes; p++) {
+      int bytes = plane_bytes(p);
+      for (int row = 0; row < plane_rows(p); row++) {
+        if (!compare::equal(data[p] + (int64_t)row * linesize[p], last, bytes))
+          return false;
+        last += bytes;
+      }
+    }
+    return true;
+  }
+
+  void remember_planes(const uint8_t *const data[], const int linesize[],
+                       int planes) {
+    if (!skip_unchanged_)
+      return;
+    size_t size = 0;
+    for (int p = 0; p < planes; p++)
+      size += (size_t)plane_bytes(p) * plane_rows(p);
+    last_input_.resize(size);
+    uint8_t *last = last_input_.data();
+    for (int p = 0; p < planes; p++) {
+      int bytes = plane_bytes(p);
+      for (int row = 0; row < plane_rows(p); row++) {
+        memcpy(last, data[p] + (int64_t)row * linesize[p], bytes);
+        last += bytes;
+      }
+    }
+    last_layout_ = INPUT_LAYOUT_PLANES;
+  }
+
+  // Replace the regions of interest of frame with rects, or drop them when
+  // rects is NULL or too fragmented to be useful.
+  int set_roi(AVFrame *frame, const RamRect *rects, int count) {
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (!rects || count <= 0 || count > MAX_ROI_RECTS)
+      return 0;
+    AVFrameSideData *sd =
+        av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                               count * sizeof(AVRegionOfInterest));
+    if (!sd) {
+      LOG_ERRORF("av_frame_new_side_data failed");
+      return AVERROR(ENOMEM);
+    }
+    AVRegionOfInterest *roi = (AVRegionOfInterest *)sd->data;
+    for (int i = 0; i < count; i++) {
+      roi[i].self_size = sizeof(AVRegionOfInterest);
+      roi[i].left = std::max(rects[i].x, 0);
+      roi[i].top = std::max(rects[i].y, 0);
+      roi[i].right =
+          (int)std::min<int64_t>((int64_t)rects[i].x + rects[i].width, width_);
+      roi[i].bottom = (int)std::min<int64_t>(
+          (int64_t)rects[i].y + rects[i].height, height_);
+      roi[i].qoffset = av_make_q(ROI_QOFFSET_NUM, ROI_QOFFSET_DEN);
+    }
+    return 0;
+  }
+
+  void remember(const uint8_t *data, int length, int layout) {
+    if (!skip_unchanged_)
+      return;
+    // keeps its capacity, so this only allocates for the first frame
+    last_input_.assign(data, data + length);
+    last_layout_ = layout;
+  }
+
+  int encode_frame(AVFrame *frame, const void *obj, int64_t ms,
+                   RamEncodePacketCallback packet_callback) {
+    int ret;
+    AVFrame *tmp_frame;
+    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
+      PROFILE_START(upload);
+      if ((ret = av_hwframe_transfer_data(hw_frame_, frame, 0)) < 0) {
+        LOG_ERRORF("av_hwframe_transfer_data failed, ret = %s",
+                   av_err2cstr(ret));
+        return ret;
+      }
+      PROFILE_STOP(profiler_, ENCODE_STAGE_UPLOAD, upload);
+      // the transfer only copies the picture
+      av_frame_remove_side_data(hw_frame_, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+      AVFrameSideData *sd =
+          av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+      if (sd) {
+        AVBufferRef *buf = av_buffer_ref(sd->buf);
+        if (buf && !av_frame_new_side_data_from_buf(
+                       hw_frame_, AV_FRAME_DATA_REGIONS_OF_INTEREST, buf))
+          av_buffer_unref(&buf);
+      }
+      tmp_frame = hw_frame_;
+    } else {
+      tmp_frame = frame;
+    }
+
+    return do_encode(tmp_frame, obj, ms, packet_callback);
+  }
+
+  void async_loop() {
+    AVFrame *frame = NULL;
+    while (pending_frames_->pop(frame)) {
+      PROFILE_START(total);
+      // no packet yet is normal while the encoder fills its pipeline
+      encode_frame(frame, async_obj_, frame->pts, async_callback_);
+      PROFILE_STOP(profiler_, ENCODE_STAGE_TOTAL, total);
+      free_frames_->try_push(frame);
+    }
+  }
+
+  int copy_frame(AVFrame *frame, const uint8_t *data, int length) {
+    int planes;
+    switch (frame->format) {
+    case AV_PIX_FMT_NV12:
+      planes = 2;
+      break;
+    case AV_PIX_FMT_YUV420P:
+      planes = 3;
+      break;
+    default:
+      LOG_ERRORF("copy_frame: unsupported format, %d", frame->format);
+      return -1;
+    }
+    int offset = 0;
+    for (int i = 0; i < planes; i++) {
+      int height = i == 0 ? frame->height : frame->height / 2;
+      int size = frame->linesize[i] * height;
+      if (offset + size > length) {
+        LOG_ERRORF("copy_frame: data length error. data_length:%d, "
+                   "required:%d",
+                   length, offset + size);
+        return -1;
+      }
+      memcpy(frame->data[i], data + offset, size);
+      offset += size;
+    }
+    return 0;
+  }
+
   int set_hwframe_ctx() {
     AVBufferRef *hw_frames_ref;
     AVHWFramesContext *frames_ctx = NULL;
@@ -334,29 +1377,64 @@ private:
     return err;
   }
 
-  int do_encode(AVFrame *frame, const void *obj, int64_t ms) {
+  int do_encode(AVFrame *frame, const void *obj, int64_t ms,
+                RamEncodePacketCallback packet_callback) {
     int ret;
     bool encoded = false;
     frame->pts = ms;
+    if (restored_) {
+      drop_before_ = ms;
+      restored_ = false;
+    }
+    frame->pict_type =
+        key_pending_.exchange(false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    PROFILE_START(send);
     if ((ret = avcodec_send_frame(c_, frame)) < 0) {
-      LOG_ERROR("avcodec_send_frame failed, ret = " + av_err2str(ret));
+      LOG_ERRORF("avcodec_send_frame failed, ret = %s", av_err2cstr(ret));
+      // the frame carrying the request never reached the encoder
+      if (frame->pict_type == AV_PICTURE_TYPE_I)
+        key_pending_ = true;
       return ret;
     }
+    PROFILE_STOP(profiler_, ENCODE_STAGE_SEND_FRAME, send);
 
     while (ret >= 0) {
-      if ((ret = avcodec_receive_packet(c_, pkt_)) < 0) {
+      PROFILE_START(receive);
+      ret = avcodec_receive_packet(c_, pkt_);
+      PROFILE_STOP(profiler_, ENCODE_STAGE_RECEIVE_PACKET, receive);
+      if (ret < 0) {
         if (ret != AVERROR(EAGAIN)) {
-          LOG_ERROR("avcodec_receive_packet failed, ret = " + av_err2str(ret));
+          LOG_ERRORF("avcodec_receive_packet failed, ret = %s",
+                     av_err2cstr(ret));
         }
         goto _exit;
       }
       if (!pkt_->data || !pkt_->size) {
-        LOG_ERROR("avcodec_receive_packet failed, pkt size is 0");
+        LOG_ERRORF("avcodec_receive_packet failed, pkt size is 0");
         goto _exit;
       }
+      if (drop_before_ != AV_NOPTS_VALUE) {
+        if (pkt_->pts < drop_before_) {
+          av_packet_unref(pkt_);
+          continue;
+        }
+        drop_before_ = AV_NOPTS_VALUE;
+      }
       encoded = true;
-      callback_(pkt_->data, pkt_->size, pkt_->pts,
-                pkt_->flags & AV_PKT_FLAG_KEY, obj);
+      if (packet_callback) {
+        // hand the refcounted packet over instead of letting the callee copy
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+          LOG_ERRORF("av_packet_alloc failed");
+          goto _exit;
+        }
+        av_packet_move_ref(packet, pkt_);
+        packet_callback(packet, packet->data, packet->size, packet->pts,
+                        packet->flags & AV_PKT_FLAG_KEY, obj);
+      } else {
+        callback_(pkt_->data, pkt_->size, pkt_->pts,
+                  pkt_->flags & AV_PKT_FLAG_KEY, obj);
+      }
     }
   _exit:
     av_packet_unref(pkt_);
@@ -369,10 +1447,9 @@ private:
     case AV_PIX_FMT_NV12:
       if (data_length <
           frame->height * (frame->linesize[0] + frame->linesize[1] / 2)) {
-        LOG_ERROR("fill_frame: NV12 data length error. data_length:" +
-                  std::to_string(data_length) +
-                  ", linesize[0]:" + std::to_string(frame->linesize[0]) +
-                  ", linesize[1]:" + std::to_string(frame->linesize[1]));
+        LOG_ERRORF("fill_frame: NV12 data length error. data_length:%d, "
+                   "linesize[0]:%d, linesize[1]:%d",
+                   data_length, frame->linesize[0], frame->linesize[1]);
         return -1;
       }
       frame->data[0] = data;
@@ -382,11 +1459,10 @@ private:
       if (data_length <
           frame->height * (frame->linesize[0] + frame->linesize[1] / 2 +
                            frame->linesize[2] / 2)) {
-        LOG_ERROR("fill_frame: 420P data length error. data_length:" +
-                  std::to_string(data_length) +
-                  ", linesize[0]:" + std::to_string(frame->linesize[0]) +
-                  ", linesize[1]:" + std::to_string(frame->linesize[1]) +
-                  ", linesize[2]:" + std::to_string(frame->linesize[2]));
+        LOG_ERRORF("fill_frame: 420P data length error. data_length:%d, "
+                   "linesize[0]:%d, linesize[1]:%d, linesize[2]:%d",
+                   data_length, frame->linesize[0], frame->linesize[1],
+                   frame->linesize[2]);
         return -1;
       }
       frame->data[0] = data;
@@ -394,12 +1470,199 @@ private:
       frame->data[2] = data + offset[1];
       break;
     default:
-      LOG_ERROR("fill_frame: unsupported format, " +
-                std::to_string(frame->format));
+      LOG_ERRORF("fill_frame: unsupported format, %d", frame->format);
+      return -1;
+    }
+    return 0;
+  }
+};
+
+
+// One input encoded at several resolutions / bitrates. Every layer owns an
+// encoder, layers smaller than the input also a swscale context scaling into
+// that encoder's frame_. The layers are encoded in parallel on pool_, their
+// packets are handed out in layer order on the calling thread.
+class FFmpegRamEncoderGroup {
+public:
+  struct Layer {
+    FFmpegRamEncoder *encoder = NULL;
+    SwsContext *sws = NULL; // NULL for a layer of the input size
+    std::vector<AVPacket *> packets;
+    int ret = 0;
+  };
+
+  std::vector<Layer> layers_;
+  ThreadPool *pool_ = NULL;
+  int width_ = 0;
+  int height_ = 0;
+  AVPixelFormat pixfmt_ = AV_PIX_FMT_NV12;
+  int linesize_[AV_NUM_DATA_POINTERS] = {0};
+  int offset_[AV_NUM_DATA_POINTERS] = {0};
+  int length_ = 0;
+
+  // the input of the running encode()
+  const uint8_t *data_ = NULL;
+  int data_length_ = 0;
+  int64_t ms_ = 0;
+
+  bool init(const char *name, const char *mc_name, int width, int height,
+            int pixfmt, int align, int fps, int gop, int rc, int quality,
+            int q, int thread_count, int gpu, int refresh_period,
+            int refresh_direction, const RamEncodeLayer *layers, int count,
+            int *linesize, int *offset, int *length) {
+    if (!layers || count <= 0 || count > MAX_ENCODE_LAYERS) {
+      LOG_ERROR("invalid layer count: " + std::to_string(count));
+      return false;
+    }
+    width_ = width;
+    height_ = height;
+    pixfmt_ = (AVPixelFormat)pixfmt;
+    if (ffmpeg_ram_get_linesize_offset_length(pixfmt, width, height, align,
+                                              linesize_, offset_,
+                                              &length_) != 0)
+      return false;
+
+    layers_.resize(count);
+    for (int i = 0; i < count; i++) {
+      const RamEncodeLayer &l = layers[i];
+      if (l.width <= 0 || l.height <= 0 || l.width % 2 || l.height % 2 ||
+          l.width > width || l.height > height) {
+        LOG_ERROR("invalid layer " + std::to_string(i) + ": " +
+                  std::to_string(l.width) + "x" + std::to_string(l.height));
+        return false;
+      }
+      int layer_linesize[AV_NUM_DATA_POINTERS] = {0};
+      int layer_offset[AV_NUM_DATA_POINTERS] = {0};
+      int layer_length = 0;
+      Layer &layer = layers_[i];
+      layer.encoder = new FFmpegRamEncoder(
+          name, mc_name, l.width, l.height, pixfmt, align, fps, gop, rc,
+          quality, l.kbs, q, thread_count, gpu, refresh_period,
+          refresh_direction, NULL);
+      if (!layer.encoder->init(layer_linesize, layer_offset, &layer_length)) {
+        LOG_ERROR("init layer " + std::to_string(i) + " failed");
+        return false;
+      }
+      if (l.width != width || l.height != height) {
+        // text stays readable with area averaging when downscaling
+        layer.sws = sws_getCachedContext(NULL, width, height, pixfmt_, l.width,
+                                         l.height, pixfmt_, SWS_AREA, NULL,
+                                         NULL, NULL);
+        if (!layer.sws) {
+          LOG_ERROR("sws_getCachedContext failed, layer " + std::to_string(i));
+          return false;
+        }
+      }
+      layer.packets.reserve(4);
+    }
+    if (count > 1)
+      pool_ = new ThreadPool(count - 1);
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
+      linesize[i] = linesize_[i];
+      offset[i] = offset_[i];
+    }
+    *length = length_;
+    return true;
+  }
+
+  // Encode data, laid out as given by init, on every layer. Returns 0 if any
+  // layer produced a packet.
+  int encode(const uint8_t *data, int length, const void *obj, int64_t ms,
+             RamGroupPacketCallback callback) {
+    if (!data || length < length_ || !callback) {
+      LOG_ERRORF("encode_group: illegal parameter, length: %d", length);
       return -1;
     }
+    data_ = data;
+    data_length_ = length;
+    ms_ = ms;
+    if (pool_)
+      pool_->run((int)layers_.size(), encode_layer, this);
+    else
+      encode_layer(this, 0);
+    data_ = NULL;
+
+    bool encoded = false;
+    int ret = -1;
+    for (size_t i = 0; i < layers_.size(); i++) {
+      Layer &layer = layers_[i];
+      for (AVPacket *packet : layer.packets) {
+        callback(packet, (int)i, packet->data, packet->size, packet->pts,
+                 packet->flags & AV_PKT_FLAG_KEY, obj);
+        encoded = true;
+      }
+      layer.packets.clear();
+      // -1 is an encoder still filling its pipeline
+      if (layer.ret != 0 && layer.ret != -1)
+        ret = layer.ret;
+    }
+    return encoded ? 0 : ret;
+  }
+
+  int set_bitrate(int layer, int kbs) {
+    if (layer < 0 || layer >= (int)layers_.size())
+      return -1;
+    return layers_[layer].encoder->set_bitrate(kbs);
+  }
+
+  // layer -1 requests a keyframe on every layer
+  int request_keyframe(int layer) {
+    if (layer < -1 || layer >= (int)layers_.size())
+      return -1;
+    for (int i = 0; i < (int)layers_.size(); i++) {
+      if (layer == -1 || layer == i)
+        layers_[i].encoder->request_keyframe();
+    }
     return 0;
   }
+
+  void free_group() {
+    if (pool_) {
+      delete pool_;
+      pool_ = NULL;
+    }
+    for (auto &layer : layers_) {
+      if (layer.encoder) {
+        layer.encoder->free_encoder();
+        delete layer.encoder;
+        layer.encoder = NULL;
+      }
+      if (layer.sws) {
+        sws_freeContext(layer.sws);
+        layer.sws = NULL;
+      }
+      for (AVPacket *packet : layer.packets)
+        av_packet_free(&packet);
+      layer.packets.clear();
+    }
+  }
+
+private:
+  static void encode_layer(void *ctx, int index) {
+    FFmpegRamEncoderGroup *group = (FFmpegRamEncoderGroup *)ctx;
+    Layer &layer = group->layers_[index];
+    if (!layer.sws) {
+      layer.ret = layer.encoder->encode(group->data_, group->data_length_,
+                                        &layer, group->ms_, collect_packet);
+      return;
+    }
+    const uint8_t *src[AV_NUM_DATA_POINTERS] = {group->data_};
+    for (int i = 1; i < AV_NUM_DATA_POINTERS && group->offset_[i - 1]; i++)
+      src[i] = group->data_ + group->offset_[i - 1];
+    layer.ret = layer.encoder->encode_scaled(layer.sws, src, group->linesize_,
+                                             group->height_, &layer, group->ms_,
+                                             collect_packet);
+  }
+
+  static void collect_packet(void *packet, const uint8_t *data, int len,
+                             int64_t pts, int key, const void *obj) {
+    (void)data;
+    (void)len;
+    (void)pts;
+    (void)key;
+    ((Layer *)obj)->packets.push_back((AVPacket *)packet);
+  }
 };
 
 } // namespace
@@ -408,13 +1671,15 @@ extern "C" FFmpegRamEncoder *
 ffmpeg_ram_new_encoder(const char *name, const char *mc_name, int width,
                        int height, int pixfmt, int align, int fps, int gop,
                        int rc, int quality, int kbs, int q, int thread_count,
-                       int gpu, int *linesize, int *offset, int *length,
+                       int gpu, int refresh_period, int refresh_direction,
+                       int *linesize, int *offset, int *length,
                        RamEncodeCallback callback) {
   FFmpegRamEncoder *encoder = NULL;
   try {
     encoder = new FFmpegRamEncoder(name, mc_name, width, height, pixfmt, align,
                                    fps, gop, rc, quality, kbs, q, thread_count,
-                                   gpu, callback);
+                                   gpu, refresh_period, refresh_direction,
+                                   callback);
     if (encoder) {
       if (encoder->init(linesize, offset, length)) {
         return encoder;
@@ -441,6 +1706,125 @@ extern "C" int ffmpeg_ram_encode(FFmpegRamEncoder *encoder, const uint8_t *data,
   return -1;
 }
 
+extern "C" int ffmpeg_ram_encode_batch(FFmpegRamEncoder *encoder,
+                                       const RamEncodeEntry *entries,
+                                       int count, const void *obj) {
+  try {
+    return encoder->encode_batch(entries, count, obj);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_batch failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_encode_bgra(FFmpegRamEncoder *encoder,
+                                      const uint8_t *data, int length,
+                                      int stride, int format, int colorspace,
+                                      int range, const void *obj, int64_t ms) {
+  try {
+    return encoder->encode_bgra(data, length, stride, format, colorspace, range,
+                                obj, ms);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_bgra failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_encode_planes(FFmpegRamEncoder *encoder,
+                                        const uint8_t *const *data,
+                                        const int *linesize, const void *obj,
+                                        int64_t ms) {
+  try {
+    return encoder->encode_planes(data, linesize, obj, ms);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_planes failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_encode_dirty(FFmpegRamEncoder *encoder,
+                                       const uint8_t *data, int length,
+                                       const RamRect *rects, int count,
+                                       int roi, const void *obj, int64_t ms) {
+  try {
+    return encoder->encode_dirty(data, length, rects, count, roi != 0, obj,
+                                 ms);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_dirty failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_encode_packet(FFmpegRamEncoder *encoder,
+                                        const uint8_t *data, int length,
+                                        const void *obj, uint64_t ms,
+                                        RamEncodePacketCallback callback) {
+  try {
+    return encoder->encode(data, length, obj, ms, callback);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_packet failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_encode_start_async(FFmpegRamEncoder *encoder,
+                                             int depth,
+                                             RamEncodePacketCallback callback,
+                                             const void *obj) {
+  try {
+    return encoder->start_async(depth, callback, obj);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_start_async failed, " +
+              std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_encode_submit(FFmpegRamEncoder *encoder,
+                                        const uint8_t *data, int length,
+                                        int64_t ms) {
+  try {
+    return encoder->submit(data, length, ms);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_submit failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" void ffmpeg_ram_encode_flush_async(FFmpegRamEncoder *encoder) {
+  try {
+    encoder->flush_async();
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_flush_async failed, " +
+              std::string(e.what()));
+  }
+}
+
+extern "C" void ffmpeg_ram_encode_stop_async(FFmpegRamEncoder *encoder) {
+  try {
+    encoder->stop_async();
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_stop_async failed, " + std::string(e.what()));
+  }
+}
+
+extern "C" int ffmpeg_ram_encode_profile(FFmpegRamEncoder *encoder,
+                                         void *stats, int count, int reset) {
+  try {
+    return encoder->profile((ProfileStats *)stats, count, reset != 0);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_profile failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_error_again() { return AVERROR(EAGAIN); }
+
+extern "C" void ffmpeg_ram_free_packet(AVPacket *packet) {
+  if (packet)
+    av_packet_free(&packet);
+}
+
 extern "C" void ffmpeg_ram_free_encoder(FFmpegRamEncoder *encoder) {
   try {
     if (!encoder)
@@ -453,6 +1837,45 @@ extern "C" void ffmpeg_ram_free_encoder(FFmpegRamEncoder *encoder) {
   }
 }
 
+extern "C" void ffmpeg_ram_set_skip_unchanged(FFmpegRamEncoder *encoder,
+                                             int enable) {
+  try {
+    encoder->set_skip_unchanged(enable != 0);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_skip_unchanged failed, " + std::string(e.what()));
+  }
+}
+
+extern "C" int ffmpeg_ram_reconfigure(FFmpegRamEncoder *encoder, int width,
+                                      int height, int pixfmt, int *linesize,
+                                      int *offset, int *length) {
+  try {
+    return encoder->reconfigure(width, height, pixfmt, linesize, offset,
+                                length);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_reconfigure failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" void ffmpeg_ram_request_keyframe(FFmpegRamEncoder *encoder) {
+  try {
+    encoder->request_keyframe();
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_request_keyframe failed, " + std::string(e.what()));
+  }
+}
+
+extern "C" int ffmpeg_ram_set_rate(FFmpegRamEncoder *encoder, int kbs, int fps,
+                                   int gop) {
+  try {
+    return encoder->set_rate(kbs, fps, gop);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_rate failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
 extern "C" int ffmpeg_ram_set_bitrate(FFmpegRamEncoder *encoder, int kbs) {
   try {
     return encoder->set_bitrate(kbs);
@@ -460,4 +1883,74 @@ extern "C" int ffmpeg_ram_set_bitrate(FFmpegRamEncoder *encoder, int kbs) {
     LOG_ERROR("ffmpeg_ram_set_bitrate failed, " + std::string(e.what()));
   }
   return -1;
-}
\ No newline at end of file
+}
+
+extern "C" FFmpegRamEncoderGroup *ffmpeg_ram_new_encoder_group(
+    const char *name, const char *mc_name, int width, int height, int pixfmt,
+    int align, int fps, int gop, int rc, int quality, int q, int thread_count,
+    int gpu, int refresh_period, int refresh_direction,
+    const RamEncodeLayer *layers, int count, int *linesize, int *offset,
+    int *length) {
+  FFmpegRamEncoderGroup *group = NULL;
+  try {
+    group = new FFmpegRamEncoderGroup();
+    if (group->init(name, mc_name, width, height, pixfmt, align, fps, gop, rc,
+                    quality, q, thread_count, gpu, refresh_period,
+                    refresh_direction, layers, count, linesize, offset,
+                    length)) {
+      return group;
+    }
+  } catch (const std::exception &e) {
+    LOG_ERROR("new FFmpegRamEncoderGroup failed, " + std::string(e.what()));
+  }
+  if (group) {
+    group->free_group();
+    delete group;
+    group = NULL;
+  }
+  return NULL;
+}
+
+extern "C" int ffmpeg_ram_encode_group(FFmpegRamEncoderGroup *group,
+                                       const uint8_t *data, int length,
+                                       const void *obj, int64_t ms,
+                                       RamGroupPacketCallback callback) {
+  try {
+    return group->encode(data, length, obj, ms, callback);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_group failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_group_set_bitrate(FFmpegRamEncoderGroup *group,
+                                            int layer, int kbs) {
+  try {
+    return group->set_bitrate(layer, kbs);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_group_set_bitrate failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_group_request_keyframe(FFmpegRamEncoderGroup *group,
+                                                 int layer) {
+  try {
+    return group->request_keyframe(layer);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_group_request_keyframe failed, " +
+              std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" void ffmpeg_ram_free_encoder_group(FFmpegRamEncoderGroup *group) {
+  try {
+    if (!group)
+      return;
+    group->free_group();
+    delete group;
+  } catch (const std::exception &e) {
+    LOG_ERROR("free encoder group failed, " + std::string(e.what()));
+  }
+}
@@ -4,31 +4,174 @@
 #include <stdint.h>
 
 #define AV_NUM_DATA_POINTERS 8
+// returned by the encode functions for an input skipped by
+// ffmpeg_ram_set_skip_unchanged
+#define FFMPEG_RAM_ENCODE_SKIPPED 1
+// returned by ffmpeg_ram_set_rate for a change applied to the running encoder
+// or one that reopened it
+#define FFMPEG_RAM_RATE_DYNAMIC 0
+#define FFMPEG_RAM_RATE_REOPENED 1
 
 typedef void (*RamDecodeCallback)(const void *obj, int width, int height,
                                   int pixfmt,
                                   int linesize[AV_NUM_DATA_POINTERS],
                                   uint8_t *data[AV_NUM_DATA_POINTERS], int key);
+typedef void (*RamDecodeFrameCallback)(void *frame, const void *obj, int width,
+                                       int height, int pixfmt,
+                                       int linesize[AV_NUM_DATA_POINTERS],
+                                       uint8_t *data[AV_NUM_DATA_POINTERS],
+                                       int key);
 typedef void (*RamEncodeCallback)(const uint8_t *data, int len, int64_t pts,
                                   int key, const void *obj);
+typedef void (*RamEncodePacketCallback)(void *packet, const uint8_t *data,
+                                        int len, int64_t pts, int key,
+                                        const void *obj);
 
+// refresh_period > 0 replaces keyframes by intra refresh over that many frames
+// in refresh_direction, a RefreshDirection, where the encoder supports it
 void *ffmpeg_ram_new_encoder(const char *name, const char *mc_name, int width,
                              int height, int pixfmt, int align, int fps,
                              int gop, int rc, int quality, int kbs, int q,
-                             int thread_count, int gpu, int *linesize,
-                             int *offset, int *length,
-                             RamEncodeCallback callback);
+                             int thread_count, int gpu, int refresh_period,
+                             int refresh_direction, int *linesize, int *offset,
+                             int *length, RamEncodeCallback callback);
 void *ffmpeg_ram_new_decoder(const char *name, int device_type,
                              int thread_count, RamDecodeCallback callback);
+typedef struct RamEncodeEntry {
+  const uint8_t *data;
+  int length;
+  int64_t pts;
+} RamEncodeEntry;
+typedef struct RamRect {
+  int x;
+  int y;
+  int width;
+  int height;
+} RamRect;
+typedef struct RamEncodeLayer {
+  int width;
+  int height;
+  int kbs;
+} RamEncodeLayer;
+// Image written by ffmpeg_ram_decode_into, length is the size of data on
+// input and the size of the image on output.
+typedef struct RamDecodeTarget {
+  uint8_t *data;
+  int length;
+  int width;
+  int height;
+  int pixfmt;
+  int linesize[AV_NUM_DATA_POINTERS];
+  int key;
+} RamDecodeTarget;
+typedef void (*RamGroupPacketCallback)(void *packet, int layer,
+                                       const uint8_t *data, int len,
+                                       int64_t pts, int key, const void *obj);
+
 int ffmpeg_ram_encode(void *encoder, const uint8_t *data, int length,
                       const void *obj, int64_t ms);
+// Encode count frames in one call, the packets of all of them are passed to
+// the callback given to ffmpeg_ram_new_encoder before it returns. Fails
+// without encoding anything if an entry is shorter than the input length.
+int ffmpeg_ram_encode_batch(void *encoder, const RamEncodeEntry *entries,
+                            int count, const void *obj);
+// Convert a packed BGRA / RGBA image (format is a SurfaceFormat) to the
+// encoder pixfmt with the given ColorSpace and ColorRange, then encode it.
+int ffmpeg_ram_encode_bgra(void *encoder, const uint8_t *data, int length,
+                           int stride, int format, int colorspace, int range,
+                           const void *obj, int64_t ms);
+// Encode a buffer in the ffmpeg_ram_encode layout of which only rects changed
+// since the previous call. With roi, the rects are also passed as regions of
+// interest to encoders that support them.
+int ffmpeg_ram_encode_dirty(void *encoder, const uint8_t *data, int length,
+                            const RamRect *rects, int count, int roi,
+                            const void *obj, int64_t ms);
+// Encode a picture given as one pointer and linesize per plane. Planes the
+// encoder can't take as they are are repacked first. As in FFmpeg, a negative
+// linesize walks up from the first row data points to.
+int ffmpeg_ram_encode_planes(void *encoder, const uint8_t *const *data,
+                             const int *linesize, const void *obj, int64_t ms);
+int ffmpeg_ram_encode_packet(void *encoder, const uint8_t *data, int length,
+                             const void *obj, int64_t ms,
+                             RamEncodePacketCallback callback);
+void ffmpeg_ram_free_packet(void *packet);
+int ffmpeg_ram_encode_start_async(void *encoder, int depth,
+                                  RamEncodePacketCallback callback,
+                                  const void *obj);
+int ffmpeg_ram_encode_submit(void *encoder, const uint8_t *data, int length,
+                             int64_t ms);
+void ffmpeg_ram_encode_flush_async(void *encoder);
+void ffmpeg_ram_encode_stop_async(void *encoder);
+int ffmpeg_ram_error_again(void);
 int ffmpeg_ram_decode(void *decoder, const uint8_t *data, int length,
                       const void *obj);
+int ffmpeg_ram_decode_frame(void *decoder, const uint8_t *data, int length,
+                            const void *obj, RamDecodeFrameCallback callback);
+// Decode into target->data, packed without row padding, instead of calling
+// back. Fails if the image doesn't fit, target->length is then its size.
+int ffmpeg_ram_decode_into(void *decoder, const uint8_t *data, int length,
+                           RamDecodeTarget *target);
+// Convert decoded frames to pixfmt at width x height (0 keeps the decoded
+// size) with a ScaleAlgorithm on threads slice threads, 0 for one per core.
+// AV_PIX_FMT_NONE as pixfmt turns the conversion off. Before FFmpeg 5 the
+// conversion runs on one thread.
+int ffmpeg_ram_decode_set_output(void *decoder, int pixfmt, int width,
+                                 int height, int algorithm, int threads);
+void ffmpeg_ram_free_frame(void *frame);
+int ffmpeg_ram_set_frame_pool(void *decoder, int count);
+int ffmpeg_ram_decode_start_pipeline(void *decoder, int depth,
+                                     RamDecodeFrameCallback callback,
+                                     const void *obj);
+int ffmpeg_ram_decode_submit(void *decoder, const uint8_t *data, int length);
+void ffmpeg_ram_decode_flush_pipeline(void *decoder);
+void ffmpeg_ram_decode_stop_pipeline(void *decoder);
 void ffmpeg_ram_free_encoder(void *encoder);
 void ffmpeg_ram_free_decoder(void *decoder);
 int ffmpeg_ram_get_linesize_offset_length(int pix_fmt, int width, int height,
                                           int align, int *linesize, int *offset,
                                           int *length);
+// Sets the bitrate of the running context, which backends that only read it
+// when opening ignore. Never reopens.
 int ffmpeg_ram_set_bitrate(void *encoder, int kbs);
+// Change the bitrate, framerate and gop, a value <= 0 keeps the current one.
+// Changes the encoder can't take at runtime reopen it on the same device.
+// With intra refresh on nvenc and libx264 the gop is the refresh period, and
+// a gop change fails.
+int ffmpeg_ram_set_rate(void *encoder, int kbs, int fps, int gop);
+// Encode the next frame as an IDR frame, e.g. after the receiver lost packets.
+// Callable from any thread, an unchanged input is not skipped then.
+void ffmpeg_ram_request_keyframe(void *encoder);
+// Switch the encoder to another size and pixfmt, keeping its device and the
+// contexts of recent sizes open. Outputs the new input layout like
+// ffmpeg_ram_new_encoder.
+int ffmpeg_ram_reconfigure(void *encoder, int width, int height, int pixfmt,
+                           int *linesize, int *offset, int *length);
+
+// Encoders of count layers fed from one input of width x height, the layers
+// are encoded in parallel. linesize / offset / length describe the input.
+void *ffmpeg_ram_new_encoder_group(const char *name, const char *mc_name,
+                                   int width, int height, int pixfmt, int align,
+                                   int fps, int gop, int rc, int quality, int q,
+                                   int thread_count, int gpu,
+                                   int refresh_period, int refresh_direction,
+                                   const RamEncodeLayer *layers, int count,
+                                   int *linesize, int *offset, int *length);
+// The packets of all layers are passed to callback in layer order before
+// this returns, the callee owns them as with ffmpeg_ram_encode_packet.
+int ffmpeg_ram_encode_group(void *group, const uint8_t *data, int length,
+                            const void *obj, int64_t ms,
+                            RamGroupPacketCallback callback);
+int ffmpeg_ram_group_set_bitrate(void *group, int layer, int kbs);
+// layer -1 for all layers
+int ffmpeg_ram_group_request_keyframe(void *group, int layer);
+void ffmpeg_ram_free_encoder_group(void *group);
+// Skip inputs identical to the last encoded one, off by default. The async
+// mode always encodes.
+void ffmpeg_ram_set_skip_unchanged(void *encoder, int enable);
+
+// stats points to count ProfileStats indexed by EncodeStage / DecodeStage,
+// -1 without CFG_PROFILE
+int ffmpeg_ram_encode_profile(void *encoder, void *stats, int count, int reset);
+int ffmpeg_ram_decode_profile(void *decoder, void *stats, int count, int reset);
 
 #endif // FFMPEG_RAM_FFI_H
\ No newline at end of file
@@ -0,0 +1,384 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_MODULE "DEMUX"
+#include <common.h>
+#include <log.h>
+
+// read buffer of the memory input, packets point into FFmpeg's own buffers
+#define DEMUX_IO_BUFFER_SIZE (64 << 10)
+#define DEMUX_EOF 1
+
+namespace {
+typedef struct DemuxInfo {
+  int format;
+  int width;
+  int height;
+  int framerate_num;
+  int framerate_den;
+  int64_t duration_ms;
+} DemuxInfo;
+
+typedef struct DemuxPacket {
+  const uint8_t *data;
+  int length;
+  int64_t pts_ms;
+  int key;
+} DemuxPacket;
+
+class Demuxer {
+public:
+  AVFormatContext *ic = NULL;
+  AVStream *st = NULL;
+  // avcC / hvcC length prefixes of mp4 and mkv to Annex-B start codes, NULL
+  // for streams that already are Annex-B
+  AVBSFContext *bsf = NULL;
+  bool draining = false;
+  // the packet handed out last
+  AVPacket *pkt = NULL;
+  // memory input
+  AVIOContext *io = NULL;
+  const uint8_t *mem = NULL;
+  int64_t mem_size = 0;
+  int64_t mem_pos = 0;
+
+  Demuxer() {}
+
+  void destroy() {
+    if (pkt)
+      av_packet_free(&pkt);
+    if (bsf)
+      av_bsf_free(&bsf);
+    if (ic)
+      avformat_close_input(&ic);
+    if (io) {
+      av_freep(&io->buffer);
+      avio_context_free(&io);
+    }
+  }
+
+  bool init(const char *filename, DemuxInfo *info) {
+    int ret;
+
+    if ((ret = avformat_open_input(&ic, filename, NULL, NULL)) < 0) {
+      LOG_ERROR("avformat_open_input failed, ret = " + std::to_string(ret));
+      return false;
+    }
+    return open(info);
+  }
+
+  bool init_memory(const uint8_t *data, int64_t length, DemuxInfo *info) {
+    int ret;
+
+    if (!data || length <= 0) {
+      LOG_ERROR("invalid memory input, length: " + std::to_string(length));
+      return false;
+    }
+    mem = data;
+    mem_size = length;
+    mem_pos = 0;
+    uint8_t *buffer = (uint8_t *)av_malloc(DEMUX_IO_BUFFER_SIZE);
+    if (!buffer) {
+      LOG_ERROR("av_malloc failed");
+      return false;
+    }
+    io = avio_alloc_context(buffer, DEMUX_IO_BUFFER_SIZE, 0, this, io_read,
+                            NULL, io_seek);
+    if (!io) {
+      av_free(buffer);
+      LOG_ERROR("avio_alloc_context failed");
+      return false;
+    }
+    if (!(ic = avformat_alloc_context())) {
+      LOG_ERROR("avformat_alloc_context failed");
+      return false;
+    }
+    ic->pb = io;
+    ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    // frees ic on failure
+    if ((ret = avformat_open_input(&ic, NULL, NULL, NULL)) < 0) {
+      LOG_ERROR("avformat_open_input failed, ret = " + std::to_string(ret));
+      return false;
+    }
+    return open(info);
+  }
+
+  int read(DemuxPacket *packet) {
+    int ret;
+
+    if (!packet) {
+      LOG_ERRORF("read: packet is NULL");
+      return -1;
+    }
+    av_packet_unref(pkt);
+    while (true) {
+      if (bsf) {
+        ret = av_bsf_receive_packet(bsf, pkt);
+        if (ret == 0)
+          break;
+        if (ret == AVERROR_EOF)
+          return DEMUX_EOF;
+        if (ret != AVERROR(EAGAIN)) {
+          LOG_ERRORF("av_bsf_receive_packet failed, ret = %d", ret);
+          return ret;
+        }
+        if (draining)
+          return DEMUX_EOF;
+      }
+      ret = av_read_frame(ic, pkt);
+      if (ret == AVERROR_EOF) {
+        if (!bsf)
+          return DEMUX_EOF;
+        // the filter may still hold a packet
+        draining = true;
+        av_bsf_send_packet(bsf, NULL);
+        continue;
+      }
+      if (ret < 0) {
+        LOG_ERRORF("av_read_frame failed, ret = %d", ret);
+        return ret;
+      }
+      if (pkt->stream_index != st->index) {
+        av_packet_unref(pkt);
+        continue;
+      }
+      if (!bsf)
+        break;
+      // takes the reference
+      if ((ret = av_bsf_send_packet(bsf, pkt)) < 0) {
+        LOG_ERRORF("av_bsf_send_packet failed, ret = %d", ret);
+        av_packet_unref(pkt);
+        return ret;
+      }
+    }
+    int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    AVRational ms = {1, 1000};
+    packet->data = pkt->data;
+    packet->length = pkt->size;
+    packet->pts_ms =
+        pts != AV_NOPTS_VALUE ? av_rescale_q(pts, st->time_base, ms) : 0;
+    packet->key = (pkt->flags & AV_PKT_FLAG_KEY) ? 1 : 0;
+    return 0;
+  }
+
+  int rewind() {
+    int ret;
+
+    av_packet_unref(pkt);
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    ret = av_seek_frame(ic, st->index, start, AVSEEK_FLAG_BACKWARD);
+    // raw streams have no index to seek in
+    if (ret < 0)
+      ret = av_seek_frame(ic, -1, 0, AVSEEK_FLAG_BYTE);
+    if (ret < 0) {
+      LOG_ERROR("rewind failed, ret = " + std::to_string(ret));
+      return ret;
+    }
+    if (bsf)
+      av_bsf_flush(bsf);
+    draining = false;
+    return 0;
+  }
+
+private:
+  bool open(DemuxInfo *info) {
+    int ret;
+
+    if ((ret = avformat_find_stream_info(ic, NULL)) < 0) {
+      LOG_ERROR("avformat_find_stream_info failed, ret = " +
+                std::to_string(ret));
+      return false;
+    }
+    ret = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (ret < 0) {
+      LOG_ERROR("no video stream, ret = " + std::to_string(ret));
+      return false;
+    }
+    st = ic->streams[ret];
+    AVCodecParameters *par = st->codecpar;
+    // configurationVersion 1 starts avcC and hvcC, Annex-B starts with 0
+    if ((par->codec_id == AV_CODEC_ID_H264 ||
+         par->codec_id == AV_CODEC_ID_HEVC) &&
+        par->extradata_size > 0 && par->extradata[0] == 1) {
+      if (!init_bsf(par->codec_id == AV_CODEC_ID_H264 ? "h264_mp4toannexb"
+                                                       : "hevc_mp4toannexb"))
+        return false;
+    }
+    if (!(pkt = av_packet_alloc())) {
+      LOG_ERROR("av_packet_alloc failed");
+      return false;
+    }
+    if (info) {
+      switch (par->codec_id) {
+      case AV_CODEC_ID_H264:
+        info->format = H264;
+        break;
+      case AV_CODEC_ID_HEVC:
+        info->format = H265;
+        break;
+      case AV_CODEC_ID_VP8:
+        info->format = VP8;
+        break;
+      case AV_CODEC_ID_VP9:
+        info->format = VP9;
+        break;
+      case AV_CODEC_ID_AV1:
+        info->format = AV1;
+        break;
+      default:
+        info->format = -1;
+        break;
+      }
+      info->width = par->width;
+      info->height = par->height;
+      AVRational rate = st->avg_frame_rate.num > 0 ? st->avg_frame_rate
+                                                   : st->r_frame_rate;
+      info->framerate_num = rate.num;
+      info->framerate_den = rate.den;
+      info->duration_ms =
+          ic->duration > 0 ? ic->duration / (AV_TIME_BASE / 1000) : 0;
+    }
+    return true;
+  }
+
+  bool init_bsf(const char *name) {
+    int ret;
+
+    const AVBitStreamFilter *filter = av_bsf_get_by_name(name);
+    if (!filter) {
+      LOG_ERROR(std::string(name) + " not found");
+      return false;
+    }
+    if ((ret = av_bsf_alloc(filter, &bsf)) < 0) {
+      LOG_ERROR("av_bsf_alloc failed, ret = " + std::to_string(ret));
+      return false;
+    }
+    if ((ret = avcodec_parameters_copy(bsf->par_in, st->codecpar)) < 0) {
+      LOG_ERROR("avcodec_parameters_copy failed, ret = " +
+                std::to_string(ret));
+      return false;
+    }
+    bsf->time_base_in = st->time_base;
+    if ((ret = av_bsf_init(bsf)) < 0) {
+      LOG_ERROR("av_bsf_init failed, ret = " + std::to_string(ret));
+      return false;
+    }
+    return true;
+  }
+
+  static int io_read(void *opaque, uint8_t *buf, int size) {
+    Demuxer *demuxer = (Demuxer *)opaque;
+    int64_t left = demuxer->mem_size - demuxer->mem_pos;
+    if (left <= 0)
+      return AVERROR_EOF;
+    if (size > left)
+      size = (int)left;
+    memcpy(buf, demuxer->mem + demuxer->mem_pos, size);
+    demuxer->mem_pos += size;
+    return size;
+  }
+
+  static int64_t io_seek(void *opaque, int64_t offset, int whence) {
+    Demuxer *demuxer = (Demuxer *)opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return demuxer->mem_size;
+    case SEEK_SET:
+      pos = offset;
+      break;
+    case SEEK_CUR:
+      pos = demuxer->mem_pos + offset;
+      break;
+    case SEEK_END:
+      pos = demuxer->mem_size + offset;
+      break;
+    default:
+      return -1;
+    }
+    if (pos < 0 || pos > demuxer->mem_size)
+      return -1;
+    demuxer->mem_pos = pos;
+    return pos;
+  }
+};
+} // namespace
+
+extern "C" Demuxer *hwcodec_new_demuxer(const char *filename,
+                                        DemuxInfo *info) {
+  Demuxer *demuxer = NULL;
+  try {
+    demuxer = new Demuxer();
+    if (demuxer) {
+      if (demuxer->init(filename, info)) {
+        return demuxer;
+      }
+    }
+  } catch (const std::exception &e) {
+    LOG_ERROR("new demuxer exception: " + std::string(e.what()));
+  }
+  if (demuxer) {
+    demuxer->destroy();
+    delete demuxer;
+    demuxer = NULL;
+  }
+  return NULL;
+}
+
+extern "C" Demuxer *hwcodec_new_memory_demuxer(const uint8_t *data,
+                                               int64_t length,
+                                               DemuxInfo *info) {
+  Demuxer *demuxer = NULL;
+  try {
+    demuxer = new Demuxer();
+    if (demuxer) {
+      if (demuxer->init_memory(data, length, info)) {
+        return demuxer;
+      }
+    }
+  } catch (const std::exception &e) {
+    LOG_ERROR("new memory demuxer exception: " + std::string(e.what()));
+  }
+  if (demuxer) {
+    demuxer->destroy();
+    delete demuxer;
+    demuxer = NULL;
+  }
+  return NULL;
+}
+
+extern "C" int hwcodec_demux_read(Demuxer *demuxer, DemuxPacket *packet) {
+  try {
+    return demuxer->read(packet);
+  } catch (const std::exception &e) {
+    LOG_ERROR("demux_read exception: " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int hwcodec_demux_rewind(Demuxer *demuxer) {
+  try {
+    return demuxer->rewind();
+  } catch (const std::exception &e) {
+    LOG_ERROR("demux_rewind exception: " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" void hwcodec_free_demuxer(Demuxer *demuxer) {
+  try {
+    if (!demuxer)
+      return;
+    demuxer->destroy();
+    delete demuxer;
+    demuxer = NULL;
+  } catch (const std::exception &e) {
+    LOG_ERROR("free_demuxer exception: " + std::string(e.what()));
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef DEMUX_FFI_H
+#define DEMUX_FFI_H
+
+#include <stdint.h>
+
+// returned by hwcodec_demux_read after the last packet
+#define DEMUX_EOF 1
+
+typedef struct DemuxInfo {
+  int format; // DataFormat, -1 for other codecs
+  int width;
+  int height;
+  int framerate_num;
+  int framerate_den;
+  int64_t duration_ms; // 0 if unknown
+} DemuxInfo;
+
+// An Annex-B packet of the video stream. data belongs to the demuxer and is
+// valid until the next hwcodec_demux_read, hwcodec_demux_rewind or
+// hwcodec_free_demuxer.
+typedef struct DemuxPacket {
+  const uint8_t *data;
+  int length;
+  int64_t pts_ms;
+  int key;
+} DemuxPacket;
+
+// Open the first video stream of a file, e.g. mp4, mkv or a raw .h264 /
+// .h265 stream, read as it is consumed.
+void *hwcodec_new_demuxer(const char *filename, DemuxInfo *info);
+// Same for a file already in memory, data must outlive the demuxer.
+void *hwcodec_new_memory_demuxer(const uint8_t *data, int64_t length,
+                                 DemuxInfo *info);
+// 0 with the next packet, DEMUX_EOF at the end, < 0 on error
+int hwcodec_demux_read(void *demuxer, DemuxPacket *packet);
+// Continue from the first packet again.
+int hwcodec_demux_rewind(void *demuxer);
+void hwcodec_free_demuxer(void *demuxer);
+
+#endif // DEMUX_FFI_H
@@ -6,20 +6,104 @@ extern "C" {
 #include <libavutil/opt.h>
 #include <libavutil/timestamp.h>
 }
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <math.h>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <vector>
 
 #define LOG_MODULE "MUX"
+#include <bounded_queue.h>
 #include <log.h>
+#include <nal.h>
+#include <profile.h>
+
+// stream mode defaults
+#define MUX_STREAM_BUFFER_SIZE (1 << 20)
+#define MUX_FRAGMENT_MS 1000
+// initial capacity of an async slot, it grows to the largest packet
+#define MUX_SLOT_RESERVE (256 << 10)
+// returned by hwcodec_write_video_frame for a packet the async queue dropped
+#define MUX_FRAME_DROPPED 1
 
 namespace {
+typedef int (*MuxWriteCallback)(const uint8_t *data, int len, const void *obj);
+enum MuxFormat {
+  MUX_FORMAT_MP4,
+  MUX_FORMAT_MATROSKA,
+};
+enum MuxQueuePolicy {
+  MUX_QUEUE_BLOCK,
+  MUX_QUEUE_DROP,
+};
+typedef struct MuxQueueStats {
+  int depth;
+  int max_depth;
+  int capacity;
+  int64_t written;
+  int64_t dropped;
+  int64_t write_ns;
+  int64_t write_max_ns;
+  int64_t latency_ns;
+  int64_t latency_max_ns;
+} MuxQueueStats;
+
+// a packet copied for the writer thread
+struct MuxSlot {
+  std::vector<uint8_t> data;
+  int64_t pts_ms;
+  int key;
+  std::chrono::steady_clock::time_point submitted;
+};
+
 typedef struct OutputStream {
   AVStream *st;
   AVPacket *tmp_pkt;
 } OutputStream;
 
+// Copy the parameter set NAL units of an Annex-B keyframe, start codes
+// included, to the extradata the mp4 and matroska muxers build avcC / hvcC
+// from, and take the picture size from the SPS. Returns false if there are
+// none.
+bool set_extradata(AVCodecParameters *par, const uint8_t *data, int len,
+                   bool is265) {
+  static const uint8_t start_code[] = {0, 0, 0, 1};
+  std::vector<uint8_t> sets;
+  size_t pos = 0;
+  nal::Unit unit;
+  while (nal::next(data, len, &pos, is265, &unit)) {
+    if (!nal::is_parameter_set(unit.type, is265))
+      continue;
+    sets.insert(sets.end(), start_code, start_code + sizeof(start_code));
+    sets.insert(sets.end(), unit.data, unit.data + unit.size);
+    int width, height;
+    if (nal::is_sps(unit.type, is265) &&
+        nal::sps_resolution(unit.data, unit.size, is265, &width, &height) &&
+        (width != par->width || height != par->height)) {
+      LOG_WARN("SPS size " + std::to_string(width) + "x" +
+               std::to_string(height) + " differs from " +
+               std::to_string(par->width) + "x" + std::to_string(par->height));
+      par->width = width;
+      par->height = height;
+    }
+  }
+  if (sets.empty())
+    return false;
+  av_freep(&par->extradata);
+  par->extradata =
+      (uint8_t *)av_mallocz(sets.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (!par->extradata)
+    return false;
+  memcpy(par->extradata, sets.data(), sets.size());
+  par->extradata_size = (int)sets.size();
+  return true;
+}
+
 class Muxer {
 public:
   OutputStream video_st;
@@ -28,60 +112,284 @@ public:
   int64_t start_ms;
   int64_t last_pts;
   int got_first;
+  int is265 = 0;
+  // stream mode: output through write_callback, the header waits for the
+  // first keyframe to carry its parameter sets
+  AVIOContext *io = NULL;
+  MuxWriteCallback write_callback = NULL;
+  const void *write_obj = NULL;
+  AVDictionary *options = NULL;
+  bool header_written = false;
+  // segment mode, the file of the next segment is opened ahead on opener
+  struct Segment {
+    AVFormatContext *oc = NULL;
+    AVStream *st = NULL;
+    std::string filename;
+  };
+  std::string filename;
+  std::string current;
+  int width = 0;
+  int height = 0;
+  int64_t segment_ms = 0;
+  int64_t segment_bytes = 0;
+  int keep = 0;
+  int segment_index = 0;
+  std::deque<std::string> finished; // closed segments, oldest first
+  Segment next;
+  std::thread opener;
+  // async mode: submit copies packets into free slots, writer muxes them
+  bool async = false;
+  int policy = MUX_QUEUE_BLOCK;
+  std::vector<MuxSlot *> slots;
+  BoundedQueue<MuxSlot *> *free_slots = NULL;
+  BoundedQueue<MuxSlot *> *pending = NULL;
+  std::thread writer;
+  // submit side: a key was queued, packets are dropped until the next key
+  bool queued_key = false;
+  bool dropping = false;
+  // first error of the writer, returned by the following submits
+  std::atomic<int> async_error = {0};
+  std::mutex stats_mutex;
+  MuxQueueStats stats = {};
+#ifdef CFG_PROFILE
+  Profiler profiler;
+#endif
 
   Muxer() {}
 
   void destroy() {
+    stop_async();
+    discard_next();
     OutputStream *ost = &video_st;
     if (ost && ost->tmp_pkt)
       av_packet_free(&ost->tmp_pkt);
+    if (io) {
+      av_freep(&io->buffer);
+      avio_context_free(&io);
+      if (oc)
+        oc->pb = NULL;
+    }
     if (oc && oc->pb && !(oc->oformat->flags & AVFMT_NOFILE))
       avio_closep(&oc->pb);
     if (oc)
       avformat_free_context(oc);
+    av_dict_free(&options);
   }
 
+  // With segment_ms or segment_bytes, the output is split into files named
+  // after filename with a running index, each started at the first keyframe
+  // past either limit. Only the last keep of them are kept, 0 for all.
   bool init(const char *filename, int width, int height, int is265,
-            int framerate) {
+            int framerate, int segment_ms, int64_t segment_bytes, int keep) {
     OutputStream *ost = &video_st;
     ost->st = NULL;
     ost->tmp_pkt = NULL;
+
+    this->filename = filename;
+    this->width = width;
+    this->height = height;
+    this->is265 = is265;
+    this->segment_ms = segment_ms > 0 ? segment_ms : 0;
+    this->segment_bytes = segment_bytes > 0 ? segment_bytes : 0;
+    this->keep = keep > 0 ? keep : 0;
+    current = segmented() ? segment_name(0) : this->filename;
+
+    ost->tmp_pkt = av_packet_alloc();
+    if (!ost->tmp_pkt) {
+      LOG_ERROR("av_packet_alloc failed");
+      return false;
+    }
+
+    PROFILE_START(header);
+    if (!open_file(current, &oc, &ost->st))
+      return false;
+    PROFILE_STOP(profiler, MUX_STAGE_WRITE_HEADER, header);
+    header_written = true;
+
+    this->framerate = framerate;
+    this->start_ms = 0;
+    this->last_pts = 0;
+    this->got_first = 0;
+
+    if (segmented())
+      preopen();
+    return true;
+  }
+
+  // Create name and write its header, *ctx is left for close_file on failure
+  bool open_file(const std::string &name, AVFormatContext **ctx,
+                 AVStream **st) {
     int ret;
 
-    if ((ret = avformat_alloc_output_context2(&oc, NULL, NULL, filename)) < 0) {
+    ret = avformat_alloc_output_context2(ctx, NULL, NULL, name.c_str());
+    if (ret < 0) {
       LOG_ERROR("avformat_alloc_output_context2 failed, ret = " +
                 std::to_string(ret));
       return false;
     }
-
-    ost->st = avformat_new_stream(oc, NULL);
-    if (!ost->st) {
-      LOG_ERROR("avformat_new_stream failed");
+    if (!(*st = add_video_stream(*ctx)))
       return false;
-    }
-    ost->st->id = oc->nb_streams - 1;
-    ost->st->codecpar->codec_id = is265 ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264;
-    ost->st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-    ost->st->codecpar->width = width;
-    ost->st->codecpar->height = height;
-
-    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
-      ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
+    if (!((*ctx)->oformat->flags & AVFMT_NOFILE)) {
+      ret = avio_open(&(*ctx)->pb, name.c_str(), AVIO_FLAG_WRITE);
       if (ret < 0) {
         LOG_ERROR("avio_open failed, ret = " + std::to_string(ret));
         return false;
       }
     }
+    ret = avformat_write_header(*ctx, NULL);
+    if (ret < 0) {
+      LOG_ERROR("avformat_write_header failed");
+      return false;
+    }
+    return true;
+  }
 
-    ost->tmp_pkt = av_packet_alloc();
-    if (!ost->tmp_pkt) {
-      LOG_ERROR("av_packet_alloc failed");
+  static void close_file(AVFormatContext **ctx) {
+    if (!*ctx)
+      return;
+    if ((*ctx)->pb && !((*ctx)->oformat->flags & AVFMT_NOFILE))
+      avio_closep(&(*ctx)->pb);
+    avformat_free_context(*ctx);
+    *ctx = NULL;
+  }
+
+  bool segmented() const { return segment_ms > 0 || segment_bytes > 0; }
+
+  // filename with -index before the extension
+  std::string segment_name(int index) const {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%05d", index);
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+      return filename + suffix;
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+  }
+
+  // Create the file of the next segment and write its header on opener, so
+  // the cut itself only writes the trailer of the current one.
+  void preopen() {
+    int index = segment_index + 1;
+    opener = std::thread([this, index] {
+      Segment segment;
+      segment.filename = segment_name(index);
+      if (!open_file(segment.filename, &segment.oc, &segment.st)) {
+        LOG_ERROR("open segment " + segment.filename + " failed");
+        close_file(&segment.oc);
+        remove(segment.filename.c_str());
+      }
+      next = segment;
+    });
+  }
+
+  bool segment_due(int64_t pts_ms) {
+    if (segment_ms > 0 && pts_ms - start_ms >= segment_ms)
+      return true;
+    return segment_bytes > 0 && oc->pb && avio_tell(oc->pb) >= segment_bytes;
+  }
+
+  // Finish the current segment and continue in the preopened one. If that
+  // failed to open, the current segment goes on until the next keyframe.
+  void cut() {
+    int ret;
+
+    if (opener.joinable())
+      opener.join();
+    if (!next.oc) {
+      segment_index++;
+      preopen();
+      return;
+    }
+    if ((ret = av_write_trailer(oc)) < 0)
+      LOG_ERROR("av_write_trailer failed, ret = " + std::to_string(ret));
+    close_file(&oc);
+    finished.push_back(current);
+    oc = next.oc;
+    video_st.st = next.st;
+    current = next.filename;
+    next = Segment();
+    segment_index++;
+    // timestamps of every segment start at 0
+    got_first = 0;
+    last_pts = 0;
+    while (keep > 0 && (int)finished.size() + 1 > keep) {
+      remove(finished.front().c_str());
+      finished.pop_front();
+    }
+    preopen();
+  }
+
+  // Close and delete a preopened segment that was never used.
+  void discard_next() {
+    if (opener.joinable())
+      opener.join();
+    if (next.oc) {
+      close_file(&next.oc);
+      remove(next.filename.c_str());
+    }
+    next = Segment();
+  }
+
+  // Write a fragmented mp4 or a matroska stream through callback with a
+  // buffer of buffer_size bytes, flushed at least every fragment_ms.
+  bool init_stream(int format, int width, int height, int is265, int framerate,
+                   int fragment_ms, int buffer_size, MuxWriteCallback callback,
+                   const void *obj) {
+    OutputStream *ost = &video_st;
+    ost->st = NULL;
+    ost->tmp_pkt = NULL;
+    int ret;
+
+    if (!callback) {
+      LOG_ERROR("no write callback");
       return false;
     }
+    const char *name = format == MUX_FORMAT_MATROSKA ? "matroska" : "mp4";
+    if ((ret = avformat_alloc_output_context2(&oc, NULL, name, NULL)) < 0) {
+      LOG_ERROR("avformat_alloc_output_context2 failed, ret = " +
+                std::to_string(ret));
+      return false;
+    }
+    this->width = width;
+    this->height = height;
+    this->is265 = is265;
+    if (!(ost->st = add_video_stream(oc)))
+      return false;
 
-    ret = avformat_write_header(oc, NULL);
-    if (ret < 0) {
-      LOG_ERROR("avformat_write_header failed");
+    if (buffer_size <= 0)
+      buffer_size = MUX_STREAM_BUFFER_SIZE;
+    uint8_t *buffer = (uint8_t *)av_malloc(buffer_size);
+    if (!buffer) {
+      LOG_ERROR("av_malloc failed");
+      return false;
+    }
+    // not seekable, so both muxers write everything in one pass
+    io = avio_alloc_context(buffer, buffer_size, 1, this, NULL, io_write, NULL);
+    if (!io) {
+      av_free(buffer);
+      LOG_ERROR("avio_alloc_context failed");
+      return false;
+    }
+    oc->pb = io;
+    oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    write_callback = callback;
+    write_obj = obj;
+
+    if (fragment_ms <= 0)
+      fragment_ms = MUX_FRAGMENT_MS;
+    if (format == MUX_FORMAT_MATROSKA) {
+      av_dict_set_int(&options, "cluster_time_limit", fragment_ms, 0);
+    } else {
+      // a fragment also starts at every keyframe
+      av_dict_set(&options, "movflags",
+                  "frag_keyframe+empty_moov+default_base_moof", 0);
+      av_dict_set_int(&options, "frag_duration", (int64_t)fragment_ms * 1000,
+                      0);
+    }
+
+    ost->tmp_pkt = av_packet_alloc();
+    if (!ost->tmp_pkt) {
+      LOG_ERROR("av_packet_alloc failed");
       return false;
     }
 
@@ -93,7 +401,215 @@ public:
     return true;
   }
 
+  AVStream *add_video_stream(AVFormatContext *ctx) {
+    AVStream *st = avformat_new_stream(ctx, NULL);
+    if (!st) {
+      LOG_ERROR("avformat_new_stream failed");
+      return NULL;
+    }
+    st->id = ctx->nb_streams - 1;
+    st->codecpar->codec_id = is265 ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264;
+    st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    st->codecpar->width = width;
+    st->codecpar->height = height;
+    return st;
+  }
+
+  // stream mode, called with the first keyframe
+  int write_header(const uint8_t *data, int len) {
+    int ret;
+
+    if (!set_extradata(video_st.st->codecpar, data, len, is265)) {
+      LOG_ERROR("no parameter sets in the first keyframe");
+      return -1;
+    }
+    PROFILE_START(header);
+    ret = avformat_write_header(oc, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+      LOG_ERROR("avformat_write_header failed, ret = " + std::to_string(ret));
+      return -1;
+    }
+    PROFILE_STOP(profiler, MUX_STAGE_WRITE_HEADER, header);
+    header_written = true;
+    return 0;
+  }
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+  static int io_write(void *opaque, const uint8_t *buf, int size) {
+#else
+  static int io_write(void *opaque, uint8_t *buf, int size) {
+#endif
+    Muxer *muxer = (Muxer *)opaque;
+    if (muxer->write_callback(buf, size, muxer->write_obj) < 0)
+      return AVERROR(EIO);
+    return size;
+  }
+
+  // Mux on a writer thread from now on, with depth packets queued at most.
+  // A full queue blocks write_video_frame or drops packets up to the next
+  // keyframe, depending on policy.
+  int start_async(int depth, int policy) {
+    if (async) {
+      LOG_ERROR("async mode already started");
+      return -1;
+    }
+    if (depth <= 0) {
+      LOG_ERROR("invalid async depth: " + std::to_string(depth));
+      return -1;
+    }
+    free_slots = new BoundedQueue<MuxSlot *>(depth);
+    pending = new BoundedQueue<MuxSlot *>(depth);
+    for (int i = 0; i < depth; i++) {
+      MuxSlot *slot = new MuxSlot();
+      slot->data.reserve(MUX_SLOT_RESERVE);
+      slots.push_back(slot);
+      free_slots->try_push(slot);
+    }
+    this->policy = policy;
+    queued_key = got_first != 0;
+    dropping = false;
+    async_error = 0;
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      stats = {};
+      stats.capacity = depth;
+    }
+    // the writer flushes once per burst instead of after every packet
+    oc->flush_packets = 0;
+    async = true;
+    writer = std::thread(&Muxer::write_loop, this);
+    return 0;
+  }
+
+  int submit(const uint8_t *data, int len, int64_t pts_ms, int key) {
+    MuxSlot *slot = NULL;
+    int ret;
+
+    if ((ret = async_error) < 0)
+      return ret;
+    if (!queued_key && key != 1)
+      return -2;
+    if (dropping && key != 1)
+      return drop();
+    if (policy == MUX_QUEUE_DROP) {
+      if (!free_slots->try_pop(slot))
+        return drop();
+    } else if (!free_slots->pop(slot)) {
+      return -1;
+    }
+    dropping = false;
+    if (key == 1)
+      queued_key = true;
+    slot->data.assign(data, data + len);
+    slot->pts_ms = pts_ms;
+    slot->key = key;
+    slot->submitted = std::chrono::steady_clock::now();
+    pending->try_push(slot);
+    int depth = (int)pending->size();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (depth > stats.max_depth)
+      stats.max_depth = depth;
+    return 0;
+  }
+
+  // Block until every queued packet is written and flushed to the output.
+  void flush_async() {
+    if (!async)
+      return;
+    // every slot is back once the writer has finished the last packet
+    free_slots->wait_full();
+  }
+
+  void stop_async() {
+    if (pending)
+      pending->close();
+    if (writer.joinable())
+      writer.join();
+    if (async && oc)
+      oc->flush_packets = -1; // the default
+    async = false;
+    for (auto &slot : slots)
+      delete slot;
+    slots.clear();
+    if (free_slots) {
+      delete free_slots;
+      free_slots = NULL;
+    }
+    if (pending) {
+      delete pending;
+      pending = NULL;
+    }
+  }
+
+  int queue_stats(MuxQueueStats *out, bool reset) {
+    if (!out)
+      return -1;
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    *out = stats;
+    out->depth = pending ? (int)pending->size() : 0;
+    if (reset) {
+      int capacity = stats.capacity;
+      stats = {};
+      stats.capacity = capacity;
+    }
+    return 0;
+  }
+
+  int drop() {
+    dropping = true;
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.dropped++;
+    return MUX_FRAME_DROPPED;
+  }
+
+  void write_loop() {
+    MuxSlot *slot = NULL;
+    while (pending->pop(slot)) {
+      auto begin = std::chrono::steady_clock::now();
+      int ret = write_video_frame(slot->data.data(), (int)slot->data.size(),
+                                  slot->pts_ms, slot->key);
+      // everything buffered since the queue last ran dry goes out at once
+      if (pending->size() == 0 && oc->pb)
+        avio_flush(oc->pb);
+      auto end = std::chrono::steady_clock::now();
+      if (ret < 0) {
+        int expected = 0;
+        async_error.compare_exchange_strong(expected, ret);
+      }
+      int64_t write_ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+              .count();
+      int64_t latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               end - slot->submitted)
+                               .count();
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats.written++;
+        stats.write_ns += write_ns;
+        if (write_ns > stats.write_max_ns)
+          stats.write_max_ns = write_ns;
+        stats.latency_ns += latency_ns;
+        if (latency_ns > stats.latency_max_ns)
+          stats.latency_max_ns = latency_ns;
+      }
+      free_slots->try_push(slot);
+    }
+  }
+
+  int write_tail() {
+    // the trailer follows every queued packet
+    stop_async();
+    // nothing was written in stream mode without a keyframe
+    if (!header_written)
+      return 0;
+    int ret = av_write_trailer(oc);
+    discard_next();
+    return ret;
+  }
+
   int write_video_frame(const uint8_t *data, int len, int64_t pts_ms, int key) {
+    PROFILE_START(total);
     OutputStream *ost = &video_st;
     AVPacket *pkt = ost->tmp_pkt;
     AVFormatContext *fmt_ctx = oc;
@@ -101,9 +617,15 @@ public:
 
     if (framerate <= 0)
       return -3;
+    if (segmented() && key == 1 && got_first && segment_due(pts_ms)) {
+      cut();
+      fmt_ctx = oc;
+    }
     if (!got_first) {
       if (key != 1)
         return -2;
+      if (!header_written && write_header(data, len) != 0)
+        return -1;
       start_ms = pts_ms;
     }
     int64_t pts = (pts_ms - start_ms); // use write timestamp
@@ -130,23 +652,40 @@ public:
     } else {
       pkt->flags &= ~AV_PKT_FLAG_KEY;
     }
+    PROFILE_START(write);
     ret = av_write_frame(fmt_ctx, pkt);
+    PROFILE_STOP(profiler, MUX_STAGE_WRITE_FRAME, write);
     if (ret < 0) {
-      LOG_ERROR("av_write_frame failed, ret = " + std::to_string(ret));
+      LOG_ERRORF("av_write_frame failed, ret = %d", ret);
       return -1;
     }
+    PROFILE_STOP(profiler, MUX_STAGE_TOTAL, total);
     return 0;
   }
+
+  int profile(ProfileStats *stats, int count, bool reset) {
+#ifdef CFG_PROFILE
+    profiler.snapshot(stats, count, reset);
+    return 0;
+#else
+    (void)stats;
+    (void)count;
+    (void)reset;
+    return -1;
+#endif
+  }
 };
 } // namespace
 
 extern "C" Muxer *hwcodec_new_muxer(const char *filename, int width, int height,
-                                    int is265, int framerate) {
+                                    int is265, int framerate, int segment_ms,
+                                    int64_t segment_bytes, int keep) {
   Muxer *muxer = NULL;
   try {
     muxer = new Muxer();
     if (muxer) {
-      if (muxer->init(filename, width, height, is265, framerate)) {
+      if (muxer->init(filename, width, height, is265, framerate, segment_ms,
+                      segment_bytes, keep)) {
         return muxer;
       }
     }
@@ -161,9 +700,35 @@ extern "C" Muxer *hwcodec_new_muxer(const char *filename, int width, int height,
   return NULL;
 }
 
+extern "C" Muxer *
+hwcodec_new_stream_muxer(int format, int width, int height, int is265,
+                         int framerate, int fragment_ms, int buffer_size,
+                         MuxWriteCallback callback, const void *obj) {
+  Muxer *muxer = NULL;
+  try {
+    muxer = new Muxer();
+    if (muxer) {
+      if (muxer->init_stream(format, width, height, is265, framerate,
+                             fragment_ms, buffer_size, callback, obj)) {
+        return muxer;
+      }
+    }
+  } catch (const std::exception &e) {
+    LOG_ERROR("new stream muxer exception: " + std::string(e.what()));
+  }
+  if (muxer) {
+    muxer->destroy();
+    delete muxer;
+    muxer = NULL;
+  }
+  return NULL;
+}
+
 extern "C" int hwcodec_write_video_frame(Muxer *muxer, const uint8_t *data,
                                          int len, int64_t pts_ms, int key) {
   try {
+    if (muxer->async)
+      return muxer->submit(data, len, pts_ms, key);
     return muxer->write_video_frame(data, len, pts_ms, key);
   } catch (const std::exception &e) {
     LOG_ERROR("write_video_frame exception: " + std::string(e.what()));
@@ -171,8 +736,51 @@ extern "C" int hwcodec_write_video_frame(Muxer *muxer, const uint8_t *data,
   return -1;
 }
 
+extern "C" int hwcodec_muxer_start_async(Muxer *muxer, int depth,
+                                         int policy) {
+  try {
+    return muxer->start_async(depth, policy);
+  } catch (const std::exception &e) {
+    LOG_ERROR("muxer_start_async exception: " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" void hwcodec_muxer_flush(Muxer *muxer) {
+  try {
+    muxer->flush_async();
+  } catch (const std::exception &e) {
+    LOG_ERROR("muxer_flush exception: " + std::string(e.what()));
+  }
+}
+
+extern "C" int hwcodec_muxer_queue_stats(Muxer *muxer, MuxQueueStats *stats,
+                                         int reset) {
+  try {
+    return muxer->queue_stats(stats, reset != 0);
+  } catch (const std::exception &e) {
+    LOG_ERROR("muxer_queue_stats exception: " + std::string(e.what()));
+  }
+  return -1;
+}
+
 extern "C" int hwcodec_write_tail(Muxer *muxer) {
-  return av_write_trailer(muxer->oc);
+  try {
+    return muxer->write_tail();
+  } catch (const std::exception &e) {
+    LOG_ERROR("write_tail exception: " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int hwcodec_muxer_profile(Muxer *muxer, void *stats, int count,
+                                     int reset) {
+  try {
+    return muxer->profile((ProfileStats *)stats, count, reset != 0);
+  } catch (const std::exception &e) {
+    LOG_ERROR("muxer_profile exception: " + std::string(e.what()));
+  }
+  return -1;
 }
 
 extern "C" void hwcodec_free_muxer(Muxer *muxer) {
@@ -3,13 +3,65 @@
 
 #include <stdint.h>
 
+// With segment_ms or segment_bytes > 0, the recording is split into files
+// named filename with -00000, -00001, ... before the extension. A new one is
+// started at the first keyframe once the current one reaches either limit,
+// and it is opened ahead of time. keep > 0 deletes all but the last keep.
 void *hwcodec_new_muxer(const char *filename, int width, int height, int is265,
-                        int framerate);
+                        int framerate, int segment_ms, int64_t segment_bytes,
+                        int keep);
+
+// Called with the next bytes of a stream muxer, returns < 0 on failure
+typedef int (*MuxWriteCallback)(const uint8_t *data, int len, const void *obj);
+enum MuxFormat {
+  MUX_FORMAT_MP4,
+  MUX_FORMAT_MATROSKA,
+};
+// Mux into a fragmented mp4 or a matroska stream passed to callback instead of
+// a file. A fragment or cluster is flushed at every keyframe (mp4 only) and
+// after fragment_ms, buffer_size is the size of the reused write buffer. 0 for
+// either takes the default. The header is written with the first keyframe.
+void *hwcodec_new_stream_muxer(int format, int width, int height, int is265,
+                               int framerate, int fragment_ms, int buffer_size,
+                               MuxWriteCallback callback, const void *obj);
+
+// returned by hwcodec_write_video_frame for a packet the async queue dropped,
+// the following ones are dropped up to the next keyframe
+#define MUX_FRAME_DROPPED 1
 
 int hwcodec_write_video_frame(void *muxer, const uint8_t *data, int len,
                               int64_t pts_ms, int key);
+
+enum MuxQueuePolicy {
+  MUX_QUEUE_BLOCK,
+  MUX_QUEUE_DROP,
+};
+typedef struct MuxQueueStats {
+  int depth;     // packets queued now
+  int max_depth; // most packets queued at once
+  int capacity;
+  int64_t written;
+  int64_t dropped;
+  // time spent writing and flushing, and from submit to written
+  int64_t write_ns;
+  int64_t write_max_ns;
+  int64_t latency_ns;
+  int64_t latency_max_ns;
+} MuxQueueStats;
+// Hand packets to a writer thread through a queue of depth copies instead of
+// muxing them in hwcodec_write_video_frame. With MUX_QUEUE_BLOCK a full queue
+// blocks the caller, with MUX_QUEUE_DROP the packet is dropped. Output is
+// flushed whenever the queue runs empty. hwcodec_write_tail drains the queue.
+int hwcodec_muxer_start_async(void *muxer, int depth, int policy);
+// Block until every queued packet is written.
+void hwcodec_muxer_flush(void *muxer);
+// Counters since the last reset, -1 if stats is NULL
+int hwcodec_muxer_queue_stats(void *muxer, MuxQueueStats *stats, int reset);
 int hwcodec_write_tail(void *muxer);
 
+// stats points to MUX_STAGE_COUNT ProfileStats, -1 without CFG_PROFILE
+int hwcodec_muxer_profile(void *muxer, void *stats, int count, int reset);
+
 void hwcodec_free_muxer(void *muxer);
 
 #endif // FFI_H
\ No newline at end of file
@@ -40,6 +40,7 @@ fn setup_ram(max_align: i32) {
             kbs: 0,
             q: -1,
             thread_count: 1,
+            intra_refresh: None,
         },
         None,
     );
@@ -106,11 +107,13 @@ fn test_ram(width: i32, height: i32, encode_info: CodecInfo, decode_info: CodecI
         rc: RC_CBR,
         thread_count: 1,
         q: -1,
+        intra_refresh: None,
     };
     let decode_ctx = DecodeContext {
         name: decode_info.name.clone(),
         device_type: decode_info.hwdevice,
         thread_count: 4,
+        output: None,
     };
     let (_, _, len) = ffmpeg_linesize_offset_length(
         encode_ctx.pixfmt,
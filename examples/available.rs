@@ -32,6 +32,7 @@ fn ram() {
         quality: Quality_Default,
         rc: RC_CBR,
         q: -1,
+        intra_refresh: None,
         thread_count: 1,
     };
     let encoders = Encoder::available_encoders(ctx.clone(), None);
@@ -29,6 +29,7 @@ fn main() {
         rc: RC_DEFAULT,
         thread_count: 4,
         q: -1,
+        intra_refresh: None,
     };
     let yuv_count = 100;
     println!("benchmark");
@@ -81,6 +82,7 @@ fn test_decoder(info: CodecInfo, h26xs: &Vec<Vec<u8>>, best: bool) {
         name: info.name,
         device_type: info.hwdevice,
         thread_count: 4,
+        output: None,
     };
 
     let mut decoder = Decoder::new(ctx.clone()).unwrap();
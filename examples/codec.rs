@@ -30,11 +30,13 @@ fn main() {
         rc: RC_DEFAULT,
         thread_count: 4,
         q: -1,
+        intra_refresh: None,
     };
     let decode_ctx = DecodeContext {
         name: String::from("hevc"),
         device_type: AV_HWDEVICE_TYPE_D3D11VA,
         thread_count: 4,
+        output: None,
     };
     let _ = std::thread::spawn(move || test_encode_decode(encode_ctx, decode_ctx)).join();
 }
@@ -0,0 +1,58 @@
+use env_logger::{init_from_env, Env, DEFAULT_FILTER_ENV};
+use hwcodec::{
+    common::{Quality::*, RateControl::*},
+    ffmpeg::AVPixelFormat::*,
+    ffmpeg_ram::encode::{EncodeContext, Encoder},
+};
+
+// Encodes a moving bar with the software encoder and requests keyframes at
+// fixed frames, every other frame follows the infinite gop.
+fn main() {
+    init_from_env(Env::default().filter_or(DEFAULT_FILTER_ENV, "info"));
+    let requests = [30, 75];
+    let ctx = EncodeContext {
+        name: String::from("libx264"),
+        mc_name: None,
+        width: 640,
+        height: 480,
+        pixfmt: AV_PIX_FMT_YUV420P,
+        align: 0,
+        kbs: 1000,
+        fps: 30,
+        gop: 0,
+        quality: Quality_Default,
+        rc: RC_DEFAULT,
+        thread_count: 4,
+        q: -1,
+        intra_refresh: None,
+    };
+    let mut encoder = Encoder::new(ctx.clone()).unwrap();
+    let mut data = vec![0u8; encoder.length as usize];
+    let mut keys = vec![];
+    for i in 0..100i64 {
+        if requests.contains(&i) {
+            encoder.request_keyframe();
+        }
+        draw(&mut data, &encoder, i as usize);
+        for frame in encoder.encode(&data, i).unwrap() {
+            if frame.key == 1 {
+                keys.push(frame.pts);
+            }
+        }
+    }
+    log::info!("keyframes at {:?}", keys);
+    assert_eq!(keys, [0, 30, 75]);
+}
+
+fn draw(data: &mut [u8], encoder: &Encoder, i: usize) {
+    let width = encoder.ctx.width as usize;
+    let height = encoder.ctx.height as usize;
+    let stride = encoder.linesize[0] as usize;
+    let (luma, chroma) = data.split_at_mut(stride * height);
+    for row in 0..height {
+        for col in 0..width {
+            luma[row * stride + col] = if (col + i * 4) % width < 64 { 235 } else { 16 };
+        }
+    }
+    chroma.fill(128);
+}
@@ -0,0 +1,74 @@
+use env_logger::{init_from_env, Env, DEFAULT_FILTER_ENV};
+use hwcodec::{
+    ffmpeg::AVHWDeviceType::*,
+    ffmpeg_ram::{
+        decode::{AsyncDecoder, DecodeContext, Decoder},
+        is_again,
+    },
+};
+use std::time::{Duration, Instant};
+
+// a single 720p IDR frame, decodable on its own any number of times
+const SAMPLE: &[u8] = include_bytes!("../src/res/720p.h264");
+
+fn main() {
+    init_from_env(Env::default().filter_or(DEFAULT_FILTER_ENV, "info"));
+    let count = 300;
+    let depth = 4;
+    // AV_HWDEVICE_TYPE_NONE runs every stage on the CPU, switch to e.g.
+    // AV_HWDEVICE_TYPE_VAAPI to measure the download stage
+    let ctx = DecodeContext {
+        name: String::from("h264"),
+        device_type: AV_HWDEVICE_TYPE_NONE,
+        thread_count: 4,
+        output: None,
+    };
+
+    sync_decode(ctx.clone(), count);
+    pipeline_decode(ctx, count, depth);
+}
+
+fn sync_decode(ctx: DecodeContext, count: u32) {
+    let mut decoder = Decoder::new(ctx).unwrap();
+    let mut frames = 0;
+    let start = Instant::now();
+    for _ in 0..count {
+        frames += decoder.decode_frames(SAMPLE).unwrap().len();
+    }
+    println!(
+        "sync: {} frames, {:?}/frame",
+        frames,
+        start.elapsed() / count
+    );
+}
+
+fn pipeline_decode(ctx: DecodeContext, count: u32, depth: usize) {
+    let mut decoder = AsyncDecoder::new(ctx, depth).unwrap();
+    let mut frames = 0;
+    let mut submitted = 0;
+    let start = Instant::now();
+    while submitted < count {
+        match decoder.submit(SAMPLE) {
+            Ok(_) => submitted += 1,
+            Err(e) if is_again(e) => {
+                if decoder
+                    .receiver()
+                    .recv_timeout(Duration::from_millis(100))
+                    .is_ok()
+                {
+                    frames += 1;
+                }
+            }
+            Err(e) => panic!("submit failed: {}", e),
+        }
+        frames += decoder.receiver().try_iter().count();
+    }
+    decoder.flush();
+    frames += decoder.receiver().try_iter().count();
+    println!(
+        "pipeline(depth {}): {} frames, {:?}/frame",
+        depth,
+        frames,
+        start.elapsed() / count
+    );
+}
@@ -3,7 +3,7 @@ use hwcodec::{
     common::{Quality::*, RateControl::*, MAX_GOP},
     ffmpeg::{
         AVHWDeviceType::{self, *},
-        AVPixelFormat::*,
+        AVPixelFormat::{self, *},
     },
     ffmpeg_ram::{
         decode::{DecodeContext, Decoder},
@@ -28,67 +28,77 @@ fn main() {
         name: String::from(codec),
         device_type,
         thread_count: 4,
+        output: None,
     };
     let mut video_decoder = Decoder::new(decode_ctx).unwrap();
+    let enc_ctx = EncodeContext {
+        name: if h264 {
+            "h264_nvenc".to_owned()
+        } else {
+            "hevc_nvenc".to_owned()
+        },
+        mc_name: None,
+        width: 1600,
+        height: 900,
+        pixfmt: pixfmt(device_type),
+        align: 0,
+        kbs: 1_000,
+        fps: 30,
+        gop: MAX_GOP as _,
+        quality: Quality_Default,
+        rc: RC_DEFAULT,
+        thread_count: 4,
+        q: -1,
+        intra_refresh: None,
+    };
+    // one encoder for both resolutions, switched with reconfigure
+    let mut video_encoder = Encoder::new(enc_ctx).unwrap();
 
     decode_encode(
         &mut video_decoder,
+        &mut video_encoder,
         0,
         hw_type,
         file_type,
         1600,
         900,
-        h264,
         device_type,
     );
     decode_encode(
         &mut video_decoder,
+        &mut video_encoder,
         1,
         hw_type,
         file_type,
         1440,
         900,
-        h264,
         device_type,
     );
 }
 
+fn pixfmt(device_type: AVHWDeviceType) -> AVPixelFormat {
+    if device_type == AV_HWDEVICE_TYPE_NONE {
+        AV_PIX_FMT_YUV420P
+    } else {
+        AV_PIX_FMT_NV12
+    }
+}
+
 fn decode_encode(
     video_decoder: &mut Decoder,
+    video_encoder: &mut Encoder,
     index: usize,
     hw_type: &str,
     file_type: &str,
     width: usize,
     height: usize,
-    h264: bool,
     device_type: AVHWDeviceType,
 ) {
     let input_enc_filename = format!("input/data_and_line/{hw_type}_{width}_{height}.{file_type}");
     let len_filename = format!("input/data_and_line/{hw_type}_{width}_{height}_{file_type}.txt");
-    let enc_ctx = EncodeContext {
-        name: if h264 {
-            "h264_nvenc".to_owned()
-        } else {
-            "hevc_nvenc".to_owned()
-        },
-        mc_name: None,
-        width: width as _,
-        height: height as _,
-        pixfmt: if device_type == AV_HWDEVICE_TYPE_NONE {
-            AV_PIX_FMT_YUV420P
-        } else {
-            AV_PIX_FMT_NV12
-        },
-        align: 0,
-        kbs: 1_000,
-        fps: 30,
-        gop: MAX_GOP as _,
-        quality: Quality_Default,
-        rc: RC_DEFAULT,
-        thread_count: 4,
-        q: -1,
-    };
-    let mut video_encoder = Encoder::new(enc_ctx).unwrap();
+    video_encoder
+        .reconfigure(width as _, height as _, pixfmt(device_type))
+        .unwrap();
     let mut encode_file =
         File::create(format!("output/{hw_type}_{width}_{height}.{file_type}")).unwrap();
 
@@ -0,0 +1,166 @@
+#![allow(non_upper_case_globals)]
+#![allow(non_camel_case_types)]
+#![allow(non_snake_case)]
+
+include!(concat!(env!("OUT_DIR"), "/color_ffi.rs"));
+
+use std::ffi::CStr;
+
+/// Name of the RGB to YUV kernels picked for this cpu, e.g. "avx2".
+pub fn simd_name() -> &'static str {
+    unsafe {
+        CStr::from_ptr(hwcodec_color_simd_name())
+            .to_str()
+            .unwrap_or_default()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::common::{ColorRange, ColorSpace, SurfaceFormat};
+    use std::ffi::CString;
+
+    // Planes with padding after each row, so writes past the width show up.
+    fn convert(
+        src: &[u8],
+        stride: usize,
+        format: SurfaceFormat,
+        width: usize,
+        height: usize,
+        nv12: bool,
+        colorspace: ColorSpace,
+        range: ColorRange,
+        kernels: &str,
+    ) -> (i32, Vec<Vec<u8>>) {
+        let kernels = CString::new(kernels).unwrap();
+        let linesize = [width as i32 + 7, width as i32 + 5, width as i32 / 2 + 3];
+        let rows = [height, height / 2, height / 2];
+        let mut planes: Vec<Vec<u8>> = (0..3)
+            .map(|i| vec![0xAA; linesize[i] as usize * rows[i]])
+            .collect();
+        let dst = [
+            planes[0].as_mut_ptr(),
+            planes[1].as_mut_ptr(),
+            planes[2].as_mut_ptr(),
+        ];
+        let ret = unsafe {
+            hwcodec_rgb_to_yuv420(
+                src.as_ptr(),
+                stride as _,
+                format as _,
+                width as _,
+                height as _,
+                dst.as_ptr(),
+                linesize.as_ptr(),
+                nv12 as _,
+                colorspace as _,
+                range as _,
+                kernels.as_ptr(),
+            )
+        };
+        if nv12 {
+            planes.truncate(2);
+        }
+        (ret, planes)
+    }
+
+    // The kernel sets this cpu runs besides the scalar one.
+    fn simd_kernels() -> Vec<&'static str> {
+        let src = [0u8; 16];
+        let kernels: Vec<&'static str> = ["avx2", "sse4.1", "neon"]
+            .into_iter()
+            .filter(|k| {
+                convert(
+                    &src,
+                    8,
+                    SurfaceFormat::SURFACE_FORMAT_BGRA,
+                    2,
+                    2,
+                    false,
+                    ColorSpace::COLOR_SPACE_BT601,
+                    ColorRange::COLOR_RANGE_LIMITED,
+                    k,
+                )
+                .0 == 0
+            })
+            .collect();
+        assert!(simd_name() == "c" || kernels.contains(&simd_name()));
+        kernels
+    }
+
+    #[test]
+    fn simd_matches_scalar() {
+        let kernels = simd_kernels();
+        let formats = [
+            SurfaceFormat::SURFACE_FORMAT_BGRA,
+            SurfaceFormat::SURFACE_FORMAT_RGBA,
+        ];
+        let colorspaces = [ColorSpace::COLOR_SPACE_BT601, ColorSpace::COLOR_SPACE_BT709];
+        let ranges = [
+            ColorRange::COLOR_RANGE_LIMITED,
+            ColorRange::COLOR_RANGE_FULL,
+        ];
+        // every tail length of the 16 and 32 pixel kernels
+        let sizes: Vec<(usize, usize)> = (1..=40)
+            .map(|i| (i * 2, 2 + (i % 4) * 2))
+            .chain([(130, 34), (1282, 6)])
+            .collect();
+        for &(width, height) in &sizes {
+            let stride = width * 4 + 12;
+            let src: Vec<u8> = (0..stride * height).map(|_| rand::random()).collect();
+            for format in formats {
+                for colorspace in colorspaces {
+                    for range in ranges {
+                        for nv12 in [false, true] {
+                            let (ret_c, c) = convert(
+                                &src, stride, format, width, height, nv12, colorspace, range, "c",
+                            );
+                            assert_eq!(ret_c, 0);
+                            for kernel in &kernels {
+                                let (ret, simd) = convert(
+                                    &src, stride, format, width, height, nv12, colorspace, range,
+                                    kernel,
+                                );
+                                assert_eq!(ret, 0);
+                                assert!(
+                                    simd == c,
+                                    "{} differs from c, {}x{} {:?} {:?} {:?} nv12: {}",
+                                    kernel,
+                                    width,
+                                    height,
+                                    format,
+                                    colorspace,
+                                    range,
+                                    nv12
+                                );
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn odd_size_rejected() {
+        for (width, height) in [(3, 2), (2, 3), (17, 9)] {
+            let stride = width * 4;
+            let src = vec![0u8; stride * height];
+            for kernel in ["c", simd_name()] {
+                let (ret, _) = convert(
+                    &src,
+                    stride,
+                    SurfaceFormat::SURFACE_FORMAT_BGRA,
+                    width,
+                    height,
+                    false,
+                    ColorSpace::COLOR_SPACE_BT709,
+                    ColorRange::COLOR_RANGE_LIMITED,
+                    kernel,
+                );
+                assert_eq!(ret, -1);
+            }
+        }
+    }
+}
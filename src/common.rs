@@ -3,6 +3,7 @@
 #![allow(non_snake_case)]
 
 use serde_derive::{Deserialize, Serialize};
+use std::{ffi::c_void, time::Duration};
 include!(concat!(env!("OUT_DIR"), "/common_ffi.rs"));
 
 pub(crate) const DATA_H264_720P: &[u8] = include_bytes!("res/720p.h264");
@@ -99,3 +100,99 @@ pub fn get_gpu_signature() -> u64 {
         0
     }
 }
+
+/// Latency histogram of one codec stage, recorded when built with the
+/// `profile` feature.
+#[derive(Debug, Clone)]
+pub struct StageHistogram {
+    pub stage: &'static str,
+    pub count: u64,
+    pub total: Duration,
+    pub min: Duration,
+    pub max: Duration,
+    /// buckets[i] counts the samples below 2^i us, the last one all longer
+    pub buckets: [u64; PROFILE_BUCKETS as usize],
+}
+
+impl StageHistogram {
+    pub fn mean(&self) -> Duration {
+        if self.count == 0 {
+            return Duration::ZERO;
+        }
+        Duration::from_nanos((self.total.as_nanos() / self.count as u128) as u64)
+    }
+
+    /// Upper bound of the bucket holding the `p` quantile, e.g. 0.99.
+    pub fn percentile(&self, p: f64) -> Duration {
+        let target = (self.count as f64 * p).ceil() as u64;
+        let mut seen = 0;
+        for (i, n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= target && *n > 0 {
+                if i == self.buckets.len() - 1 {
+                    return self.max;
+                }
+                return Duration::from_micros(1 << i).min(self.max);
+            }
+        }
+        self.max
+    }
+}
+
+pub(crate) const ENCODE_STAGES: [&str; EncodeStage::ENCODE_STAGE_COUNT as usize] = [
+    "total",
+    "make_writable",
+    "fill_frame",
+    "upload",
+    "send_frame",
+    "receive_packet",
+];
+
+pub(crate) const DECODE_STAGES: [&str; DecodeStage::DECODE_STAGE_COUNT as usize] = [
+    "total",
+    "send_packet",
+    "receive_frame",
+    "download",
+    "convert",
+    "callback",
+];
+
+pub(crate) const MUX_STAGES: [&str; MuxStage::MUX_STAGE_COUNT as usize] =
+    ["total", "write_header", "write_frame"];
+
+// `snapshot` fills the stats array passed in, indexed by stage.
+pub(crate) fn profile_histograms<F>(
+    stages: &[&'static str],
+    snapshot: F,
+) -> Option<Vec<StageHistogram>>
+where
+    F: FnOnce(*mut c_void, i32) -> i32,
+{
+    let mut stats = vec![
+        ProfileStats {
+            count: 0,
+            total_ns: 0,
+            min_ns: 0,
+            max_ns: 0,
+            buckets: [0; PROFILE_BUCKETS as usize],
+        };
+        stages.len()
+    ];
+    if snapshot(stats.as_mut_ptr() as _, stages.len() as _) != 0 {
+        return None;
+    }
+    Some(
+        stages
+            .iter()
+            .zip(stats.iter())
+            .map(|(stage, s)| StageHistogram {
+                stage,
+                count: s.count as _,
+                total: Duration::from_nanos(s.total_ns as _),
+                min: Duration::from_nanos(s.min_ns as _),
+                max: Duration::from_nanos(s.max_ns as _),
+                buckets: s.buckets.map(|n| n as _),
+            })
+            .collect(),
+    )
+}
@@ -0,0 +1,152 @@
+#![allow(non_upper_case_globals)]
+#![allow(non_camel_case_types)]
+#![allow(non_snake_case)]
+
+include!(concat!(env!("OUT_DIR"), "/demux_ffi.rs"));
+
+use log::{error, trace};
+
+use crate::{
+    common::DataFormat::{self, *},
+    ffmpeg::{av_log_get_level, AV_LOG_ERROR},
+};
+use std::{
+    ffi::{c_void, CString},
+    slice,
+    time::Duration,
+};
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct StreamInfo {
+    /// `None` for a codec the decoders don't handle.
+    pub format: Option<DataFormat>,
+    pub width: usize,
+    pub height: usize,
+    /// 0 if the container doesn't tell.
+    pub framerate: f64,
+    pub duration: Option<Duration>,
+}
+
+/// An Annex-B packet ready for `Decoder::decode`, borrowed from the
+/// [`Demuxer`] until its next call.
+pub struct Packet<'a> {
+    pub data: &'a [u8],
+    pub pts: i64,
+    pub key: bool,
+}
+
+/// Reads the video stream of an mp4, mkv or raw h264 / h265 file. Packets of
+/// raw streams are handed out without a copy, mp4 and mkv ones are converted
+/// to Annex-B first.
+pub struct Demuxer {
+    inner: *mut c_void,
+    // read by the C++ side of from_memory
+    _memory: Option<Vec<u8>>,
+    pub info: StreamInfo,
+}
+
+unsafe impl Send for Demuxer {}
+
+impl Demuxer {
+    pub fn open(filename: &str) -> Result<Self, ()> {
+        unsafe {
+            let mut info: DemuxInfo = std::mem::zeroed();
+            let inner =
+                hwcodec_new_demuxer(CString::new(filename).map_err(|_| ())?.as_ptr(), &mut info);
+            if inner.is_null() {
+                return Err(());
+            }
+            Ok(Demuxer {
+                inner,
+                _memory: None,
+                info: stream_info(&info),
+            })
+        }
+    }
+
+    /// Demuxes a whole file loaded into memory, so replays don't wait on
+    /// the disk.
+    pub fn from_memory(data: Vec<u8>) -> Result<Self, ()> {
+        unsafe {
+            let mut info: DemuxInfo = std::mem::zeroed();
+            let inner = hwcodec_new_memory_demuxer(data.as_ptr(), data.len() as _, &mut info);
+            if inner.is_null() {
+                return Err(());
+            }
+            Ok(Demuxer {
+                inner,
+                _memory: Some(data),
+                info: stream_info(&info),
+            })
+        }
+    }
+
+    /// The next packet, `None` at the end of the stream.
+    pub fn read(&mut self) -> Result<Option<Packet<'_>>, i32> {
+        unsafe {
+            let mut packet: DemuxPacket = std::mem::zeroed();
+            let result = hwcodec_demux_read(self.inner, &mut packet);
+            if result == DEMUX_EOF as i32 {
+                return Ok(None);
+            }
+            if result != 0 {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error demux read: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(Some(Packet {
+                data: if packet.data.is_null() {
+                    &[]
+                } else {
+                    slice::from_raw_parts(packet.data, packet.length as _)
+                },
+                pts: packet.pts_ms,
+                key: packet.key == 1,
+            }))
+        }
+    }
+
+    /// Starts over from the first packet.
+    pub fn rewind(&mut self) -> Result<(), i32> {
+        let result = unsafe { hwcodec_demux_rewind(self.inner) };
+        if result != 0 {
+            if unsafe { av_log_get_level() } >= AV_LOG_ERROR as _ {
+                error!("Error demux rewind: {}", result);
+            }
+            return Err(result);
+        }
+        Ok(())
+    }
+}
+
+fn stream_info(info: &DemuxInfo) -> StreamInfo {
+    let format = [H264, H265, VP8, VP9, AV1]
+        .into_iter()
+        .find(|f| *f as i32 == info.format);
+    StreamInfo {
+        format,
+        width: info.width as _,
+        height: info.height as _,
+        framerate: if info.framerate_den > 0 {
+            info.framerate_num as f64 / info.framerate_den as f64
+        } else {
+            0.0
+        },
+        duration: if info.duration_ms > 0 {
+            Some(Duration::from_millis(info.duration_ms as _))
+        } else {
+            None
+        },
+    }
+}
+
+impl Drop for Demuxer {
+    fn drop(&mut self) {
+        unsafe {
+            hwcodec_free_demuxer(self.inner);
+            self.inner = std::ptr::null_mut();
+            trace!("Demuxer dropped");
+        }
+    }
+}
@@ -0,0 +1,266 @@
+//! Persistent cache of the `available_encoders` / `available_decoders` probe
+//! results, so the trial encodes and decodes only run once per machine setup.
+//!
+//! Disabled until [`set_probe_cache_dir`] is called. Each entry is keyed by the
+//! crate and FFmpeg versions, the GPU and driver signature and the probe
+//! arguments; entries recorded under a different environment are dropped the
+//! next time a probe is written.
+
+use super::CodecInfo;
+use crate::{
+    common::get_gpu_signature,
+    ffmpeg::{avcodec_version, avutil_version},
+};
+use log::{debug, warn};
+use serde_derive::{Deserialize, Serialize};
+use std::{
+    fs,
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex, MutexGuard},
+};
+
+const CACHE_VERSION: u32 = 1;
+const MAX_ENTRIES: usize = 16;
+
+pub(crate) const ENCODERS_FILE: &str = "ffmpeg_ram_encoders.json";
+pub(crate) const DECODERS_FILE: &str = "ffmpeg_ram_decoders.json";
+
+static CACHE_DIR: Mutex<Option<PathBuf>> = Mutex::new(None);
+
+/// Enables the on-disk probe cache in `dir`, or disables it with `None`.
+pub fn set_probe_cache_dir(dir: Option<PathBuf>) {
+    *CACHE_DIR.lock().unwrap() = dir;
+}
+
+/// Deletes the cached probe results, if the cache is enabled.
+pub fn clear_probe_cache() {
+    if let Some(dir) = CACHE_DIR.lock().unwrap().clone() {
+        for file in [ENCODERS_FILE, DECODERS_FILE] {
+            fs::remove_file(dir.join(file)).ok();
+        }
+    }
+}
+
+// probes open real devices, only run one at a time
+static PROBE_LOCK: Mutex<()> = Mutex::new(());
+
+type Slot = Arc<Mutex<Option<Vec<CodecInfo>>>>;
+
+/// In-process probe results keyed by the probe arguments. Callers asking for
+/// a key that is being probed wait for that probe instead of starting another.
+pub(crate) struct ProbeCache<K> {
+    slots: Mutex<Vec<(K, Slot)>>,
+}
+
+impl<K: PartialEq + Clone> ProbeCache<K> {
+    pub(crate) const fn new() -> Self {
+        Self {
+            slots: Mutex::new(Vec::new()),
+        }
+    }
+
+    pub(crate) fn get_or_probe<F>(&self, key: &K, probe: F) -> Vec<CodecInfo>
+    where
+        F: FnOnce() -> Vec<CodecInfo>,
+    {
+        let slot = {
+            let mut slots = lock(&self.slots);
+            match slots.iter().find(|(k, _)| k == key) {
+                Some((_, slot)) => slot.clone(),
+                None => {
+                    let slot = Slot::default();
+                    slots.push((key.clone(), slot.clone()));
+                    slot
+                }
+            }
+        };
+        let mut codecs = lock(&slot);
+        if codecs.is_none() {
+            let _probing = lock(&PROBE_LOCK);
+            let result = probe();
+            // like on disk, an empty result is probed again next time
+            if result.is_empty() {
+                return result;
+            }
+            *codecs = Some(result);
+        }
+        codecs.clone().unwrap_or_default()
+    }
+
+    /// Forgets every key matching `f`. A probe already running for such a key
+    /// still completes, but its result is not handed to later callers.
+    pub(crate) fn invalidate<F: Fn(&K) -> bool>(&self, f: F) {
+        lock(&self.slots).retain(|(k, _)| !f(k));
+    }
+}
+
+// a panicking probe must not disable the cache for good
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+    mutex.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+/// Removes the on-disk entries of `file` whose probe arguments match `f`.
+pub(crate) fn remove<F: Fn(&str) -> bool>(file: &str, f: F) {
+    let dir = match CACHE_DIR.lock().unwrap().clone() {
+        Some(dir) => dir,
+        None => return,
+    };
+    let path = dir.join(file);
+    let mut entries = read_entries(&path);
+    let len = entries.len();
+    entries.retain(|e| !f(&e.args));
+    if entries.len() != len {
+        if let Err(e) = write_entries(&dir, &path, &entries) {
+            warn!("failed to write probe cache {}: {}", path.display(), e);
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+struct Environment {
+    version: u32,
+    crate_version: String,
+    gpu_signature: u64,
+    drivers: String,
+    avcodec_version: u32,
+    avutil_version: u32,
+}
+
+impl Environment {
+    fn current() -> Self {
+        unsafe {
+            Self {
+                version: CACHE_VERSION,
+                crate_version: env!("CARGO_PKG_VERSION").to_owned(),
+                gpu_signature: get_gpu_signature(),
+                drivers: driver_signature(),
+                avcodec_version: avcodec_version() as _,
+                avutil_version: avutil_version() as _,
+            }
+        }
+    }
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct Entry {
+    env: Environment,
+    // probe arguments, e.g. the debug representation of the EncodeContext
+    args: String,
+    codecs: Vec<CodecInfo>,
+}
+
+/// Returns the cached result for `args` in `file`, or runs `probe` and records
+/// its result. An empty result is not recorded: it is more likely a device
+/// that wasn't ready yet than a machine without codecs, so the next start
+/// probes again.
+pub(crate) fn get_or_probe<F>(file: &str, args: String, probe: F) -> Vec<CodecInfo>
+where
+    F: FnOnce() -> Vec<CodecInfo>,
+{
+    let dir = match CACHE_DIR.lock().unwrap().clone() {
+        Some(dir) => dir,
+        None => return probe(),
+    };
+    let path = dir.join(file);
+    let env = Environment::current();
+    let mut entries = read_entries(&path);
+    if let Some(entry) = entries
+        .iter()
+        .find(|e| e.env == env && e.args == args && !e.codecs.is_empty())
+    {
+        debug!("probe cache hit: {}", path.display());
+        return entry.codecs.clone();
+    }
+
+    let codecs = probe();
+    if codecs.is_empty() {
+        debug!("probe found no codecs, not cached: {}", path.display());
+        return codecs;
+    }
+    entries.retain(|e| e.env == env && e.args != args);
+    if entries.len() >= MAX_ENTRIES {
+        entries.remove(0);
+    }
+    entries.push(Entry {
+        env,
+        args,
+        codecs: codecs.clone(),
+    });
+    if let Err(e) = write_entries(&dir, &path, &entries) {
+        warn!("failed to write probe cache {}: {}", path.display(), e);
+    }
+    codecs
+}
+
+fn read_entries(path: &Path) -> Vec<Entry> {
+    fs::read(path)
+        .ok()
+        .and_then(|bytes| serde_json::from_slice(&bytes).ok())
+        .unwrap_or_default()
+}
+
+fn write_entries(dir: &Path, path: &Path, entries: &Vec<Entry>) -> std::io::Result<()> {
+    fs::create_dir_all(dir)?;
+    let json = serde_json::to_vec(entries)?;
+    // write then rename, so concurrent readers never see a partial file
+    let tmp = path.with_extension(format!("{}.tmp", std::process::id()));
+    fs::write(&tmp, json)?;
+    fs::rename(&tmp, path).or_else(|e| {
+        fs::remove_file(&tmp).ok();
+        Err(e)
+    })
+}
+
+// get_gpu_signature covers the adapter and driver version on windows and the
+// VideoToolbox capabilities on macos. It is 0 on linux, so fingerprint the
+// kernel and the installed NVIDIA / VA-API drivers instead.
+fn driver_signature() -> String {
+    #[allow(unused_mut)]
+    let mut signature = String::from(std::env::consts::OS);
+    #[cfg(target_os = "linux")]
+    {
+        use std::{fmt::Write, time::UNIX_EPOCH};
+
+        for file in ["/proc/sys/kernel/osrelease", "/proc/driver/nvidia/version"] {
+            if let Ok(s) = fs::read_to_string(file) {
+                write!(signature, "|{}", s.lines().next().unwrap_or("").trim()).ok();
+            }
+        }
+        let dirs = match std::env::var("LIBVA_DRIVERS_PATH") {
+            Ok(paths) => paths.split(':').map(PathBuf::from).collect(),
+            Err(_) => vec![
+                PathBuf::from("/usr/lib/x86_64-linux-gnu/dri"),
+                PathBuf::from("/usr/lib/aarch64-linux-gnu/dri"),
+                PathBuf::from("/usr/lib64/dri"),
+                PathBuf::from("/usr/lib/dri"),
+            ],
+        };
+        for dir in dirs {
+            let mut drivers: Vec<_> = match fs::read_dir(&dir) {
+                Ok(entries) => entries
+                    .filter_map(|e| e.ok())
+                    .filter(|e| e.file_name().to_string_lossy().ends_with("_drv_video.so"))
+                    .collect(),
+                Err(_) => continue,
+            };
+            drivers.sort_by_key(|e| e.file_name());
+            for driver in drivers {
+                let mtime = driver
+                    .metadata()
+                    .and_then(|m| m.modified())
+                    .ok()
+                    .and_then(|t| t.duration_since(UNIX_EPOCH).ok())
+                    .map(|d| d.as_secs())
+                    .unwrap_or(0);
+                write!(
+                    signature,
+                    "|{}:{}",
+                    driver.file_name().to_string_lossy(),
+                    mtime
+                )
+                .ok();
+            }
+        }
+    }
+    signature
+}
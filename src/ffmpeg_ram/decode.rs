@@ -5,32 +5,77 @@ use crate::common::{DataFormat, Driver};
 use crate::ffmpeg::AVHWDeviceType::*;
 
 use crate::{
-    common::DataFormat::*,
+    common::{profile_histograms, DataFormat::*, ScaleAlgorithm, StageHistogram, DECODE_STAGES},
     ffmpeg::{
         av_log_get_level, av_log_set_level, AVHWDeviceType, AVPixelFormat, AV_LOG_ERROR,
         AV_LOG_PANIC,
     },
     ffmpeg_ram::{
-        ffmpeg_ram_decode, ffmpeg_ram_free_decoder, ffmpeg_ram_new_decoder, CodecInfo,
+        cache::{self, ProbeCache},
+        ffmpeg_ram_decode, ffmpeg_ram_decode_flush_pipeline, ffmpeg_ram_decode_frame,
+        ffmpeg_ram_decode_into, ffmpeg_ram_decode_profile, ffmpeg_ram_decode_set_output,
+        ffmpeg_ram_decode_start_pipeline, ffmpeg_ram_decode_stop_pipeline,
+        ffmpeg_ram_decode_submit, ffmpeg_ram_free_decoder, ffmpeg_ram_free_frame,
+        ffmpeg_ram_new_decoder, ffmpeg_ram_set_frame_pool, is_again, CodecInfo, RamDecodeTarget,
         AV_NUM_DATA_POINTERS,
     },
 };
-use log::error;
+use log::{error, trace};
 use std::{
     ffi::{c_void, CString},
     os::raw::c_int,
     slice::from_raw_parts,
-    sync::{Arc, Mutex},
+    sync::{
+        mpsc::{channel, Receiver, Sender},
+        Arc, Mutex,
+    },
     thread,
     time::Instant,
     vec,
 };
 
+static DECODERS: ProbeCache<Option<String>> = ProbeCache::new();
+
 #[derive(Debug, Clone)]
 pub struct DecodeContext {
     pub name: String,
     pub device_type: AVHWDeviceType,
     pub thread_count: i32,
+    /// Convert every frame before it is handed out
+    pub output: Option<DecodeOutput>,
+}
+
+/// Format, size and filter of the frames a decoder hands out. Conversion runs
+/// on one cached scaler, so it costs a single pass over the frame. It also
+/// turns formats such as the P010 of 10 bit hardware decoders into one of the
+/// supported ones.
+#[derive(Debug, Clone)]
+pub struct DecodeOutput {
+    pub pixfmt: AVPixelFormat,
+    /// 0 keeps the decoded width
+    pub width: i32,
+    /// 0 keeps the decoded height
+    pub height: i32,
+    pub scale: ScaleAlgorithm,
+    /// Slice threads of the conversion, 0 picks one per core. Ignored before
+    /// FFmpeg 5.
+    pub threads: i32,
+}
+
+/// Rows of each plane of the pixfmts frames are handed out in
+fn plane_rows(pixfmt: c_int, height: c_int) -> Option<Vec<c_int>> {
+    let chroma = (height + 1) / 2;
+    if pixfmt == AVPixelFormat::AV_PIX_FMT_YUV420P as c_int {
+        Some(vec![height, chroma, chroma])
+    } else if pixfmt == AVPixelFormat::AV_PIX_FMT_NV12 as c_int {
+        Some(vec![height, chroma])
+    } else if pixfmt == AVPixelFormat::AV_PIX_FMT_RGBA as c_int
+        || pixfmt == AVPixelFormat::AV_PIX_FMT_BGRA as c_int
+    {
+        Some(vec![height])
+    } else {
+        None
+    }
 }
 
 pub struct DecodeFrame {
@@ -61,9 +106,107 @@ impl std::fmt::Display for DecodeFrame {
     }
 }
 
+/// A decoded frame lent out by the decoder. The planes point straight into
+/// FFmpeg's buffer, which goes back to its pool when this is dropped.
+pub struct DecodeFrameRef {
+    frame: *mut c_void,
+    pub pixfmt: AVPixelFormat,
+    pub width: i32,
+    pub height: i32,
+    datas: Vec<*const u8>,
+    rows: Vec<i32>,
+    pub linesize: Vec<i32>,
+    pub key: bool,
+}
+
+unsafe impl Send for DecodeFrameRef {}
+unsafe impl Sync for DecodeFrameRef {}
+
+impl DecodeFrameRef {
+    pub fn planes(&self) -> usize {
+        self.datas.len()
+    }
+
+    pub fn plane(&self, index: usize) -> &[u8] {
+        unsafe {
+            from_raw_parts(
+                self.datas[index],
+                (self.linesize[index] * self.rows[index]) as usize,
+            )
+        }
+    }
+
+    unsafe fn from_raw(
+        frame: *mut c_void,
+        width: c_int,
+        height: c_int,
+        pixfmt: c_int,
+        linesizes: *mut c_int,
+        datas: *mut *mut u8,
+        key: c_int,
+    ) -> Option<Self> {
+        let datas = from_raw_parts(datas, AV_NUM_DATA_POINTERS as _);
+        let linesizes = from_raw_parts(linesizes, AV_NUM_DATA_POINTERS as _);
+
+        let rows = match plane_rows(pixfmt, height) {
+            Some(rows) => rows,
+            None => {
+                error!("unsupported pixfmt {}, set an output format", pixfmt);
+                ffmpeg_ram_free_frame(frame);
+                return None;
+            }
+        };
+        let planes = rows.len();
+        Some(DecodeFrameRef {
+            frame,
+            pixfmt: std::mem::transmute(pixfmt),
+            width,
+            height,
+            datas: datas[..planes].iter().map(|d| *d as *const u8).collect(),
+            rows,
+            linesize: linesizes[..planes].to_vec(),
+            key: key != 0,
+        })
+    }
+}
+
+impl std::fmt::Display for DecodeFrameRef {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(
+            f,
+            "fixfmt:{}, width:{}, height:{},key:{}, linesize:{:?}",
+            self.pixfmt as i32, self.width, self.height, self.key, self.linesize,
+        )
+    }
+}
+
+impl Drop for DecodeFrameRef {
+    fn drop(&mut self) {
+        unsafe {
+            ffmpeg_ram_free_frame(self.frame);
+            self.frame = std::ptr::null_mut();
+        }
+    }
+}
+
+/// A frame written by `Decoder::decode_into`. Its planes follow each other
+/// in the buffer without padding, starting at `offset`.
+#[derive(Debug, Clone)]
+pub struct DecodeImage {
+    pub pixfmt: AVPixelFormat,
+    pub width: i32,
+    pub height: i32,
+    pub linesize: Vec<i32>,
+    pub offset: Vec<usize>,
+    /// Bytes written
+    pub length: usize,
+    pub key: bool,
+}
+
 pub struct Decoder {
     codec: *mut c_void,
     frames: *mut Vec<DecodeFrame>,
+    frame_refs: *mut Vec<DecodeFrameRef>,
     pub ctx: DecodeContext,
 }
 
@@ -83,6 +226,20 @@ impl Decoder {
             if codec.is_null() {
                 return Err(());
             }
+            if let Some(output) = &ctx.output {
+                let ret = ffmpeg_ram_decode_set_output(
+                    codec,
+                    output.pixfmt as _,
+                    output.width,
+                    output.height,
+                    output.scale as _,
+                    output.threads,
+                );
+                if ret != 0 {
+                    ffmpeg_ram_free_decoder(codec);
+                    return Err(());
+                }
+            }
 
             // ffmpeg amd encoder doesn't handle colorspace, this can disable warning
             if ctx.device_type == AV_HWDEVICE_TYPE_VIDEOTOOLBOX {
@@ -92,6 +249,7 @@ impl Decoder {
             Ok(Decoder {
                 codec,
                 frames: Box::into_raw(Box::new(Vec::<DecodeFrame>::new())),
+                frame_refs: Box::into_raw(Box::new(Vec::<DecodeFrameRef>::new())),
                 ctx,
             })
         }
@@ -118,6 +276,114 @@ impl Decoder {
         }
     }
 
+    /// Same as `decode`, but frames are lent out instead of copied.
+    /// Drain the returned vector to keep frames beyond the next call.
+    pub fn decode_frames(&mut self, packet: &[u8]) -> Result<&mut Vec<DecodeFrameRef>, i32> {
+        unsafe {
+            (&mut *self.frame_refs).clear();
+            let ret = ffmpeg_ram_decode_frame(
+                self.codec,
+                packet.as_ptr(),
+                packet.len() as c_int,
+                self.frame_refs as *const _ as *const c_void,
+                Some(Decoder::frame_callback),
+            );
+
+            if ret < 0 {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error decode: {}", ret);
+                }
+                Err(ret)
+            } else {
+                Ok(&mut *self.frame_refs)
+            }
+        }
+    }
+
+    /// Decode straight into `dst`, converted if `DecodeContext::output` is set.
+    /// `dst` must hold the whole image, which `ffmpeg_linesize_offset_length`
+    /// with align 1 measures. If the packet holds several frames, the last
+    /// one is kept.
+    pub fn decode_into(&mut self, packet: &[u8], dst: &mut [u8]) -> Result<DecodeImage, i32> {
+        unsafe {
+            let mut target: RamDecodeTarget = std::mem::zeroed();
+            target.data = dst.as_mut_ptr();
+            target.length = dst.len().min(i32::MAX as usize) as c_int;
+            let ret = ffmpeg_ram_decode_into(
+                self.codec,
+                packet.as_ptr(),
+                packet.len() as c_int,
+                &mut target,
+            );
+            if ret < 0 {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error decode: {}", ret);
+                }
+                return Err(ret);
+            }
+            let rows = match plane_rows(target.pixfmt, target.height) {
+                Some(rows) => rows,
+                None => {
+                    error!("unsupported pixfmt {}, set an output format", target.pixfmt);
+                    return Err(-1);
+                }
+            };
+            let mut offset = vec![];
+            let mut next = 0;
+            for (i, rows) in rows.iter().enumerate() {
+                offset.push(next);
+                next += (target.linesize[i] * rows) as usize;
+            }
+            Ok(DecodeImage {
+                pixfmt: std::mem::transmute(target.pixfmt),
+                width: target.width,
+                height: target.height,
+                linesize: target.linesize[..rows.len()].to_vec(),
+                offset,
+                length: target.length as usize,
+                key: target.key != 0,
+            })
+        }
+    }
+
+    /// Per stage latency histograms of the packets decoded so far, `None`
+    /// unless built with the `profile` feature. With `reset`, the next
+    /// snapshot only covers packets decoded after this one.
+    pub fn profile(&self, reset: bool) -> Option<Vec<StageHistogram>> {
+        profile_histograms(&DECODE_STAGES, |stats, count| unsafe {
+            ffmpeg_ram_decode_profile(self.codec, stats, count, reset as _)
+        })
+    }
+
+    /// Number of download buffers preallocated for hardware decoders in
+    /// `decode_frames`. Holding more frames than this grows the pool.
+    pub fn set_frame_pool_size(&mut self, count: usize) -> Result<(), ()> {
+        let ret = unsafe { ffmpeg_ram_set_frame_pool(self.codec, count as _) };
+        if ret == 0 {
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    unsafe extern "C" fn frame_callback(
+        frame: *mut c_void,
+        obj: *const c_void,
+        width: c_int,
+        height: c_int,
+        pixfmt: c_int,
+        linesizes: *mut c_int,
+        datas: *mut *mut u8,
+        key: c_int,
+    ) {
+        let frames = &mut *(obj as *mut Vec<DecodeFrameRef>);
+        if let Some(frame) =
+            DecodeFrameRef::from_raw(frame, width, height, pixfmt, linesizes, datas, key)
+        {
+            frames.push(frame);
+        }
+    }
+
     unsafe extern "C" fn callback(
         obj: *const c_void,
         width: c_int,
@@ -140,48 +406,34 @@ impl Decoder {
             key: key != 0,
         };
 
-        if pixfmt == AVPixelFormat::AV_PIX_FMT_YUV420P as c_int {
-            let y = from_raw_parts(datas[0], (linesizes[0] * height) as usize).to_vec();
-            let u = from_raw_parts(datas[1], (linesizes[1] * height / 2) as usize).to_vec();
-            let v = from_raw_parts(datas[2], (linesizes[2] * height / 2) as usize).to_vec();
-
-            frame.data.push(y);
-            frame.data.push(u);
-            frame.data.push(v);
-
-            frame.linesize.push(linesizes[0]);
-            frame.linesize.push(linesizes[1]);
-            frame.linesize.push(linesizes[2]);
-
-            frames.push(frame);
-        } else if pixfmt == AVPixelFormat::AV_PIX_FMT_NV12 as c_int {
-            let y = from_raw_parts(datas[0], (linesizes[0] * height) as usize).to_vec();
-            let uv = from_raw_parts(datas[1], (linesizes[1] * height / 2) as usize).to_vec();
-
-            frame.data.push(y);
-            frame.data.push(uv);
-
-            frame.linesize.push(linesizes[0]);
-            frame.linesize.push(linesizes[1]);
-
+        if let Some(rows) = plane_rows(pixfmt, height) {
+            for (i, rows) in rows.iter().enumerate() {
+                frame
+                    .data
+                    .push(from_raw_parts(datas[i], (linesizes[i] * rows) as usize).to_vec());
+                frame.linesize.push(linesizes[i]);
+            }
             frames.push(frame);
         } else {
-            error!("unsupported pixfmt {}", pixfmt as i32);
+            error!("unsupported pixfmt {}, set an output format", pixfmt);
         }
     }
 
+    /// Probes the usable decoders, cached per sdk and safe to call from any
+    /// thread.
     pub fn available_decoders(sdk: Option<String>) -> Vec<CodecInfo> {
-        use std::{mem::MaybeUninit, sync::Once};
-
-        static mut INSTANCE: MaybeUninit<Vec<CodecInfo>> = MaybeUninit::uninit();
-        static ONCE: Once = Once::new();
+        DECODERS.get_or_probe(&sdk, || {
+            let args = format!("{:?}", sdk);
+            cache::get_or_probe(cache::DECODERS_FILE, args, || {
+                Decoder::available_decoders_(sdk.clone())
+            })
+        })
+    }
 
-        ONCE.call_once(|| unsafe {
-            INSTANCE
-                .as_mut_ptr()
-                .write(Decoder::available_decoders_(sdk));
-        });
-        unsafe { (&*INSTANCE.as_ptr()).clone() }
+    /// Drops the cached probe results, including the on-disk cache.
+    pub fn invalidate_available_decoders() {
+        DECODERS.invalidate(|_| true);
+        cache::remove(cache::DECODERS_FILE, |_| true);
     }
 
     fn available_decoders_(_sdk: Option<String>) -> Vec<CodecInfo> {
@@ -315,6 +567,7 @@ impl Decoder {
                     name: codec.name.clone(),
                     device_type: codec.hwdevice,
                     thread_count: 4,
+                    output: None,
                 };
                 let start = Instant::now();
                 if let Ok(mut decoder) = Decoder::new(c) {
@@ -375,6 +628,100 @@ impl Drop for Decoder {
             ffmpeg_ram_free_decoder(self.codec);
             self.codec = std::ptr::null_mut();
             let _ = Box::from_raw(self.frames);
+            let _ = Box::from_raw(self.frame_refs);
+        }
+    }
+}
+
+/// Three stage decoder: packets are copied in by `submit`, decoded on one
+/// thread and downloaded from the GPU on another, so a slow download doesn't
+/// hold up the next packet. With `AV_HWDEVICE_TYPE_NONE` the download stage
+/// just forwards software frames, which exercises the pipeline on any CPU.
+pub struct AsyncDecoder {
+    decoder: Decoder,
+    sender: *mut Sender<DecodeFrameRef>,
+    receiver: Receiver<DecodeFrameRef>,
+}
+
+unsafe impl Send for AsyncDecoder {}
+
+impl AsyncDecoder {
+    pub fn new(ctx: DecodeContext, depth: usize) -> Result<Self, ()> {
+        let decoder = Decoder::new(ctx)?;
+        let (sender, receiver) = channel();
+        let sender = Box::into_raw(Box::new(sender));
+        unsafe {
+            let ret = ffmpeg_ram_decode_start_pipeline(
+                decoder.codec,
+                depth as _,
+                Some(AsyncDecoder::callback),
+                sender as *const c_void,
+            );
+            if ret != 0 {
+                let _ = Box::from_raw(sender);
+                return Err(());
+            }
+        }
+        Ok(AsyncDecoder {
+            decoder,
+            sender,
+            receiver,
+        })
+    }
+
+    /// Queue a packet. Fails with an error for which `is_again` holds when
+    /// every packet slot is still waiting to be decoded.
+    pub fn submit(&mut self, packet: &[u8]) -> Result<(), i32> {
+        let ret = unsafe {
+            ffmpeg_ram_decode_submit(self.decoder.codec, packet.as_ptr(), packet.len() as c_int)
+        };
+        if ret != 0 {
+            if !is_again(ret) && unsafe { av_log_get_level() } >= AV_LOG_ERROR as _ {
+                error!("Error submit: {}", ret);
+            }
+            return Err(ret);
+        }
+        Ok(())
+    }
+
+    pub fn receiver(&self) -> &Receiver<DecodeFrameRef> {
+        &self.receiver
+    }
+
+    /// Block until every submitted packet has been decoded and delivered.
+    pub fn flush(&mut self) {
+        unsafe { ffmpeg_ram_decode_flush_pipeline(self.decoder.codec) };
+    }
+
+    pub fn decoder(&self) -> &Decoder {
+        &self.decoder
+    }
+
+    unsafe extern "C" fn callback(
+        frame: *mut c_void,
+        obj: *const c_void,
+        width: c_int,
+        height: c_int,
+        pixfmt: c_int,
+        linesizes: *mut c_int,
+        datas: *mut *mut u8,
+        key: c_int,
+    ) {
+        let sender = &*(obj as *const Sender<DecodeFrameRef>);
+        if let Some(frame) =
+            DecodeFrameRef::from_raw(frame, width, height, pixfmt, linesizes, datas, key)
+        {
+            let _ = sender.send(frame);
+        }
+    }
+}
+
+impl Drop for AsyncDecoder {
+    fn drop(&mut self) {
+        unsafe {
+            ffmpeg_ram_decode_stop_pipeline(self.decoder.codec);
+            let _ = Box::from_raw(self.sender);
+            trace!("AsyncDecoder dropped");
         }
     }
 }
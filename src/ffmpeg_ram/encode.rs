@@ -1,21 +1,35 @@
 use crate::{
     common::{
+        profile_histograms, ColorRange, ColorSpace,
         DataFormat::{self, *},
-        Quality, RateControl,
+        Quality, RateControl, RefreshDirection, StageHistogram, SurfaceFormat, ENCODE_STAGES,
     },
     ffmpeg::{av_log_get_level, av_log_set_level, AVPixelFormat, AV_LOG_ERROR, AV_LOG_PANIC},
     ffmpeg_ram::{
-        ffmpeg_linesize_offset_length, ffmpeg_ram_encode, ffmpeg_ram_free_encoder,
-        ffmpeg_ram_new_encoder, ffmpeg_ram_set_bitrate, CodecInfo, AV_NUM_DATA_POINTERS,
+        cache::{self, ProbeCache},
+        ffmpeg_linesize_offset_length, ffmpeg_ram_encode, ffmpeg_ram_encode_batch,
+        ffmpeg_ram_encode_bgra, ffmpeg_ram_encode_dirty, ffmpeg_ram_encode_flush_async,
+        ffmpeg_ram_encode_group, ffmpeg_ram_encode_packet, ffmpeg_ram_encode_planes,
+        ffmpeg_ram_encode_profile, ffmpeg_ram_encode_start_async, ffmpeg_ram_encode_stop_async,
+        ffmpeg_ram_encode_submit, ffmpeg_ram_free_encoder, ffmpeg_ram_free_encoder_group,
+        ffmpeg_ram_free_packet, ffmpeg_ram_group_request_keyframe, ffmpeg_ram_group_set_bitrate,
+        ffmpeg_ram_new_encoder, ffmpeg_ram_new_encoder_group, ffmpeg_ram_reconfigure,
+        ffmpeg_ram_request_keyframe, ffmpeg_ram_set_bitrate, ffmpeg_ram_set_rate,
+        ffmpeg_ram_set_skip_unchanged, is_again, CodecInfo, RamEncodeEntry, RamEncodeLayer,
+        RamRect, AV_NUM_DATA_POINTERS, FFMPEG_RAM_ENCODE_SKIPPED, FFMPEG_RAM_RATE_REOPENED,
     },
 };
 use log::{error, trace};
 use std::{
     ffi::{c_void, CString},
     fmt::Display,
+    ops::Deref,
     os::raw::c_int,
     slice,
-    sync::{Arc, Mutex},
+    sync::{
+        mpsc::{channel, Receiver, Sender},
+        Arc, Mutex,
+    },
     thread,
     time::Instant,
 };
@@ -24,6 +38,12 @@ use super::Priority;
 #[cfg(any(windows, target_os = "linux"))]
 use crate::common::Driver;
 
+static ENCODERS: ProbeCache<(EncodeContext, Option<String>)> = ProbeCache::new();
+
+fn encoders_args(ctx: &EncodeContext, sdk: &Option<String>) -> String {
+    format!("{:?} {:?}", ctx, sdk)
+}
+
 #[derive(Debug, Clone, PartialEq)]
 pub struct EncodeContext {
     pub name: String,
@@ -39,6 +59,18 @@ pub struct EncodeContext {
     pub kbs: i32,
     pub q: i32,
     pub thread_count: i32,
+    pub intra_refresh: Option<IntraRefresh>,
+}
+
+/// Renews the picture with a band of intra coded blocks moving across it over
+/// `period` frames instead of sending periodic keyframes, which keeps the
+/// frame size flat. nvenc and libx264 take `period` as their gop and sweep
+/// columns, h264_amf always sweeps rows, qsv follows `direction`. Other
+/// encoders ignore it.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct IntraRefresh {
+    pub period: i32,
+    pub direction: RefreshDirection,
 }
 
 pub struct EncodeFrame {
@@ -53,9 +85,67 @@ impl Display for EncodeFrame {
     }
 }
 
+/// An encoded packet that still lives in the buffer FFmpeg produced it in.
+/// The underlying `AVPacket` is released when this is dropped.
+pub struct EncodePacket {
+    packet: *mut c_void,
+    data: *const u8,
+    len: usize,
+    pub pts: i64,
+    pub key: i32,
+}
+
+unsafe impl Send for EncodePacket {}
+unsafe impl Sync for EncodePacket {}
+
+impl EncodePacket {
+    pub fn data(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl Deref for EncodePacket {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        self.data()
+    }
+}
+
+impl Display for EncodePacket {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "encode len:{}, pts:{}", self.len, self.pts)
+    }
+}
+
+impl Drop for EncodePacket {
+    fn drop(&mut self) {
+        unsafe {
+            ffmpeg_ram_free_packet(self.packet);
+            self.packet = std::ptr::null_mut();
+        }
+    }
+}
+
+/// How [`Encoder::set_rate`] applied a change.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum RateChange {
+    /// Taken by the running encoder.
+    Dynamic,
+    /// The encoder was reopened on the same device, the next frame is a
+    /// keyframe.
+    Reopened,
+}
+
 pub struct Encoder {
     codec: *mut c_void,
     frames: *mut Vec<EncodeFrame>,
+    packets: *mut Vec<EncodePacket>,
+    batch: Vec<RamEncodeEntry>,
+    skipped: bool,
     pub ctx: EncodeContext,
     pub linesize: Vec<i32>,
     pub offset: Vec<i32>,
@@ -94,6 +184,10 @@ impl Encoder {
                 ctx.q,
                 ctx.thread_count,
                 gpu,
+                ctx.intra_refresh.map_or(0, |r| r.period),
+                ctx.intra_refresh
+                    .map_or(RefreshDirection::REFRESH_COLUMNS, |r| r.direction)
+                    as _,
                 linesize.as_mut_ptr(),
                 offset.as_mut_ptr(),
                 length.as_mut_ptr(),
@@ -107,6 +201,9 @@ impl Encoder {
             Ok(Encoder {
                 codec,
                 frames: Box::into_raw(Box::new(Vec::<EncodeFrame>::new())),
+                packets: Box::into_raw(Box::new(Vec::<EncodePacket>::new())),
+                batch: Vec::new(),
+                skipped: false,
                 ctx,
                 linesize,
                 offset,
@@ -125,7 +222,8 @@ impl Encoder {
                 self.frames as *const _ as *const c_void,
                 ms,
             );
-            if result != 0 {
+            self.skipped = result == FFMPEG_RAM_ENCODE_SKIPPED as i32;
+            if result != 0 && !self.skipped {
                 if av_log_get_level() >= AV_LOG_ERROR as _ {
                     error!("Error encode: {}", result);
                 }
@@ -135,6 +233,215 @@ impl Encoder {
         }
     }
 
+    /// Encodes `(data, ms)` frames with a single FFI call and returns the
+    /// packets of all of them.
+    pub fn encode_batch(&mut self, frames: &[(&[u8], i64)]) -> Result<&mut Vec<EncodeFrame>, i32> {
+        self.batch.clear();
+        self.batch
+            .extend(frames.iter().map(|(data, ms)| RamEncodeEntry {
+                data: data.as_ptr(),
+                length: data.len() as _,
+                pts: *ms,
+            }));
+        unsafe {
+            (&mut *self.frames).clear();
+            let result = ffmpeg_ram_encode_batch(
+                self.codec,
+                self.batch.as_ptr(),
+                self.batch.len() as _,
+                self.frames as *const _ as *const c_void,
+            );
+            self.skipped = result == FFMPEG_RAM_ENCODE_SKIPPED as i32;
+            if result != 0 && !self.skipped {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error encode_batch: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(&mut *self.frames)
+        }
+    }
+
+    /// Encodes a packed BGRA or RGBA image of the encoder size, `stride` bytes
+    /// per row. It is converted to the encoder pixfmt (NV12 or YUV420P) with
+    /// SIMD kernels, split over `thread_count` threads.
+    pub fn encode_bgra(
+        &mut self,
+        data: &[u8],
+        stride: usize,
+        format: SurfaceFormat,
+        colorspace: ColorSpace,
+        range: ColorRange,
+        ms: i64,
+    ) -> Result<&mut Vec<EncodeFrame>, i32> {
+        unsafe {
+            (&mut *self.frames).clear();
+            let result = ffmpeg_ram_encode_bgra(
+                self.codec,
+                data.as_ptr(),
+                data.len() as _,
+                stride as _,
+                format as _,
+                colorspace as _,
+                range as _,
+                self.frames as *const _ as *const c_void,
+                ms,
+            );
+            self.skipped = result == FFMPEG_RAM_ENCODE_SKIPPED as i32;
+            if result != 0 && !self.skipped {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error encode_bgra: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(&mut *self.frames)
+        }
+    }
+
+    /// Encodes a frame in the `encode` layout of which only `rects` changed
+    /// since the previous `encode_dirty` call, so only those are copied. The
+    /// first call, and the first one after another encode function, copies
+    /// the whole frame. With `roi`, encoders supporting regions of interest
+    /// spend more bits on the rects.
+    pub fn encode_dirty(
+        &mut self,
+        data: &[u8],
+        rects: &[RamRect],
+        roi: bool,
+        ms: i64,
+    ) -> Result<&mut Vec<EncodeFrame>, i32> {
+        unsafe {
+            (&mut *self.frames).clear();
+            let result = ffmpeg_ram_encode_dirty(
+                self.codec,
+                data.as_ptr(),
+                data.len() as _,
+                rects.as_ptr(),
+                rects.len() as _,
+                roi as _,
+                self.frames as *const _ as *const c_void,
+                ms,
+            );
+            self.skipped = result == FFMPEG_RAM_ENCODE_SKIPPED as i32;
+            if result != 0 && !self.skipped {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error encode_dirty: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(&mut *self.frames)
+        }
+    }
+
+    /// Encodes a frame given as one slice and linesize per plane, such as a
+    /// capture buffer with its own pitch. Planes that already meet the
+    /// encoder's `align` go to the encoder as they are, others are repacked
+    /// first. A negative linesize takes the plane bottom-up, its first row is
+    /// then the last one of the slice.
+    pub fn encode_planes(
+        &mut self,
+        planes: &[&[u8]],
+        linesize: &[i32],
+        ms: i64,
+    ) -> Result<&mut Vec<EncodeFrame>, i32> {
+        let count = match self.ctx.pixfmt {
+            AVPixelFormat::AV_PIX_FMT_NV12 => 2,
+            AVPixelFormat::AV_PIX_FMT_YUV420P => 3,
+            _ => 0,
+        };
+        let width = self.ctx.width as i64;
+        let height = self.ctx.height as i64;
+        let plane = |i: usize| match (i, count) {
+            (0, _) => (width, height),
+            (_, 2) => (2 * ((width + 1) / 2), (height + 1) / 2),
+            _ => ((width + 1) / 2, (height + 1) / 2),
+        };
+        let valid = count > 0
+            && planes.len() >= count
+            && linesize.len() >= count
+            && (0..count).all(|i| {
+                let (bytes, rows) = plane(i);
+                let stride = (linesize[i] as i64).abs();
+                rows > 0
+                    && stride >= bytes
+                    && stride
+                        .checked_mul(rows - 1)
+                        .and_then(|s| s.checked_add(bytes))
+                        .map_or(false, |span| planes[i].len() as i64 >= span)
+            });
+        if !valid {
+            error!(
+                "Error encode_planes: invalid planes for {:?}",
+                self.ctx.pixfmt
+            );
+            return Err(-1);
+        }
+        let mut data = [std::ptr::null::<u8>(); 4];
+        for i in 0..count {
+            data[i] = if linesize[i] < 0 {
+                // checked above to lie within the slice
+                let last_row = (-(linesize[i] as i64) * (plane(i).1 - 1)) as usize;
+                unsafe { planes[i].as_ptr().add(last_row) }
+            } else {
+                planes[i].as_ptr()
+            };
+        }
+        unsafe {
+            (&mut *self.frames).clear();
+            let result = ffmpeg_ram_encode_planes(
+                self.codec,
+                data.as_ptr(),
+                linesize.as_ptr(),
+                self.frames as *const _ as *const c_void,
+                ms,
+            );
+            self.skipped = result == FFMPEG_RAM_ENCODE_SKIPPED as i32;
+            if result != 0 && !self.skipped {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error encode_planes: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(&mut *self.frames)
+        }
+    }
+
+    /// Switches to another size and pixfmt without recreating the encoder.
+    /// The hardware device stays open and the contexts of the last sizes are
+    /// kept, so going back to one of them is nearly free. `linesize`,
+    /// `offset` and `length` describe the new input layout afterwards, and
+    /// the next frame is a keyframe.
+    pub fn reconfigure(
+        &mut self,
+        width: i32,
+        height: i32,
+        pixfmt: AVPixelFormat,
+    ) -> Result<(), ()> {
+        if width % 2 == 1 || height % 2 == 1 {
+            return Err(());
+        }
+        let mut length = 0;
+        let ret = unsafe {
+            ffmpeg_ram_reconfigure(
+                self.codec,
+                width,
+                height,
+                pixfmt as c_int,
+                self.linesize.as_mut_ptr(),
+                self.offset.as_mut_ptr(),
+                &mut length,
+            )
+        };
+        if ret != 0 {
+            return Err(());
+        }
+        self.ctx.width = width;
+        self.ctx.height = height;
+        self.ctx.pixfmt = pixfmt;
+        self.length = length;
+        Ok(())
+    }
+
     extern "C" fn callback(data: *const u8, size: c_int, pts: i64, key: i32, obj: *const c_void) {
         unsafe {
             let frames = &mut *(obj as *mut Vec<EncodeFrame>);
@@ -146,15 +453,130 @@ impl Encoder {
         }
     }
 
+    /// Same as `encode`, but the packets are handed over without being copied.
+    /// Drain the returned vector to keep packets beyond the next call.
+    pub fn encode_packets(&mut self, data: &[u8], ms: i64) -> Result<&mut Vec<EncodePacket>, i32> {
+        unsafe {
+            (&mut *self.packets).clear();
+            let result = ffmpeg_ram_encode_packet(
+                self.codec,
+                (*data).as_ptr(),
+                data.len() as _,
+                self.packets as *const _ as *const c_void,
+                ms,
+                Some(Encoder::packet_callback),
+            );
+            self.skipped = result == FFMPEG_RAM_ENCODE_SKIPPED as i32;
+            if result != 0 && !self.skipped {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error encode: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(&mut *self.packets)
+        }
+    }
+
+    extern "C" fn packet_callback(
+        packet: *mut c_void,
+        data: *const u8,
+        size: c_int,
+        pts: i64,
+        key: i32,
+        obj: *const c_void,
+    ) {
+        unsafe {
+            let packets = &mut *(obj as *mut Vec<EncodePacket>);
+            packets.push(EncodePacket {
+                packet,
+                data,
+                len: size as _,
+                pts,
+                key,
+            });
+        }
+    }
+
+    /// Per stage latency histograms of the frames encoded so far, `None`
+    /// unless built with the `profile` feature. With `reset`, the next
+    /// snapshot only covers frames encoded after this one.
+    pub fn profile(&self, reset: bool) -> Option<Vec<StageHistogram>> {
+        profile_histograms(&ENCODE_STAGES, |stats, count| unsafe {
+            ffmpeg_ram_encode_profile(self.codec, stats, count, reset as _)
+        })
+    }
+
+    /// Opt in to skipping inputs identical to the previous one, for screen
+    /// content that is mostly static. A skipped input returns no packets and
+    /// sets [`Encoder::skipped`]. `encode_dirty` skips when given no rects.
+    pub fn set_skip_unchanged(&mut self, enable: bool) {
+        unsafe { ffmpeg_ram_set_skip_unchanged(self.codec, enable as _) };
+        self.skipped = false;
+    }
+
+    /// Whether the last encode call skipped its input as unchanged. For
+    /// `encode_batch`, whether no entry was encoded because all were skipped.
+    pub fn skipped(&self) -> bool {
+        self.skipped
+    }
+
+    /// Sets the bitrate without reopening the encoder, backends that only read
+    /// it when opening keep the old one. Use [`Encoder::set_rate`] for a change
+    /// that always takes effect.
     pub fn set_bitrate(&mut self, kbs: i32) -> Result<(), ()> {
         let ret = unsafe { ffmpeg_ram_set_bitrate(self.codec, kbs) };
         if ret == 0 {
+            if kbs > 0 {
+                self.ctx.kbs = kbs;
+            }
             Ok(())
         } else {
             Err(())
         }
     }
 
+    /// Changes the bitrate, framerate and gop, a value <= 0 keeps the current
+    /// one. Not available while an [`AsyncEncoder`] runs. With
+    /// `intra_refresh` on nvenc and libx264 the gop is the refresh period and
+    /// can't be changed.
+    pub fn set_rate(&mut self, kbs: i32, fps: i32, gop: i32) -> Result<RateChange, i32> {
+        let ret = unsafe { ffmpeg_ram_set_rate(self.codec, kbs, fps, gop) };
+        if ret < 0 {
+            if unsafe { av_log_get_level() } >= AV_LOG_ERROR as _ {
+                error!("set_rate({}, {}, {}) failed, ret={}", kbs, fps, gop, ret);
+            }
+            return Err(ret);
+        }
+        if kbs > 0 {
+            self.ctx.kbs = kbs;
+        }
+        if fps > 0 {
+            self.ctx.fps = fps;
+        }
+        if gop > 0 {
+            self.ctx.gop = gop;
+        }
+        if ret == FFMPEG_RAM_RATE_REOPENED as i32 {
+            Ok(RateChange::Reopened)
+        } else {
+            Ok(RateChange::Dynamic)
+        }
+    }
+
+    /// Encodes the next frame as an IDR frame, e.g. after the receiver lost
+    /// packets. An unchanged input is not skipped then.
+    pub fn request_keyframe(&mut self) {
+        unsafe { ffmpeg_ram_request_keyframe(self.codec) };
+    }
+
+    pub fn set_framerate(&mut self, fps: i32) -> Result<RateChange, i32> {
+        self.set_rate(0, fps, 0)
+    }
+
+    pub fn set_gop(&mut self, gop: i32) -> Result<RateChange, i32> {
+        self.set_rate(0, 0, gop)
+    }
+
     pub fn format_from_name(name: String) -> Result<DataFormat, ()> {
         if name.contains("h264") {
             return Ok(H264);
@@ -170,17 +592,28 @@ impl Encoder {
         Err(())
     }
 
+    /// Probes the encoders usable with `ctx`. Results are cached per context
+    /// and sdk, so this can be called from any thread; concurrent callers with
+    /// the same arguments share a single probe.
     pub fn available_encoders(ctx: EncodeContext, sdk: Option<String>) -> Vec<CodecInfo> {
-        static mut INSTANCE: Vec<CodecInfo> = vec![];
-        static mut CACHED_CTX: Option<EncodeContext> = None;
+        let key = (ctx, sdk);
+        ENCODERS.get_or_probe(&key, || {
+            let (ctx, sdk) = key.clone();
+            let args = encoders_args(&ctx, &sdk);
+            cache::get_or_probe(cache::ENCODERS_FILE, args, || {
+                Encoder::available_encoders_(ctx, sdk)
+            })
+        })
+    }
 
-        unsafe {
-            if CACHED_CTX.clone().take() != Some(ctx.clone()) {
-                CACHED_CTX = Some(ctx.clone());
-                INSTANCE = Encoder::available_encoders_(ctx, sdk);
-            }
-            INSTANCE.clone()
-        }
+    /// Drops the cached probe results of `ctx`, or of every context if `None`,
+    /// including the entries of the on-disk cache.
+    pub fn invalidate_available_encoders(ctx: Option<&EncodeContext>) {
+        ENCODERS.invalidate(|(c, _)| ctx.map_or(true, |ctx| c == ctx));
+        let prefix = ctx.map(|ctx| format!("{:?} ", ctx));
+        cache::remove(cache::ENCODERS_FILE, |args| {
+            prefix.as_ref().map_or(true, |p| args.starts_with(p))
+        });
     }
 
     fn available_encoders_(ctx: EncodeContext, _sdk: Option<String>) -> Vec<CodecInfo> {
@@ -387,7 +820,288 @@ impl Drop for Encoder {
             ffmpeg_ram_free_encoder(self.codec);
             self.codec = std::ptr::null_mut();
             let _ = Box::from_raw(self.frames);
+            let _ = Box::from_raw(self.packets);
             trace!("Encoder dropped");
         }
     }
 }
+
+/// Pipelined encoder. `submit` returns once the frame is copied into one of
+/// `depth` in-flight slots, so capturing the next frame overlaps encoding of
+/// this one. Packets are delivered on `receiver` from the encode thread.
+pub struct AsyncEncoder {
+    encoder: Encoder,
+    sender: *mut Sender<EncodePacket>,
+    receiver: Receiver<EncodePacket>,
+}
+
+unsafe impl Send for AsyncEncoder {}
+
+impl AsyncEncoder {
+    pub fn new(ctx: EncodeContext, depth: usize) -> Result<Self, ()> {
+        let encoder = Encoder::new(ctx)?;
+        let (sender, receiver) = channel();
+        let sender = Box::into_raw(Box::new(sender));
+        unsafe {
+            let ret = ffmpeg_ram_encode_start_async(
+                encoder.codec,
+                depth as _,
+                Some(AsyncEncoder::callback),
+                sender as *const c_void,
+            );
+            if ret != 0 {
+                let _ = Box::from_raw(sender);
+                return Err(());
+            }
+        }
+        Ok(AsyncEncoder {
+            encoder,
+            sender,
+            receiver,
+        })
+    }
+
+    /// Queue a frame for encoding. Fails with an error for which `is_again`
+    /// holds when all slots are in flight; receive packets and retry.
+    pub fn submit(&mut self, data: &[u8], ms: i64) -> Result<(), i32> {
+        let result = unsafe {
+            ffmpeg_ram_encode_submit(self.encoder.codec, data.as_ptr(), data.len() as _, ms)
+        };
+        if result != 0 {
+            if !is_again(result) && unsafe { av_log_get_level() } >= AV_LOG_ERROR as _ {
+                error!("Error submit: {}", result);
+            }
+            return Err(result);
+        }
+        Ok(())
+    }
+
+    /// The next submitted frame is encoded as an IDR frame.
+    pub fn request_keyframe(&mut self) {
+        self.encoder.request_keyframe();
+    }
+
+    pub fn receiver(&self) -> &Receiver<EncodePacket> {
+        &self.receiver
+    }
+
+    /// Block until every submitted frame has been handed to the encoder and
+    /// the packets it returned so far were sent to the receiver. Frames the
+    /// encoder still buffers come out with later ones.
+    pub fn flush(&mut self) {
+        unsafe { ffmpeg_ram_encode_flush_async(self.encoder.codec) };
+    }
+
+    pub fn encoder(&self) -> &Encoder {
+        &self.encoder
+    }
+
+    extern "C" fn callback(
+        packet: *mut c_void,
+        data: *const u8,
+        size: c_int,
+        pts: i64,
+        key: i32,
+        obj: *const c_void,
+    ) {
+        unsafe {
+            let sender = &*(obj as *const Sender<EncodePacket>);
+            // a failed send drops and frees the packet
+            let _ = sender.send(EncodePacket {
+                packet,
+                data,
+                len: size as _,
+                pts,
+                key,
+            });
+        }
+    }
+}
+
+impl Drop for AsyncEncoder {
+    fn drop(&mut self) {
+        unsafe {
+            ffmpeg_ram_encode_stop_async(self.encoder.codec);
+            let _ = Box::from_raw(self.sender);
+            trace!("AsyncEncoder dropped");
+        }
+    }
+}
+
+/// Resolution and bitrate of one layer of an [`EncoderGroup`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct EncodeLayer {
+    pub width: i32,
+    pub height: i32,
+    pub kbs: i32,
+}
+
+/// A packet of an [`EncoderGroup`], `layer` indexes the group's layers.
+pub struct LayerPacket {
+    pub layer: usize,
+    pub packet: EncodePacket,
+}
+
+/// Simulcast encoder. One input of `ctx.width` x `ctx.height` is scaled once
+/// per layer and all layers are encoded in parallel. `ctx.kbs` is unused, each
+/// layer has its own bitrate.
+pub struct EncoderGroup {
+    codec: *mut c_void,
+    packets: *mut Vec<LayerPacket>,
+    pub ctx: EncodeContext,
+    pub layers: Vec<EncodeLayer>,
+    pub linesize: Vec<i32>,
+    pub offset: Vec<i32>,
+    pub length: i32,
+}
+
+unsafe impl Send for EncoderGroup {}
+
+impl EncoderGroup {
+    pub fn new(ctx: EncodeContext, layers: Vec<EncodeLayer>) -> Result<Self, ()> {
+        if ctx.width % 2 == 1
+            || ctx.height % 2 == 1
+            || layers.is_empty()
+            || layers.iter().any(|l| l.width % 2 == 1 || l.height % 2 == 1)
+        {
+            return Err(());
+        }
+        let raw: Vec<RamEncodeLayer> = layers
+            .iter()
+            .map(|l| RamEncodeLayer {
+                width: l.width,
+                height: l.height,
+                kbs: l.kbs,
+            })
+            .collect();
+        let mut linesize = vec![0i32; AV_NUM_DATA_POINTERS as _];
+        let mut offset = vec![0i32; AV_NUM_DATA_POINTERS as _];
+        let mut length = 0i32;
+        let gpu = std::env::var("RUSTDESK_HWCODEC_NVENC_GPU")
+            .unwrap_or("-1".to_owned())
+            .parse()
+            .unwrap_or(-1);
+        let mc_name = ctx.mc_name.clone().unwrap_or_default();
+        unsafe {
+            let codec = ffmpeg_ram_new_encoder_group(
+                CString::new(ctx.name.as_str()).map_err(|_| ())?.as_ptr(),
+                CString::new(mc_name.as_str()).map_err(|_| ())?.as_ptr(),
+                ctx.width,
+                ctx.height,
+                ctx.pixfmt as c_int,
+                ctx.align,
+                ctx.fps,
+                ctx.gop,
+                ctx.rc as _,
+                ctx.quality as _,
+                ctx.q,
+                ctx.thread_count,
+                gpu,
+                ctx.intra_refresh.map_or(0, |r| r.period),
+                ctx.intra_refresh
+                    .map_or(RefreshDirection::REFRESH_COLUMNS, |r| r.direction)
+                    as _,
+                raw.as_ptr(),
+                raw.len() as _,
+                linesize.as_mut_ptr(),
+                offset.as_mut_ptr(),
+                &mut length,
+            );
+            if codec.is_null() {
+                return Err(());
+            }
+            Ok(EncoderGroup {
+                codec,
+                packets: Box::into_raw(Box::new(Vec::<LayerPacket>::new())),
+                ctx,
+                layers,
+                linesize,
+                offset,
+                length,
+            })
+        }
+    }
+
+    /// Encodes `data`, laid out as described by `linesize` / `offset`, on
+    /// every layer. The packets are handed over without being copied, in
+    /// layer order.
+    pub fn encode(&mut self, data: &[u8], ms: i64) -> Result<&mut Vec<LayerPacket>, i32> {
+        unsafe {
+            (&mut *self.packets).clear();
+            let result = ffmpeg_ram_encode_group(
+                self.codec,
+                data.as_ptr(),
+                data.len() as _,
+                self.packets as *const _ as *const c_void,
+                ms,
+                Some(EncoderGroup::callback),
+            );
+            if result != 0 {
+                if av_log_get_level() >= AV_LOG_ERROR as _ {
+                    error!("Error encode group: {}", result);
+                }
+                return Err(result);
+            }
+            Ok(&mut *self.packets)
+        }
+    }
+
+    pub fn set_bitrate(&mut self, layer: usize, kbs: i32) -> Result<(), ()> {
+        let ret = unsafe { ffmpeg_ram_group_set_bitrate(self.codec, layer as _, kbs) };
+        if ret == 0 {
+            if let Some(l) = self.layers.get_mut(layer) {
+                l.kbs = kbs;
+            }
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    /// Encodes the next frame of `layer`, or of every layer with `None`, as an
+    /// IDR frame.
+    pub fn request_keyframe(&mut self, layer: Option<usize>) -> Result<(), ()> {
+        let layer = layer.map_or(-1, |l| l as i32);
+        let ret = unsafe { ffmpeg_ram_group_request_keyframe(self.codec, layer) };
+        if ret == 0 {
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    extern "C" fn callback(
+        packet: *mut c_void,
+        layer: c_int,
+        data: *const u8,
+        size: c_int,
+        pts: i64,
+        key: i32,
+        obj: *const c_void,
+    ) {
+        unsafe {
+            let packets = &mut *(obj as *mut Vec<LayerPacket>);
+            packets.push(LayerPacket {
+                layer: layer as _,
+                packet: EncodePacket {
+                    packet,
+                    data,
+                    len: size as _,
+                    pts,
+                    key,
+                },
+            });
+        }
+    }
+}
+
+impl Drop for EncoderGroup {
+    fn drop(&mut self) {
+        unsafe {
+            ffmpeg_ram_free_encoder_group(self.codec);
+            self.codec = std::ptr::null_mut();
+            let _ = Box::from_raw(self.packets);
+            trace!("EncoderGroup dropped");
+        }
+    }
+}
@@ -12,6 +12,7 @@ use std::ffi::c_int;
 
 include!(concat!(env!("OUT_DIR"), "/ffmpeg_ram_ffi.rs"));
 
+pub mod cache;
 pub mod decode;
 pub mod encode;
 
@@ -183,3 +184,8 @@ pub fn ffmpeg_linesize_offset_length(
 
     Err(())
 }
+
+/// Whether an error returned by a non-blocking call means "try again later".
+pub fn is_again(err: i32) -> bool {
+    err == unsafe { ffmpeg_ram_error_again() }
+}
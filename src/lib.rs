@@ -1,26 +1,41 @@
+pub mod color;
 pub mod common;
+pub mod demux;
 pub mod ffmpeg;
 pub mod ffmpeg_ram;
 pub mod mux;
+pub mod nal;
 #[cfg(all(windows, feature = "vram"))]
 pub mod vram;
 #[cfg(target_os = "android")]
 pub mod android;
 
+fn log_level(level: i32) -> Option<log::Level> {
+    match level {
+        0 => Some(log::Level::Error),
+        1 => Some(log::Level::Warn),
+        2 => Some(log::Level::Info),
+        3 => Some(log::Level::Debug),
+        4 => Some(log::Level::Trace),
+        _ => None,
+    }
+}
+
 #[no_mangle]
 pub extern "C" fn hwcodec_log(level: i32, message: *const std::os::raw::c_char) {
     unsafe {
         let c_str = std::ffi::CStr::from_ptr(message);
-        if let Ok(str_slice) = c_str.to_str() {
-            let string = String::from(str_slice);
-            match level {
-                0 => log::error!("{}", string),
-                1 => log::warn!("{}", string),
-                2 => log::info!("{}", string),
-                3 => log::debug!("{}", string),
-                4 => log::trace!("{}", string),
-                _ => {}
-            }
+        if let (Some(level), Ok(str_slice)) = (log_level(level), c_str.to_str()) {
+            log::log!(level, "{}", str_slice);
         }
     }
 }
+
+/// Lets the C++ side skip formatting messages that would be filtered out.
+#[no_mangle]
+pub extern "C" fn hwcodec_log_enabled(level: i32) -> i32 {
+    match log_level(level) {
+        Some(level) => log::log_enabled!(level) as i32,
+        None => 0,
+    }
+}
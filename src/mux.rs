@@ -6,10 +6,16 @@ include!(concat!(env!("OUT_DIR"), "/mux_ffi.rs"));
 
 use log::{error, trace};
 
-use crate::ffmpeg::{av_log_get_level, AV_LOG_ERROR};
+use crate::{
+    common::{profile_histograms, StageHistogram, MUX_STAGES},
+    ffmpeg::{av_log_get_level, AV_LOG_ERROR},
+};
 use std::{
     ffi::{c_void, CString},
-    time::Instant,
+    io::Write,
+    os::raw::c_int,
+    slice,
+    time::{Duration, Instant},
 };
 
 #[derive(Debug, Clone, PartialEq)]
@@ -21,10 +27,22 @@ pub struct MuxContext {
     pub framerate: usize,
 }
 
+/// Splits a recording into files named after `filename` with a running
+/// `-00000` index. A segment ends at the first keyframe after `duration_ms`
+/// or `bytes`, whichever is reached first, 0 disables either limit. With
+/// `keep` > 0 only the last `keep` files are kept on disk.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Segmenting {
+    pub duration_ms: usize,
+    pub bytes: u64,
+    pub keep: usize,
+}
+
 pub struct Muxer {
     inner: *mut c_void,
     pub ctx: MuxContext,
     start: Instant,
+    dropped: bool,
 }
 
 unsafe impl Send for Muxer {}
@@ -32,6 +50,15 @@ unsafe impl Sync for Muxer {}
 
 impl Muxer {
     pub fn new(ctx: MuxContext) -> Result<Self, ()> {
+        Self::open(ctx, None)
+    }
+
+    /// Records into a series of files instead of one, see [`Segmenting`].
+    pub fn new_segmented(ctx: MuxContext, segmenting: Segmenting) -> Result<Self, ()> {
+        Self::open(ctx, Some(segmenting))
+    }
+
+    fn open(ctx: MuxContext, segmenting: Option<Segmenting>) -> Result<Self, ()> {
         unsafe {
             let inner = hwcodec_new_muxer(
                 CString::new(ctx.filename.as_str())
@@ -41,6 +68,9 @@ impl Muxer {
                 ctx.height as _,
                 if ctx.is265 { 1 } else { 0 },
                 ctx.framerate as _,
+                segmenting.map_or(0, |s| s.duration_ms as _),
+                segmenting.map_or(0, |s| s.bytes as _),
+                segmenting.map_or(0, |s| s.keep as _),
             );
             if inner.is_null() {
                 return Err(());
@@ -50,49 +80,264 @@ impl Muxer {
                 inner,
                 ctx,
                 start: Instant::now(),
+                dropped: false,
             })
         }
     }
 
     pub fn write_video(&mut self, data: &[u8], key: bool) -> Result<(), i32> {
+        self.dropped = write_video(self.inner, self.start, data, key)?;
+        Ok(())
+    }
+
+    /// Writes on a background thread from now on, see [`MuxQueuePolicy`] for
+    /// what happens once `depth` packets are waiting.
+    pub fn start_async(&mut self, depth: usize, policy: MuxQueuePolicy) -> Result<(), i32> {
+        start_async(self.inner, depth, policy)
+    }
+
+    /// Whether the async queue dropped the last packet, the following ones
+    /// are dropped up to the next keyframe.
+    pub fn dropped(&self) -> bool {
+        self.dropped
+    }
+
+    /// Blocks until every queued packet is written.
+    pub fn flush(&mut self) {
+        unsafe { hwcodec_muxer_flush(self.inner) };
+    }
+
+    pub fn queue_stats(&self, reset: bool) -> Option<QueueStats> {
+        queue_stats(self.inner, reset)
+    }
+
+    /// Per stage latency histograms, `None` unless built with the `profile`
+    /// feature.
+    pub fn profile(&self, reset: bool) -> Option<Vec<StageHistogram>> {
+        profile_histograms(&MUX_STAGES, |stats, count| unsafe {
+            hwcodec_muxer_profile(self.inner, stats, count, reset as _)
+        })
+    }
+
+    pub fn write_tail(&mut self) -> Result<(), i32> {
+        write_tail(self.inner)
+    }
+}
+
+// Ok(true) for a packet dropped by the async queue
+fn write_video(inner: *mut c_void, start: Instant, data: &[u8], key: bool) -> Result<bool, i32> {
+    unsafe {
+        let result = hwcodec_write_video_frame(
+            inner,
+            (*data).as_ptr(),
+            data.len() as _,
+            start.elapsed().as_millis() as _,
+            if key { 1 } else { 0 },
+        );
+        if result == MUX_FRAME_DROPPED as i32 {
+            return Ok(true);
+        }
+        if result != 0 {
+            if av_log_get_level() >= AV_LOG_ERROR as _ {
+                error!("Error write_video: {}", result);
+            }
+            return Err(result);
+        }
+        Ok(false)
+    }
+}
+
+fn start_async(inner: *mut c_void, depth: usize, policy: MuxQueuePolicy) -> Result<(), i32> {
+    let result = unsafe { hwcodec_muxer_start_async(inner, depth as _, policy as _) };
+    if result != 0 {
+        if unsafe { av_log_get_level() } >= AV_LOG_ERROR as _ {
+            error!("Error start_async: {}", result);
+        }
+        return Err(result);
+    }
+    Ok(())
+}
+
+fn queue_stats(inner: *mut c_void, reset: bool) -> Option<QueueStats> {
+    let mut stats: MuxQueueStats = unsafe { std::mem::zeroed() };
+    if unsafe { hwcodec_muxer_queue_stats(inner, &mut stats, reset as _) } != 0 {
+        return None;
+    }
+    let avg = |total: i64| {
+        if stats.written > 0 {
+            Duration::from_nanos((total / stats.written) as _)
+        } else {
+            Duration::ZERO
+        }
+    };
+    Some(QueueStats {
+        depth: stats.depth as _,
+        max_depth: stats.max_depth as _,
+        capacity: stats.capacity as _,
+        written: stats.written as _,
+        dropped: stats.dropped as _,
+        write_avg: avg(stats.write_ns),
+        write_max: Duration::from_nanos(stats.write_max_ns as _),
+        latency_avg: avg(stats.latency_ns),
+        latency_max: Duration::from_nanos(stats.latency_max_ns as _),
+    })
+}
+
+/// Async writer counters since the last reset. `write` is the time spent
+/// muxing and flushing a packet, `latency` the time from submit until then.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct QueueStats {
+    pub depth: usize,
+    pub max_depth: usize,
+    pub capacity: usize,
+    pub written: u64,
+    pub dropped: u64,
+    pub write_avg: Duration,
+    pub write_max: Duration,
+    pub latency_avg: Duration,
+    pub latency_max: Duration,
+}
+
+fn write_tail(inner: *mut c_void) -> Result<(), i32> {
+    unsafe {
+        let result = hwcodec_write_tail(inner);
+        if result != 0 {
+            if av_log_get_level() >= AV_LOG_ERROR as _ {
+                error!("Error write_tail: {}", result);
+            }
+            return Err(result);
+        }
+        Ok(())
+    }
+}
+
+impl Drop for Muxer {
+    fn drop(&mut self) {
+        unsafe {
+            hwcodec_free_muxer(self.inner);
+            self.inner = std::ptr::null_mut();
+            trace!("Muxer dropped");
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct StreamContext {
+    pub format: MuxFormat,
+    pub width: usize,
+    pub height: usize,
+    pub is265: bool,
+    pub framerate: usize,
+    /// Longest fragment (mp4) or cluster (matroska), 0 for one second.
+    pub fragment_ms: usize,
+    /// Size of the write buffer, 0 for 1 MiB.
+    pub buffer_size: usize,
+}
+
+type StreamWriter = Box<dyn Write + Send>;
+
+/// A [`Muxer`] that writes a fragmented mp4 or a matroska stream to a
+/// [`Write`] instead of a file, so a recording can be uploaded while it runs
+/// and survives a crash up to the last fragment. The writer is called with
+/// whole buffers from inside `write_video` and `write_tail`.
+pub struct StreamMuxer {
+    inner: *mut c_void,
+    writer: *mut StreamWriter,
+    pub ctx: StreamContext,
+    start: Instant,
+    dropped: bool,
+}
+
+unsafe impl Send for StreamMuxer {}
+
+impl StreamMuxer {
+    pub fn new<W: Write + Send + 'static>(ctx: StreamContext, writer: W) -> Result<Self, ()> {
         unsafe {
-            let result = hwcodec_write_video_frame(
-                self.inner,
-                (*data).as_ptr(),
-                data.len() as _,
-                self.start.elapsed().as_millis() as _,
-                if key { 1 } else { 0 },
+            let writer: *mut StreamWriter = Box::into_raw(Box::new(Box::new(writer)));
+            let inner = hwcodec_new_stream_muxer(
+                ctx.format as _,
+                ctx.width as _,
+                ctx.height as _,
+                if ctx.is265 { 1 } else { 0 },
+                ctx.framerate as _,
+                ctx.fragment_ms as _,
+                ctx.buffer_size as _,
+                Some(StreamMuxer::write),
+                writer as *const c_void,
             );
-            if result != 0 {
-                if av_log_get_level() >= AV_LOG_ERROR as _ {
-                    error!("Error write_video: {}", result);
-                }
-                return Err(result);
+            if inner.is_null() {
+                drop(Box::from_raw(writer));
+                return Err(());
             }
-            Ok(())
+
+            Ok(StreamMuxer {
+                inner,
+                writer,
+                ctx,
+                start: Instant::now(),
+                dropped: false,
+            })
         }
     }
 
+    /// The first frame must be a keyframe carrying the parameter sets.
+    pub fn write_video(&mut self, data: &[u8], key: bool) -> Result<(), i32> {
+        self.dropped = write_video(self.inner, self.start, data, key)?;
+        Ok(())
+    }
+
+    /// As [`Muxer::start_async`], the writer is then called on the
+    /// background thread.
+    pub fn start_async(&mut self, depth: usize, policy: MuxQueuePolicy) -> Result<(), i32> {
+        start_async(self.inner, depth, policy)
+    }
+
+    pub fn dropped(&self) -> bool {
+        self.dropped
+    }
+
+    pub fn flush(&mut self) {
+        unsafe { hwcodec_muxer_flush(self.inner) };
+    }
+
+    pub fn queue_stats(&self, reset: bool) -> Option<QueueStats> {
+        queue_stats(self.inner, reset)
+    }
+
+    pub fn profile(&self, reset: bool) -> Option<Vec<StageHistogram>> {
+        profile_histograms(&MUX_STAGES, |stats, count| unsafe {
+            hwcodec_muxer_profile(self.inner, stats, count, reset as _)
+        })
+    }
+
     pub fn write_tail(&mut self) -> Result<(), i32> {
+        write_tail(self.inner)?;
+        unsafe { (*self.writer).flush() }.map_err(|_| -1)
+    }
+
+    extern "C" fn write(data: *const u8, len: c_int, obj: *const c_void) -> c_int {
         unsafe {
-            let result = hwcodec_write_tail(self.inner);
-            if result != 0 {
-                if av_log_get_level() >= AV_LOG_ERROR as _ {
-                    error!("Error write_tail: {}", result);
+            let writer = &mut *(obj as *mut StreamWriter);
+            match writer.write_all(slice::from_raw_parts(data, len as usize)) {
+                Ok(()) => 0,
+                Err(e) => {
+                    if av_log_get_level() >= AV_LOG_ERROR as _ {
+                        error!("stream muxer write failed: {}", e);
+                    }
+                    -1
                 }
-                return Err(result);
             }
-            Ok(())
         }
     }
 }
 
-impl Drop for Muxer {
+impl Drop for StreamMuxer {
     fn drop(&mut self) {
         unsafe {
             hwcodec_free_muxer(self.inner);
             self.inner = std::ptr::null_mut();
-            trace!("Muxer dropped");
+            drop(Box::from_raw(self.writer));
+            trace!("StreamMuxer dropped");
         }
     }
 }
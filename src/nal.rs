@@ -0,0 +1,214 @@
+#![allow(non_upper_case_globals)]
+#![allow(non_camel_case_types)]
+#![allow(non_snake_case)]
+
+include!(concat!(env!("OUT_DIR"), "/nal_ffi.rs"));
+
+use log::trace;
+
+use std::{ffi::c_void, slice};
+
+/// A NAL unit of an Annex-B buffer, from its header up to the next start
+/// code.
+#[derive(Debug, Clone, Copy)]
+pub struct Unit<'a> {
+    pub data: &'a [u8],
+    /// nal_unit_type
+    pub kind: i32,
+    /// h264 IDR, hevc IDR / CRA / BLA: decoding can start here
+    pub key: bool,
+    /// h264 SPS / PPS, hevc VPS / SPS / PPS
+    pub parameter_set: bool,
+}
+
+/// Iterates the NAL units of an Annex-B buffer without copying them.
+pub struct Units<'a> {
+    data: &'a [u8],
+    pos: i32,
+    is265: bool,
+}
+
+pub fn units(data: &[u8], is265: bool) -> Units<'_> {
+    Units {
+        data,
+        pos: 0,
+        is265,
+    }
+}
+
+impl<'a> Iterator for Units<'a> {
+    type Item = Unit<'a>;
+
+    fn next(&mut self) -> Option<Unit<'a>> {
+        unsafe {
+            let mut unit: NalUnit = std::mem::zeroed();
+            if hwcodec_nal_next(
+                self.data.as_ptr(),
+                self.data.len() as _,
+                &mut self.pos,
+                self.is265 as _,
+                &mut unit,
+            ) != 1
+            {
+                return None;
+            }
+            Some(Unit {
+                data: slice::from_raw_parts(
+                    self.data.as_ptr().add(unit.offset as _),
+                    unit.length as _,
+                ),
+                kind: unit.type_,
+                key: unit.key == 1,
+                parameter_set: unit.parameter_set == 1,
+            })
+        }
+    }
+}
+
+/// The cropped picture size an SPS unit declares, header included.
+pub fn sps_resolution(sps: &[u8], is265: bool) -> Option<(usize, usize)> {
+    let (mut width, mut height) = (0, 0);
+    let result = unsafe {
+        hwcodec_nal_sps_resolution(
+            sps.as_ptr(),
+            sps.len() as _,
+            is265 as _,
+            &mut width,
+            &mut height,
+        )
+    };
+    if result != 0 {
+        return None;
+    }
+    Some((width as _, height as _))
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct Summary {
+    pub units: usize,
+    pub key: bool,
+    pub parameter_sets: bool,
+    /// A parameter set is new or differs from the last one of its type.
+    pub changed: bool,
+    /// From the last SPS seen, `None` before the first one.
+    pub resolution: Option<(usize, usize)>,
+}
+
+/// Follows the parameter sets of a stream, so packets can be routed or
+/// dropped and resolution changes noticed without a decoder.
+pub struct Parser {
+    inner: *mut c_void,
+    pub is265: bool,
+}
+
+unsafe impl Send for Parser {}
+
+impl Parser {
+    pub fn new(is265: bool) -> Result<Self, ()> {
+        let inner = unsafe { hwcodec_new_nal_parser(is265 as _) };
+        if inner.is_null() {
+            return Err(());
+        }
+        Ok(Parser { inner, is265 })
+    }
+
+    pub fn parse(&mut self, data: &[u8]) -> Summary {
+        unsafe {
+            let mut summary: NalSummary = std::mem::zeroed();
+            if hwcodec_nal_parse(self.inner, data.as_ptr(), data.len() as _, &mut summary) != 0 {
+                return Summary::default();
+            }
+            Summary {
+                units: summary.units as _,
+                key: summary.key == 1,
+                parameter_sets: summary.parameter_sets == 1,
+                changed: summary.changed == 1,
+                resolution: if summary.width > 0 && summary.height > 0 {
+                    Some((summary.width as _, summary.height as _))
+                } else {
+                    None
+                },
+            }
+        }
+    }
+
+    /// Forgets the parameter sets seen so far.
+    pub fn reset(&mut self) {
+        unsafe { hwcodec_nal_reset(self.inner) };
+    }
+}
+
+impl Drop for Parser {
+    fn drop(&mut self) {
+        unsafe {
+            hwcodec_free_nal_parser(self.inner);
+            self.inner = std::ptr::null_mut();
+            trace!("Parser dropped");
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::common::{DATA_H264_720P, DATA_H265_720P};
+
+    fn kinds(data: &[u8], is265: bool) -> Vec<i32> {
+        units(data, is265).map(|u| u.kind).collect()
+    }
+
+    #[test]
+    fn sample_resolution() {
+        for (data, is265) in [(DATA_H264_720P, false), (DATA_H265_720P, true)] {
+            let mut sps = 0;
+            for unit in units(data, is265) {
+                let is_sps = if is265 {
+                    unit.kind == 33
+                } else {
+                    unit.kind == 7
+                };
+                if is_sps {
+                    sps += 1;
+                    assert_eq!(sps_resolution(unit.data, is265), Some((1280, 720)));
+                    let mut padded = unit.data.to_vec();
+                    padded.extend([0, 0, 0]);
+                    assert_eq!(sps_resolution(&padded, is265), Some((1280, 720)));
+                }
+            }
+            assert!(sps > 0);
+            let summary = Parser::new(is265).unwrap().parse(data);
+            assert!(summary.key && summary.parameter_sets && summary.changed);
+            assert_eq!(summary.resolution, Some((1280, 720)));
+        }
+        assert_eq!(kinds(DATA_H264_720P, false), [7, 8, 6, 6, 5]);
+        assert_eq!(kinds(DATA_H265_720P, true), [32, 33, 34, 39, 19]);
+    }
+
+    #[test]
+    fn start_codes() {
+        // 4 byte start code, 3 byte start code, 4 byte start code
+        let data = [
+            0, 0, 0, 1, 0x67, 1, 2, 0, 0, 1, 0x68, 3, 0, 0, 0, 1, 0x65, 4, 5,
+        ];
+        let units: Vec<Unit> = units(&data, false).collect();
+        assert_eq!(units.len(), 3);
+        assert_eq!(units[0].data, &[0x67, 1, 2]);
+        assert_eq!(units[1].data, &[0x68, 3]);
+        assert_eq!(units[2].data, &[0x65, 4, 5]);
+        assert!(units[0].parameter_set && units[1].parameter_set);
+        assert!(units[2].key && !units[2].parameter_set);
+    }
+
+    #[test]
+    fn trailing_zeros() {
+        // zeros before a start code and at the end of the buffer aren't data
+        let data = [0, 0, 1, 0x06, 7, 0, 0, 0, 0, 0, 1, 0x01, 8, 0, 0];
+        let units: Vec<Unit> = units(&data, false).collect();
+        assert_eq!(units.len(), 2);
+        assert_eq!(units[0].data, &[0x06, 7]);
+        assert_eq!(units[1].data, &[0x01, 8]);
+        assert_eq!(kinds(&data, false), [6, 1]);
+        assert!(kinds(&[], false).is_empty());
+        assert!(kinds(&[0, 0, 0, 0], false).is_empty());
+    }
+}